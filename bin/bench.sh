@@ -0,0 +1,316 @@
+#!/bin/bash
+
+# Benchmark sharded paths of the cluster through the coordinator.
+#
+# Each workload is run under each config, i.e. pgParameters patch applied
+# with 'shardmanctl update', and one JSON object per run is appended to
+# $BENCH_OUT:
+#   {"workload": "transfer", "config": "global_snapshots_on", "revision": ...,
+#    "clients": 8, "duration_s": 60, "transactions": 12345, "tps": 205.7,
+#    "latency_ms": {"avg": ..., "p50": ..., "p99": ...}, "aborted_clients": 0,
+#    "fdw": {...}}
+# "fdw" are deltas of shardman.fdw_server_stats() counters of the coordinator
+# over the run (round trips, waiting, 2PC phases), null if shardman is not in
+# shared_preload_libraries. Raw pgbench output goes to ${BENCH_OUT%.*}.log.
+#
+# Usage: bench.sh [workload...]
+# Workloads:
+#   point_write   single-shard point updates
+#   transfer      cross-shard transfers between two accounts, committed with 2PC
+#   fanout_agg    aggregate over all partitions, rows fetched by coordinator
+#   pushdown_agg  same aggregate pushed down to repgroups
+#   copy_ingest   COPY into sharded table through the coordinator
+#   rebalance     transfer while repgroup $BENCH_REBALANCE_RG is removed, added
+#                 back and the cluster is rebalanced
+# By default all of them are run; rebalance is skipped without
+# BENCH_REBALANCE_RG.
+#
+# Cluster is addressed with the usual libpq PG* variables (coordinator, e.g.
+# proxy) and HPCTL_* variables of shardmanctl; see defaults below.
+
+set -e
+
+script_dir=`dirname "$(readlink -f "$0")"`
+bench_dir="${script_dir}/bench"
+
+export HPCTL_CLUSTER_NAME="${HPCTL_CLUSTER_NAME:-haha}"
+export HPCTL_STORE_ENDPOINTS="${HPCTL_STORE_ENDPOINTS:-localhost:2379}"
+export PGHOST="${PGHOST:-localhost}"
+export PGPORT="${PGPORT:-5432}"
+export PGDATABASE="${PGDATABASE:-postgres}"
+
+# names of json files in bin/ with pgParameters patches
+configs="${BENCH_CONFIGS:-global_snapshots_on global_snapshots_off}"
+clients=${BENCH_CLIENTS:-8}
+threads=${BENCH_THREADS:-4}
+duration=${BENCH_DURATION:-60}
+naccounts=${BENCH_ACCOUNTS:-100000}
+nparts=${BENCH_PARTS:-30}
+copy_clients=${BENCH_COPY_CLIENTS:-4}
+copy_batches=${BENCH_COPY_BATCHES:-50}
+copy_rows=${BENCH_COPY_ROWS:-10000}
+rebalance_rg="${BENCH_REBALANCE_RG:-}"
+# extra options of 'shardmanctl addrepgroup', e.g. stolon store endpoints
+rebalance_rg_opts="${BENCH_REBALANCE_RG_OPTS:-}"
+# how long to wait for config to take effect
+config_timeout=${BENCH_CONFIG_TIMEOUT:-120}
+out="${BENCH_OUT:-${PWD}/bench_results.jsonl}"
+logfile="${out%.*}.log"
+
+workloads="$@"
+if [ -z "${workloads}" ]; then
+    workloads="point_write transfer fanout_agg pushdown_agg copy_ingest rebalance"
+fi
+
+revision=`git -C "${script_dir}" rev-parse --short HEAD 2>/dev/null || echo unknown`
+tmpdir=`mktemp -d`
+trap 'rm -rf "${tmpdir}"' EXIT
+
+function psql_c()
+{
+    psql -X -q -v ON_ERROR_STOP=1 -tA -c "$1"
+}
+
+# Execute sql on all repgroups for each local (not foreign) partition of
+# table $1, substituting its name for %I in $2
+function forall_local_parts()
+{
+    shardmanctl forall --sql "set shardman.broadcast_utility = off;
+do \$\$
+declare
+  r record;
+begin
+  for r in select c.relname from pg_inherits i join pg_class c on c.oid = i.inhrelid
+      where i.inhparent = '$1'::regclass and c.relkind = 'r' loop
+    execute format('$2', r.relname);
+  end loop;
+end \$\$;"
+}
+
+# Apply config and wait until coordinator runs with it; track_global_snapshots
+# needs restart, so the cluster spec must allow automatic restarts.
+function apply_config()
+{
+    local file="${script_dir}/$1.json"
+    local expected=`sed -n 's/.*"track_global_snapshots": *"\([a-z]*\)".*/\1/p' "${file}"`
+    local waited=0
+
+    echo "applying config $1"
+    shardmanctl update --patch -f "${file}"
+    [ -z "${expected}" ] && return 0
+    while [ "`psql_c 'show track_global_snapshots' 2>/dev/null`" != "${expected}" ]; do
+	if [ ${waited} -ge ${config_timeout} ]; then
+	    echo "config $1 didn't take effect in ${config_timeout}s; is automaticPgRestart on?" >&2
+	    return 1
+	fi
+	sleep 2
+	let "waited+=2"
+    done
+}
+
+# Fresh tables for each config, so runs are comparable. Indexes are created on
+# real partitions only: postgres_fdw doesn't support indexes on foreign ones.
+function setup_schema()
+{
+    echo "creating ${naccounts} accounts in ${nparts} partitions"
+    psql_c "drop table if exists bench_ingest, bench_accounts"
+    psql_c "create table bench_accounts (id int, amount int) partition by hash (id)"
+    psql_c "select shardman.hash_shard_table('bench_accounts', ${nparts})"
+    psql_c "create table bench_ingest (id int, payload text) partition by hash (id)"
+    psql_c "select shardman.hash_shard_table('bench_ingest', ${nparts}, 'bench_accounts')"
+    psql_c "insert into bench_accounts select i, 0 from generate_series(1, ${naccounts}) i"
+    forall_local_parts bench_accounts 'create index on %I (id)'
+    forall_local_parts bench_accounts 'analyze %I'
+}
+
+# Reads per-transaction log lines with latency in us in the third field, like
+# pgbench -l writes, and prints 'count avg p50 p99' in ms
+function latency_stats()
+{
+    awk '{ print $3 }' | sort -n | awk '
+	{ lat[NR] = $1; sum += $1 }
+	END {
+	    if (NR == 0) { print 0, "null", "null", "null"; exit }
+	    printf "%d %.3f %.3f %.3f\n", NR, sum / NR / 1000,
+		lat[int((NR - 1) * 0.50) + 1] / 1000, lat[int((NR - 1) * 0.99) + 1] / 1000
+	}'
+}
+
+# fdw counters are cumulative, so reset them before each run
+stats_available=0
+function fdw_stats_reset()
+{
+    if psql_c "select shardman.fdw_stats_reset()" >/dev/null 2>&1; then
+	stats_available=1
+    else
+	stats_available=0
+    fi
+}
+
+function fdw_stats_json()
+{
+    if [ ${stats_available} -eq 0 ]; then
+	echo null
+	return
+    fi
+    psql_c "select json_build_object(
+	'round_trips', coalesce(sum(round_trips), 0),
+	'wait_time_ms', coalesce(sum(wait_time), 0),
+	'rows_fetched', coalesce(sum(rows_fetched), 0),
+	'bytes_fetched', coalesce(sum(bytes_fetched), 0),
+	'copy_bytes', coalesce(sum(copy_bytes), 0),
+	'prepares', coalesce(sum(prepares), 0),
+	'prepare_time_ms', coalesce(sum(prepare_time), 0),
+	'assigns', coalesce(sum(assigns), 0),
+	'assign_time_ms', coalesce(sum(assign_time), 0),
+	'commits', coalesce(sum(commits), 0),
+	'commit_time_ms', coalesce(sum(commit_time), 0))
+      from shardman.fdw_server_stats()"
+}
+
+# report workload config clients elapsed_s 'count avg p50 p99' aborted [extra]
+function report()
+{
+    local stats=($5)
+    local tps=`awk -v n=${stats[0]} -v d=$4 'BEGIN { printf "%.1f", d > 0 ? n / d : 0 }'`
+
+    printf '{"workload": "%s", "config": "%s", "revision": "%s", "clients": %d, "duration_s": %s, "transactions": %d, "tps": %s, "latency_ms": {"avg": %s, "p50": %s, "p99": %s}, "aborted_clients": %d, "fdw": %s%s}\n' \
+	   "$1" "$2" "${revision}" $3 $4 ${stats[0]} ${tps} ${stats[1]} ${stats[2]} ${stats[3]} \
+	   $6 "`fdw_stats_json`" "$7" >> "${out}"
+}
+
+function now_ns()
+{
+    date +%s%N
+}
+
+function elapsed_s()
+{
+    awk -v s=$1 -v e=`now_ns` 'BEGIN { printf "%.3f", (e - s) / 1e9 }'
+}
+
+# run_pgbench script config duration; leaves logs in ${tmpdir}/$1
+function run_pgbench()
+{
+    rm -rf "${tmpdir}/$1"
+    mkdir "${tmpdir}/$1"
+    echo "### $1 $2" >> "${logfile}"
+    # pgbench exits with error if some clients were aborted; count them instead
+    pgbench -n -c ${clients} -j ${threads} -T $3 -D naccounts=${naccounts} \
+	    -f "${bench_dir}/$1.sql" -l --log-prefix "${tmpdir}/$1/log" \
+	    >> "${logfile}" 2>"${tmpdir}/$1/stderr" || true
+    cat "${tmpdir}/$1/stderr" >> "${logfile}"
+}
+
+function aborted_clients()
+{
+    grep -c 'client [0-9]* aborted' "${tmpdir}/$1/stderr" || true
+}
+
+function bench_pgbench()
+{
+    fdw_stats_reset
+    run_pgbench $1 $2 ${duration}
+    report $1 $2 ${clients} ${duration} "`cat "${tmpdir}/$1"/log.* | latency_stats`" \
+	   `aborted_clients $1`
+}
+
+# Each client copies the same file $copy_batches times, each batch in its own
+# psql session; latency includes connection.
+function bench_copy_ingest()
+{
+    local rows="${tmpdir}/rows.csv"
+    local start
+
+    forall_local_parts bench_ingest 'truncate %I'
+    seq 1 ${copy_rows} | awk '{ print $1 ",payload_" $1 }' > "${rows}"
+    rm -rf "${tmpdir}/copy"
+    mkdir "${tmpdir}/copy"
+
+    fdw_stats_reset
+    start=`now_ns`
+    for c in `seq 1 ${copy_clients}`; do
+	(
+	    for b in `seq 1 ${copy_batches}`; do
+		local t0=`now_ns`
+		if psql -X -q -v ON_ERROR_STOP=1 -c "\copy bench_ingest from '${rows}' csv" \
+			2>>"${tmpdir}/copy/stderr"; then
+		    echo "$c $b $(( (`now_ns` - t0) / 1000 ))" >> "${tmpdir}/copy/log.$c"
+		else
+		    echo "client $c aborted in batch $b" >> "${tmpdir}/copy/stderr"
+		    break
+		fi
+	    done
+	) &
+    done
+    wait
+    local elapsed=`elapsed_s ${start}`
+
+    touch "${tmpdir}/copy/stderr"
+    echo "### copy_ingest $1" >> "${logfile}"
+    cat "${tmpdir}/copy/stderr" >> "${logfile}"
+    local stats="`cat "${tmpdir}/copy"/log.* | latency_stats`"
+    local nbatches=`echo ${stats} | cut -d' ' -f1`
+    local rows_per_s=`awk -v n=$(( nbatches * copy_rows )) -v d=${elapsed} 'BEGIN { printf "%.1f", n / d }'`
+    report copy_ingest $1 ${copy_clients} ${elapsed} "${stats}" \
+	   `grep -c 'client [0-9]* aborted' "${tmpdir}/copy/stderr" || true` \
+	   ", \"rows_per_batch\": ${copy_rows}, \"rows_per_s\": ${rows_per_s}"
+}
+
+# transfer load around removal of repgroup (its partitions are moved away),
+# adding it back and rebalancing
+function bench_rebalance()
+{
+    if [ -z "${rebalance_rg}" ]; then
+	echo "BENCH_REBALANCE_RG is not set, skipping rebalance"
+	return 0
+    fi
+
+    fdw_stats_reset
+    run_pgbench transfer $1 ${duration} &
+    local pgbench_pid=$!
+
+    # let load settle first
+    sleep $(( duration / 6 ))
+    local start=`now_ns`
+    local ok=true
+    echo "### rebalance $1" >> "${logfile}"
+    {
+	shardmanctl rmrepgroup --stolon-name "${rebalance_rg}" &&
+	    shardmanctl addrepgroup --stolon-name "${rebalance_rg}" ${rebalance_rg_opts} &&
+	    shardmanctl rebalance
+    } >> "${logfile}" 2>&1 || ok=false
+    local rebalance_s=`elapsed_s ${start}`
+    local under_load=true
+    kill -0 ${pgbench_pid} 2>/dev/null || under_load=false
+    wait ${pgbench_pid}
+
+    report rebalance $1 ${clients} ${duration} "`cat "${tmpdir}/transfer"/log.* | latency_stats`" \
+	   `aborted_clients transfer` \
+	   ", \"rebalance_s\": ${rebalance_s}, \"rebalance_ok\": ${ok}, \"rebalance_under_load\": ${under_load}"
+}
+
+for config in ${configs}; do
+    apply_config ${config}
+    setup_schema
+    for w in ${workloads}; do
+	echo "running ${w} with ${config}"
+	case ${w} in
+	    point_write|transfer|fanout_agg|pushdown_agg)
+		bench_pgbench ${w} ${config}
+		;;
+	    copy_ingest)
+		bench_copy_ingest ${config}
+		;;
+	    rebalance)
+		bench_rebalance ${config}
+		;;
+	    *)
+		echo "unknown workload ${w}" >&2
+		exit 1
+		;;
+	esac
+    done
+done
+
+echo "results are in ${out}"
@@ -0,0 +1,5 @@
+-- fan-out aggregate: every partition is scanned and its rows are fetched
+-- by coordinator, exercising fetch_more_data; aggregate pushdown is turned
+-- off for that, see pushdown_agg for the pushed down variant
+SET shardman.aggregate_pushdown = off;
+SELECT count(*), sum(amount) FROM bench_accounts;
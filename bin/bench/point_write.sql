@@ -0,0 +1,3 @@
+-- single-shard point write: partition is pruned, one server is touched
+\set id random(1, :naccounts)
+UPDATE bench_accounts SET amount = amount + 1 WHERE id = :id;
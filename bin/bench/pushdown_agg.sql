@@ -0,0 +1,4 @@
+-- pushed down aggregate: each repgroup aggregates its partitions and only
+-- partial aggregates are fetched by coordinator
+SET shardman.aggregate_pushdown = on;
+SELECT count(*), sum(amount) FROM bench_accounts;
@@ -0,0 +1,8 @@
+-- cross-shard transfer, like bank test of postgres_fdw: two accounts
+-- usually live on different repgroups, so commit goes through 2PC
+\set src random(1, :naccounts)
+\set dst random(1, :naccounts)
+BEGIN;
+UPDATE bench_accounts SET amount = amount - 1 WHERE id = :src;
+UPDATE bench_accounts SET amount = amount + 1 WHERE id = :dst;
+COMMIT;
@@ -0,0 +1,336 @@
+/* -------------------------------------------------------------------------
+ *
+ * lockgraph.c
+ *   Local part of the global lock graph, see lock_graph view.
+ *
+ * lock_graph_edges() computes the same edges as lock_graph view, but walks
+ * the lock table once with a hash of holders instead of self-joining
+ * pg_locks, and doesn't parse application_name with split_part on every
+ * row. Besides, it remembers (per backend) since when each waiter is seen
+ * waiting and reports only waits older than the given threshold: monitor
+ * keeps its connection, so short-living waits which can't be a part of
+ * deadlock are filtered out right here.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/lock.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "shardman.h"
+
+#define LOCK_GRAPH_COLS 4
+
+/* Holders of the lock, all granted LockInstanceData entries on the tag */
+typedef struct LockHolders
+{
+	LOCKTAG		tag;			/* hash key (must be first) */
+	List	   *holders;
+} LockHolders;
+
+/* Key of waitSince entry: who waits on what */
+typedef struct WaiterKey
+{
+	int			pid;
+	LOCKTAG		tag;
+} WaiterKey;
+
+typedef struct WaiterEntry
+{
+	WaiterKey	key;			/* hash key (must be first) */
+	TimestampTz since;			/* first time we saw it waiting */
+	uint64		seen;			/* call number we saw it last time */
+} WaiterEntry;
+
+/* Coordinator of prepared xact, parsed from its gid */
+typedef struct PreparedXactEntry
+{
+	TransactionId xid;			/* hash key (must be first) */
+	int64		sysid;
+	int			pid;
+} PreparedXactEntry;
+
+PG_FUNCTION_INFO_V1(lock_graph_edges);
+
+/* Waits we know about, survives between calls */
+static HTAB *waitSince = NULL;
+static uint64 callCounter = 0;
+
+static HTAB *prepared_xacts_hash(void);
+static void put_edge(Tuplestorestate *tupstore, TupleDesc tupdesc,
+					 int64 wait_sysid, int wait_pid,
+					 int64 hold_sysid, int hold_pid);
+
+/*
+ * Return edges wait -> hold of local lock graph, omitting lock waits younger
+ * than min_wait_ms.
+ */
+Datum
+lock_graph_edges(PG_FUNCTION_ARGS)
+{
+	int			min_wait_ms = PG_GETARG_INT32(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASHCTL		info;
+	HTAB	   *holders_hash;
+	HTAB	   *xacts_hash = NULL;
+	HASH_SEQ_STATUS hash_seq;
+	WaiterEntry *waiter;
+	LockData   *lockData;
+	int64		sysid = (int64) GetSystemIdentifier();
+	TimestampTz now = GetCurrentTimestamp();
+	int			nbackends;
+	int			i;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts != LOCK_GRAPH_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (waitSince == NULL)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(WaiterKey);
+		info.entrysize = sizeof(WaiterEntry);
+		waitSince = hash_create("shardman lock waiters", 256, &info,
+								HASH_ELEM | HASH_BLOBS);
+	}
+	callCounter++;
+
+	/* Group granted locks by tag */
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(LOCKTAG);
+	info.entrysize = sizeof(LockHolders);
+	info.hcxt = CurrentMemoryContext;
+	holders_hash = hash_create("shardman lock holders", 1024, &info,
+							   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	lockData = GetLockStatusData();
+	for (i = 0; i < lockData->nelements; i++)
+	{
+		LockInstanceData *instance = &lockData->locks[i];
+		LockHolders *lh;
+		bool		found;
+
+		if (instance->holdMask == 0)
+			continue;
+		lh = (LockHolders *) hash_search(holders_hash, &instance->locktag,
+										 HASH_ENTER, &found);
+		if (!found)
+			lh->holders = NIL;
+		lh->holders = lappend(lh->holders, instance);
+	}
+
+	/* Local dependencies: waiter -> holder of the same object */
+	for (i = 0; i < lockData->nelements; i++)
+	{
+		LockInstanceData *instance = &lockData->locks[i];
+		WaiterKey	key;
+		LockHolders *lh;
+		ListCell   *lc;
+		bool		found;
+
+		if (instance->waitLockMode == NoLock || instance->pid == 0)
+			continue;
+
+		memset(&key, 0, sizeof(key));
+		key.pid = instance->pid;
+		key.tag = instance->locktag;
+		waiter = (WaiterEntry *) hash_search(waitSince, &key, HASH_ENTER,
+											 &found);
+		if (!found)
+			waiter->since = now;
+		waiter->seen = callCounter;
+
+		if (!TimestampDifferenceExceeds(waiter->since, now, min_wait_ms))
+			continue;
+
+		lh = (LockHolders *) hash_search(holders_hash, &instance->locktag,
+										 HASH_FIND, NULL);
+		if (lh == NULL)
+			continue;
+		foreach(lc, lh->holders)
+		{
+			LockInstanceData *holder = (LockInstanceData *) lfirst(lc);
+			PreparedXactEntry *pxact;
+			TransactionId xid;
+
+			/* upgrading own lock is not a deadlock by itself */
+			if (holder->pid == instance->pid)
+				continue;
+
+			if (holder->pid != 0)
+			{
+				put_edge(tupstore, tupdesc, sysid, instance->pid,
+						 sysid, holder->pid);
+				continue;
+			}
+
+			/*
+			 * Xact is already prepared, take node and pid of the coordinator.
+			 * Like the view, we can identify it only by xid lock.
+			 */
+			if (holder->locktag.locktag_type != LOCKTAG_TRANSACTION)
+				continue;
+			if (xacts_hash == NULL)
+				xacts_hash = prepared_xacts_hash();
+			xid = (TransactionId) holder->locktag.locktag_field1;
+			pxact = (PreparedXactEntry *) hash_search(xacts_hash, &xid,
+													  HASH_FIND, NULL);
+			if (pxact != NULL)
+				put_edge(tupstore, tupdesc, sysid, instance->pid,
+						 pxact->sysid, pxact->pid);
+		}
+	}
+
+	/* Forget waits which are over */
+	hash_seq_init(&hash_seq, waitSince);
+	while ((waiter = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (waiter->seen != callCounter)
+			hash_search(waitSince, &waiter->key, HASH_REMOVE, NULL);
+	}
+
+	/*
+	 * If fdw backend is busy, potentially waiting, add edge coordinator ->
+	 * fdw; otherwise, coordinator itself is busy, potentially waiting, so add
+	 * fdw -> coordinator edge. Backends running on CPU wait for nobody.
+	 */
+	nbackends = pgstat_fetch_stat_numbackends();
+	for (i = 1; i <= nbackends; i++)
+	{
+		PgBackendStatus *beentry = pgstat_fetch_stat_beentry(i);
+		PGPROC	   *proc;
+		uint32		wait_event_info;
+		long long	coord_sysid;
+		int			coord_pid;
+
+		if (beentry == NULL ||
+			strncmp(beentry->st_appname, "pgfdw:", strlen("pgfdw:")) != 0)
+			continue;
+		if (sscanf(beentry->st_appname, "pgfdw:%lld:%d",
+				   &coord_sysid, &coord_pid) != 2)
+			continue;
+		proc = BackendPidGetProc(beentry->st_procpid);
+		if (proc == NULL)
+			continue;
+		wait_event_info = proc->wait_event_info;
+		if (wait_event_info == 0)
+			continue;
+
+		if (wait_event_info == WAIT_EVENT_CLIENT_READ)
+			put_edge(tupstore, tupdesc, sysid, beentry->st_procpid,
+					 (int64) coord_sysid, coord_pid);
+		else
+			put_edge(tupstore, tupdesc, (int64) coord_sysid, coord_pid,
+					 sysid, beentry->st_procpid);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Map xid of each prepared xact to its coordinator. Gid is assumed
+ * pgfdw:$timestamp:$sys_id:$pid:$xid:$participants_count:$coord_count
+ */
+static HTAB *
+prepared_xacts_hash(void)
+{
+	HASHCTL		info;
+	HTAB	   *xacts_hash;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	uint64		i;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(TransactionId);
+	info.entrysize = sizeof(PreparedXactEntry);
+	info.hcxt = CurrentMemoryContext;
+	xacts_hash = hash_create("shardman prepared xacts", 64, &info,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	SPI_connect();
+	if (SPI_execute("select transaction::text, gid from pg_prepared_xacts",
+					true, 0) != SPI_OK_SELECT)
+		hp_elog(ERROR, "failed to get prepared xacts");
+
+	/* hash lives in caller's context, SPI tuples are freed on finish */
+	MemoryContextSwitchTo(oldcontext);
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	desc = SPI_tuptable->tupdesc;
+		char	   *xid_str = SPI_getvalue(tuple, desc, 1);
+		char	   *gid = SPI_getvalue(tuple, desc, 2);
+		PreparedXactEntry *pxact;
+		TransactionId xid;
+		long long	coord_sysid;
+		int			coord_pid;
+
+		if (sscanf(gid, "pgfdw:%*[^:]:%lld:%d", &coord_sysid, &coord_pid) != 2)
+			continue;
+		xid = (TransactionId) strtoul(xid_str, NULL, 10);
+		pxact = (PreparedXactEntry *) hash_search(xacts_hash, &xid,
+												  HASH_ENTER, NULL);
+		pxact->sysid = (int64) coord_sysid;
+		pxact->pid = coord_pid;
+	}
+	SPI_finish();
+
+	return xacts_hash;
+}
+
+static void
+put_edge(Tuplestorestate *tupstore, TupleDesc tupdesc,
+		 int64 wait_sysid, int wait_pid, int64 hold_sysid, int hold_pid)
+{
+	Datum		values[LOCK_GRAPH_COLS];
+	bool		nulls[LOCK_GRAPH_COLS];
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(wait_sysid);
+	values[1] = Int32GetDatum(wait_pid);
+	values[2] = Int64GetDatum(hold_sysid);
+	values[3] = Int32GetDatum(hold_pid);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
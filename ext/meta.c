@@ -14,10 +14,15 @@
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "catalog/namespace.h"
+#include "commands/extension.h"
 #include "utils/fmgroids.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/syscache.h"
 
 #include "meta.h"
 
@@ -31,118 +36,345 @@
 #define Anum_parts_pnum						2
 #define Anum_parts_rgid						3
 
-static Oid ShardmanNamespaceOid(void);
-static Oid RepgroupsIndexOid(void);
+/*
+ * Backend-local cache of metadata.
+ *
+ * Utility statements hook and friends consult the metadata all the time, so
+ * instead of looking up and scanning the tables on each call we remember the
+ * oids of our objects and contents of repgroups and sharded_tables. Changes
+ * of the contents are signalled by relcache invalidation of the table, which
+ * statement-level triggers send (see meta_cache_inval), and objects being
+ * dropped or recreated by relcache and pg_namespace invalidations. Since
+ * metadata changes rarely, any of these just makes us forget everything.
+ *
+ * Invalidation might arrive while we are filling the cache, as catalog
+ * access processes them; what we got then is still returned, but not
+ * remembered. For that, each invalidation bumps meta_cache_generation.
+ */
+typedef struct RepgroupsCacheEntry
+{
+	int			rgid;			/* hash key (must be first) */
+	Oid			srvid;
+	bool		srvid_isnull;	/* true for ourselves */
+} RepgroupsCacheEntry;
+
+typedef struct ShardedRelsCacheEntry
+{
+	Oid			rel;			/* hash key (must be first) */
+	Oid			colocated_with;	/* InvalidOid if none */
+} ShardedRelsCacheEntry;
+
+static uint64 meta_cache_generation = 0;
+
+static Oid extension_oid = InvalidOid;
+static bool extension_missing = false;
+
+static bool meta_oids_valid = false;
+static Oid namespace_oid;
+static Oid repgroups_oid;
+static Oid sharded_tables_oid;
+static Oid sharded_tables_index_oid;
+static Oid parts_oid;
+static Oid parts_index_oid;
+
+static bool repgroups_valid = false;
+static HTAB *repgroups_cache = NULL;
+
+static bool sharded_rels_valid = false;
+static HTAB *sharded_rels_cache = NULL;
+
+static void InvalidateMetaCache(void);
+static void MetaCacheRelcacheCallback(Datum arg, Oid relid);
+static void MetaCacheSyscacheCallback(Datum arg, int cacheid, uint32 hashvalue);
+static void LoadMetaOids(void);
+static void LoadRepgroups(void);
+static void LoadShardedRels(void);
 static Oid ShardedTablesOid(void);
 static Oid PartsOid(void);
 static Oid PartsIndexOid(void);
 
-/* TODO: caching */
-static Oid ShardmanNamespaceOid(void)
+/* Register invalidation callbacks of the cache; called once in _PG_init */
+void InitMetaCache(void)
 {
-	return get_namespace_oid("shardman", false);
+	CacheRegisterRelcacheCallback(MetaCacheRelcacheCallback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, MetaCacheSyscacheCallback,
+								  (Datum) 0);
 }
 
-Oid RepgroupsOid(void)
+static void InvalidateMetaCache(void)
+{
+	meta_cache_generation++;
+	extension_oid = InvalidOid;
+	extension_missing = false;
+	meta_oids_valid = false;
+	repgroups_valid = false;
+	sharded_rels_valid = false;
+}
+
+static void MetaCacheRelcacheCallback(Datum arg, Oid relid)
+{
+	/*
+	 * InvalidOid means all relations. While the extension is missing, any
+	 * relation counts: CREATE EXTENSION creates our tables, and the schema
+	 * might have existed before, so pg_namespace invalidation alone is not
+	 * enough to notice it.
+	 */
+	if (relid == InvalidOid || extension_missing ||
+		(meta_oids_valid &&
+		 (relid == repgroups_oid || relid == sharded_tables_oid ||
+		  relid == parts_oid)))
+		InvalidateMetaCache();
+}
+
+static void MetaCacheSyscacheCallback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	InvalidateMetaCache();
+}
+
+/* Oid of shardman extension, or InvalidOid if it is not created */
+Oid ShardmanExtensionOid(void)
+{
+	uint64 generation = meta_cache_generation;
+	Oid oid;
+
+	if (OidIsValid(extension_oid) || extension_missing)
+		return extension_oid;
+
+	/*
+	 * pg_extension has no syscache, so its changes are not signalled; absence
+	 * is remembered until any relcache or pg_namespace invalidation, see
+	 * MetaCacheRelcacheCallback.
+	 */
+	oid = get_extension_oid("shardman", true);
+	if (generation == meta_cache_generation)
+	{
+		extension_oid = oid;
+		extension_missing = !OidIsValid(oid);
+	}
+	return oid;
+}
+
+/*
+ * Look up shardman schema and tables. Errors out if there is no schema;
+ * missing tables (e.g. while extension is being created) are not remembered.
+ */
+static void LoadMetaOids(void)
 {
-	return get_relname_relid("repgroups", ShardmanNamespaceOid());
+	uint64 generation = meta_cache_generation;
+
+	if (meta_oids_valid)
+		return;
+
+	namespace_oid = get_namespace_oid("shardman", false);
+	repgroups_oid = get_relname_relid("repgroups", namespace_oid);
+	sharded_tables_oid = get_relname_relid("sharded_tables", namespace_oid);
+	sharded_tables_index_oid = get_relname_relid("sharded_tables_pkey",
+												 namespace_oid);
+	parts_oid = get_relname_relid("parts", namespace_oid);
+	parts_index_oid = get_relname_relid("parts_pkey", namespace_oid);
+
+	meta_oids_valid = generation == meta_cache_generation &&
+		OidIsValid(repgroups_oid) &&
+		OidIsValid(sharded_tables_oid) && OidIsValid(sharded_tables_index_oid) &&
+		OidIsValid(parts_oid) && OidIsValid(parts_index_oid);
 }
 
-static Oid RepgroupsIndexOid(void)
+Oid RepgroupsOid(void)
 {
-	return get_relname_relid("repgroups_pkey", ShardmanNamespaceOid());
+	LoadMetaOids();
+	return repgroups_oid;
 }
 
 static Oid ShardedTablesOid(void)
 {
-	return get_relname_relid("sharded_tables", ShardmanNamespaceOid());
+	LoadMetaOids();
+	return sharded_tables_oid;
 }
 
 static Oid ShardedTablesIndexOid(void)
 {
-	return get_relname_relid("sharded_tables_pkey", ShardmanNamespaceOid());
+	LoadMetaOids();
+	return sharded_tables_index_oid;
 }
 
 static Oid PartsOid(void)
 {
-	return get_relname_relid("parts", ShardmanNamespaceOid());
+	LoadMetaOids();
+	return parts_oid;
 }
 
 static Oid PartsIndexOid(void)
 {
-	return get_relname_relid("parts_pkey", ShardmanNamespaceOid());
+	LoadMetaOids();
+	return parts_index_oid;
 }
 
-/* Get foreign server oid by rgid. Errors out if there is no such rgid. */
-Oid ServerIdByRgid(int rgid, bool *isnull)
+/* Read the whole repgroups table into repgroups_cache, if not yet */
+static void LoadRepgroups(void)
 {
+	uint64 generation = meta_cache_generation;
+	HASHCTL ctl;
 	Relation rel;
-	SysScanDesc scan_desc;
-	ScanKeyData key[1];
-	HeapTuple repgroup_tuple;
+	SysScanDesc scan;
 	TupleDesc tupleDescriptor;
-	Datum serverid_datum;
-	Oid serverid;
+	HeapTuple tuple;
+
+	if (repgroups_valid)
+		return;
+
+	if (repgroups_cache != NULL)
+		hash_destroy(repgroups_cache);
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int);
+	ctl.entrysize = sizeof(RepgroupsCacheEntry);
+	ctl.hcxt = CacheMemoryContext;
+	repgroups_cache = hash_create("shardman repgroups cache", 16, &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 
 	rel = heap_open(RepgroupsOid(), AccessShareLock);
 	tupleDescriptor = RelationGetDescr(rel);
-	/* find tuple */
-	ScanKeyInit(&key[0],
-				Anum_repgroups_id,
-				BTEqualStrategyNumber, F_INT4EQ,
-				Int32GetDatum(rgid));
-
-	scan_desc = systable_beginscan(rel,
-								   RepgroupsIndexOid(),
-								   true, NULL, 1, key);
 
-	repgroup_tuple = systable_getnext(scan_desc);
-	if (HeapTupleIsValid(repgroup_tuple))
-	{
-		serverid_datum = heap_getattr(repgroup_tuple,
-									  Anum_repgroups_srvid,
-									  tupleDescriptor,
-									  isnull);
-		serverid = DatumGetObjectId(serverid_datum);
-	}
-	else
+	scan = systable_beginscan(rel, 0, true, NULL, 0, NULL);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
 	{
-		elog(ERROR, "repgroup with id %d not found", rgid);
+		RepgroupsCacheEntry *entry;
+		bool isnull;
+		int rgid;
+
+		rgid = DatumGetInt32(heap_getattr(tuple, Anum_repgroups_id,
+										  tupleDescriptor, &isnull));
+		entry = hash_search(repgroups_cache, &rgid, HASH_ENTER, NULL);
+		entry->srvid = DatumGetObjectId(heap_getattr(tuple,
+													 Anum_repgroups_srvid,
+													 tupleDescriptor,
+													 &entry->srvid_isnull));
 	}
 
-	systable_endscan(scan_desc);
+	systable_endscan(scan);
 	heap_close(rel, AccessShareLock);
-	return serverid;
+
+	/* contents are watched only if we know the table's oid */
+	repgroups_valid = generation == meta_cache_generation && meta_oids_valid;
 }
 
-/* check that rel is sharded */
-bool RelIsSharded(Oid relid)
+/* Read the whole sharded_tables table into sharded_rels_cache, if not yet */
+static void LoadShardedRels(void)
 {
+	uint64 generation = meta_cache_generation;
+	HASHCTL ctl;
 	Relation rel;
-	SysScanDesc scan_desc;
-	ScanKeyData key[1];
-	bool found = false;
+	SysScanDesc scan;
+	TupleDesc tupleDescriptor;
 	HeapTuple tuple;
 
+	if (sharded_rels_valid)
+		return;
+
+	if (sharded_rels_cache != NULL)
+		hash_destroy(sharded_rels_cache);
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(ShardedRelsCacheEntry);
+	ctl.hcxt = CacheMemoryContext;
+	sharded_rels_cache = hash_create("shardman sharded tables cache", 64, &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
 	rel = heap_open(ShardedTablesOid(), AccessShareLock);
-	/* find tuple */
-	ScanKeyInit(&key[0],
-				Anum_sharded_tables_rel,
-				BTEqualStrategyNumber, F_OIDEQ,
-				ObjectIdGetDatum(relid));
-	scan_desc = systable_beginscan(rel,
-								   ShardedTablesIndexOid(),
-								   true, NULL, 1, key);
+	tupleDescriptor = RelationGetDescr(rel);
 
-	tuple = systable_getnext(scan_desc);
-	if (HeapTupleIsValid(tuple))
+	scan = systable_beginscan(rel, 0, true, NULL, 0, NULL);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
 	{
-		found = true;
+		ShardedRelsCacheEntry *entry;
+		bool isnull;
+		Oid relid;
+		Datum colocated_with;
+
+		relid = DatumGetObjectId(heap_getattr(tuple, Anum_sharded_tables_rel,
+											  tupleDescriptor, &isnull));
+		colocated_with = heap_getattr(tuple,
+									  Anum_sharded_tables_colocated_with,
+									  tupleDescriptor, &isnull);
+		entry = hash_search(sharded_rels_cache, &relid, HASH_ENTER, NULL);
+		entry->colocated_with = isnull ? InvalidOid :
+			DatumGetObjectId(colocated_with);
 	}
 
-	systable_endscan(scan_desc);
+	systable_endscan(scan);
 	heap_close(rel, AccessShareLock);
-	return found;
+
+	/* contents are watched only if we know the table's oid */
+	sharded_rels_valid = generation == meta_cache_generation && meta_oids_valid;
+}
+
+/* Get foreign server oid by rgid. Errors out if there is no such rgid. */
+Oid ServerIdByRgid(int rgid, bool *isnull)
+{
+	RepgroupsCacheEntry *entry;
+
+	LoadRepgroups();
+	entry = hash_search(repgroups_cache, &rgid, HASH_FIND, NULL);
+	if (entry == NULL)
+		elog(ERROR, "repgroup with id %d not found", rgid);
+
+	*isnull = entry->srvid_isnull;
+	return entry->srvid;
+}
+
+/*
+ * List of foreign servers of all repgroups except ourselves. The list is
+ * allocated in current memory context, so the cache can go away meanwhile.
+ */
+List *RepgroupsServers(void)
+{
+	HASH_SEQ_STATUS status;
+	RepgroupsCacheEntry *entry;
+	List *servers = NIL;
+
+	LoadRepgroups();
+	hash_seq_init(&status, repgroups_cache);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		if (!entry->srvid_isnull)
+			servers = lappend_oid(servers, entry->srvid);
+	}
+	return servers;
+}
+
+/* check that rel is sharded */
+bool RelIsSharded(Oid relid)
+{
+	LoadShardedRels();
+	return hash_search(sharded_rels_cache, &relid, HASH_FIND, NULL) != NULL;
+}
+
+/*
+ * Get the table starting the chain of colocated_with links from rel, which
+ * identifies the group of tables whose partitions with the same number live
+ * on the same repgroup. Returns InvalidOid if rel is not sharded.
+ */
+Oid ShardedRelColocationGroup(Oid relid)
+{
+	ShardedRelsCacheEntry *entry;
+	int nhops = 0;
+
+	LoadShardedRels();
+	entry = hash_search(sharded_rels_cache, &relid, HASH_FIND, NULL);
+	if (entry == NULL)
+		return InvalidOid;
+
+	while (OidIsValid(entry->colocated_with))
+	{
+		ShardedRelsCacheEntry *next;
+
+		next = hash_search(sharded_rels_cache, &entry->colocated_with,
+						   HASH_FIND, NULL);
+		/* foreign key prevents dangling links, but let's be paranoid */
+		if (next == NULL || ++nhops > hash_get_num_entries(sharded_rels_cache))
+			break;
+		entry = next;
+	}
+	return entry->rel;
 }
 
 /* Delete from local metadata */
@@ -186,4 +418,7 @@ void DropShardedRel(Oid relid)
 	}
 	systable_endscan(scan_desc);
 	heap_close(rel, RowExclusiveLock);
+
+	/* We bypassed the invalidation triggers, send it ourselves */
+	CacheInvalidateRelcacheByRelid(ShardedTablesOid());
 }
@@ -16,8 +16,15 @@
 #define Anum_repgroups_srvid		2
 
 
+#include "nodes/pg_list.h"
+
+extern void InitMetaCache(void);
+
+extern Oid ShardmanExtensionOid(void);
 extern Oid ServerIdByRgid(int rgid, bool *isnull);
+extern List *RepgroupsServers(void);
 
 extern Oid RepgroupsOid(void);
 extern bool RelIsSharded(Oid rel);
+extern Oid ShardedRelColocationGroup(Oid rel);
 extern void DropShardedRel(Oid rel);
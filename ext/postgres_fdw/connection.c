@@ -13,18 +13,22 @@
 #include "postgres.h"
 
 #include "postgres_fdw.h"
+#include "shardman.h"
 
 #include "access/global_snapshot.h"
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "access/transam.h"
 #include "access/twophase.h"
 #include "access/xact.h"
 #include "access/xlog.h" /* GetSystemIdentifier() */
 #include "catalog/pg_user_mapping.h"
+#include "commands/defrem.h"
 #include "libpq-int.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "portability/instr_time.h"
 #include "storage/latch.h"
 #include "utils/hsearch.h"
 #include "utils/inval.h"
@@ -32,6 +36,7 @@
 #include "utils/snapmgr.h"
 #include "utils/snapshot.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 
 /*
@@ -49,8 +54,16 @@
  * commands at the same nesting depth on the remote as we're executing at
  * ourselves, so that rolling back a subtransaction will kill the right
  * queries and not the wrong ones.
+ *
+ * Scans of read-only transactions may be served by a standby of the server
+ * instead, see GetConnectionForScan; such connection has an entry of its own,
+ * with standby flag set in the key.
  */
-typedef Oid ConnCacheKey;
+typedef struct ConnCacheKey
+{
+	Oid			umid;			/* user mapping OID */
+	bool		standby;		/* connection to a standby of the server? */
+} ConnCacheKey;
 
 struct ConnCacheEntry
 {
@@ -62,18 +75,44 @@ struct ConnCacheEntry
 								 * one level of subxact open, etc */
 	bool		have_prep_stmt; /* have we prepared any stmts in this xact? */
 	bool		have_error;		/* have any subxacts aborted in this xact? */
+	bool		modified;		/* have we sent any writes in this xact? */
 	bool		changing_xact_state;	/* xact state change in process */
 	bool		invalidated;	/* true if reconnect is pending */
 	uint32		server_hashvalue;	/* hash value of foreign server OID */
 	uint32		mapping_hashvalue;	/* hash value of user mapping OID */
 	bool		copy_from_started;	/* COPY FROM in progress on this conn */
+	StringInfo	copy_buf;		/* COPY FROM data not passed to libpq yet */
+	PgFdwPendingCallback pending_cb;	/* collects result of async query, or
+										 * NULL if none is in flight */
+	void	   *pending_arg;	/* argument for pending_cb */
+	Oid			serverid;		/* foreign server of the user mapping */
+	char		servername[NAMEDATALEN];	/* and its name, for 2PC traces */
+	TimestampTz last_used;		/* connected or last xact using it ended */
+	TimestampTz connect_failed_at;	/* last failed attempt to reach standbys */
+	PgFdwStatsCounters stats;	/* not yet flushed to shared memory */
+	HTAB	   *prep_scans;		/* scan queries prepared on conn, or NULL */
 } ;
 
+/*
+ * Entry of ConnCacheEntry's prep_scans: scan queries are prepared once per
+ * connection, see GetPreparedScan.
+ */
+typedef struct PrepScanEntry
+{
+	char	   *query;			/* hash key (must be first) */
+	char		name[NAMEDATALEN];	/* name of the prepared statement */
+} PrepScanEntry;
+
 /*
  * Connection cache (initialized on first use)
  */
 static HTAB *ConnectionHash = NULL;
 
+/* Don't try to connect to standbys more often than this, ms */
+#define STANDBY_RETRY_INTERVAL 10000
+/* Give up on standby not answering for that long, on top of replay wait, ms */
+#define STANDBY_QUERY_TIMEOUT 10000
+
 /*
  * FdwTransactionState
  *
@@ -83,9 +122,12 @@ static HTAB *ConnectionHash = NULL;
 typedef struct FdwTransactionState
 {
 	char		gid[GIDSIZE];
-	int			nparticipants;
+	int			nparticipants;	/* number of nodes having written something */
 	GlobalCSN	global_csn;
 	bool		two_phase_commit;
+	bool		traced;			/* is this 2PC sampled for tracing? */
+	instr_time	trace_start;	/* when 2PC started, if traced */
+	GlobalCSN	max_csn;		/* csn assigned to the 2PC, if traced */
 } FdwTransactionState;
 static FdwTransactionState *fdwTransState;
 
@@ -100,20 +142,33 @@ static bool xact_got_connection = false;
 static int two_phase_xact_count = 0;
 
 /* prototypes of private functions */
+static ConnCacheEntry *get_connection_entry(UserMapping *user, bool standby);
+static bool begin_standby_xact(ConnCacheEntry *standby, ConnCacheEntry *master);
+static bool standby_exec(ConnCacheEntry *standby, const char *sql,
+						 PGresult **result);
 static void connect_pg_server(ConnCacheEntry *entry, ForeignServer *server,
-							  UserMapping *user);
+							  UserMapping *user, List *standby_hosts);
 static void disconnect_pg_server(ConnCacheEntry *entry);
+static uint32 prep_scan_hash(const void *key, Size keysize);
+static int	prep_scan_match(const void *key1, const void *key2, Size keysize);
+static void forget_prepared_scans(ConnCacheEntry *entry);
 static void check_conn_params(const char **keywords, const char **values, UserMapping *user);
-static void configure_remote_session(ConnCacheEntry *entry);
+static char *remote_session_options(const char **keywords,
+					   const char **values);
 static void do_sql_command(ConnCacheEntry *entry, const char *sql);
+static GlobalCSN get_global_csn(void);
 static void begin_remote_xact(ConnCacheEntry *entry);
 static void pgfdw_xact_callback(XactEvent event, void *arg);
+static void pgfdw_trace_start(void);
+static void pgfdw_trace_report(const char *outcome);
 static void deallocate_prepared_stmts(ConnCacheEntry *entry);
 static void pgfdw_subxact_callback(SubXactEvent event,
 					   SubTransactionId mySubid,
 					   SubTransactionId parentSubid,
 					   void *arg);
 static void pgfdw_inval_callback(Datum arg, int cacheid, uint32 hashvalue);
+static bool pgfdw_idle_expired(ConnCacheEntry *entry, TimestampTz now);
+static void pgfdw_close_idle_connections(void);
 static void pgfdw_reject_incomplete_xact_state_change(ConnCacheEntry *entry);
 static bool pgfdw_cancel_query(ConnCacheEntry *entry);
 static bool pgfdw_exec_cleanup_query(ConnCacheEntry *entry, const char *query,
@@ -135,6 +190,69 @@ static bool pgfdw_get_cleanup_result(ConnCacheEntry *entry, TimestampTz endtime,
 ConnCacheEntry *
 GetConnectionCopyFrom(UserMapping *user, bool will_prep_stmt,
 					  bool **copy_from_started)
+{
+	ConnCacheEntry *entry = get_connection_entry(user, false);
+
+	/*
+	 * Start a new transaction or subtransaction if needed.
+	 */
+	begin_remote_xact(entry);
+
+	/* Remember if caller will prepare statements */
+	entry->have_prep_stmt |= will_prep_stmt;
+
+	if (copy_from_started)
+		*copy_from_started = &(entry->copy_from_started);
+
+	return entry;
+}
+
+/*
+ * Like GetConnection, but when standby_reads is on and the transaction is
+ * read-only, the scan may be served by a standby of the server, as listed in
+ * its standby_hosts option.  The standby is used only after it has replayed
+ * everything the master had written once our transaction started; if it
+ * doesn't catch up in time, fails in any way, or none of standbys is
+ * reachable, we read from the master as usual.  Within a transaction, all
+ * scans of the server go to the same place.
+ *
+ * Standbys don't keep CSNs of transactions, so they can't provide global
+ * snapshot visibility: with global snapshots, the master is always used.
+ * Hot standby can't run serializable transactions either.
+ */
+ConnCacheEntry *
+GetConnectionForScan(UserMapping *user, bool will_prep_stmt)
+{
+	ConnCacheEntry *entry;
+
+	if (!UseStandbyReads || UseGlobalSnapshots || !XactReadOnly ||
+		IsolationIsSerializable())
+		return GetConnection(user, will_prep_stmt);
+
+	entry = get_connection_entry(user, true);
+	if (entry->conn == NULL)
+		return GetConnection(user, will_prep_stmt);
+	if (entry->xact_depth <= 0)
+	{
+		ConnCacheEntry *master;
+
+		master = get_connection_entry(user, false);
+		if (master->xact_depth > 0 || !begin_standby_xact(entry, master))
+			return GetConnection(user, will_prep_stmt);
+	}
+
+	begin_remote_xact(entry);
+	entry->have_prep_stmt |= will_prep_stmt;
+	return entry;
+}
+
+/*
+ * Find or create cache entry of connection to the server of user mapping, or
+ * to one of its standbys, and connect if needed.  Standby entry is left without
+ * connection if the server has no standbys or none of them is reachable.
+ */
+static ConnCacheEntry *
+get_connection_entry(UserMapping *user, bool standby)
 {
 	bool		found;
 	ConnCacheEntry *entry;
@@ -178,8 +296,10 @@ GetConnectionCopyFrom(UserMapping *user, bool will_prep_stmt,
 	/* Set flag that we did GetConnection during the current transaction */
 	xact_got_connection = true;
 
-	/* Create hash key for the entry.  Assume no pad bytes in key struct */
-	key = user->umid;
+	/* Create hash key for the entry, zeroing pad bytes */
+	memset(&key, 0, sizeof(key));
+	key.umid = user->umid;
+	key.standby = standby;
 
 	/*
 	 * Find or create cached entry for requested connection.
@@ -188,10 +308,15 @@ GetConnectionCopyFrom(UserMapping *user, bool will_prep_stmt,
 	if (!found)
 	{
 		/*
-		 * We need only clear "conn" here; remaining fields will be filled
-		 * later when "conn" is set.
+		 * We need only clear "conn" and the COPY FROM buffer here; remaining
+		 * fields will be filled later when "conn" is set.
 		 */
 		entry->conn = NULL;
+		entry->copy_buf = NULL;
+		entry->prep_scans = NULL;
+		entry->serverid = user->serverid;
+		entry->connect_failed_at = 0;
+		memset(&entry->stats, 0, sizeof(PgFdwStatsCounters));
 	}
 
 	/* Reject further use of connections which failed abort cleanup. */
@@ -222,40 +347,148 @@ GetConnectionCopyFrom(UserMapping *user, bool will_prep_stmt,
 	if (entry->conn == NULL)
 	{
 		ForeignServer *server = GetForeignServer(user->serverid);
+		List	   *standby_hosts = NIL;
+
+		if (standby)
+		{
+			ListCell   *lc;
+
+			foreach(lc, server->options)
+			{
+				DefElem    *def = (DefElem *) lfirst(lc);
+
+				if (strcmp(def->defname, "standby_hosts") == 0)
+					standby_hosts = ExtractStandbyHosts(defGetString(def));
+			}
+			if (standby_hosts == NIL ||
+				!TimestampDifferenceExceeds(entry->connect_failed_at,
+											GetCurrentTimestamp(),
+											STANDBY_RETRY_INTERVAL))
+				return entry;
+		}
 
 		/* Reset all transient state fields, to be sure all are clean */
 		entry->xact_depth = 0;
 		entry->have_prep_stmt = false;
 		entry->have_error = false;
+		entry->modified = false;
 		entry->changing_xact_state = false;
 		entry->invalidated = false;
 		entry->copy_from_started = false;
+		entry->pending_cb = NULL;
+		entry->pending_arg = NULL;
 		entry->server_hashvalue =
 			GetSysCacheHashValue1(FOREIGNSERVEROID,
 								  ObjectIdGetDatum(server->serverid));
 		entry->mapping_hashvalue =
 			GetSysCacheHashValue1(USERMAPPINGOID,
 								  ObjectIdGetDatum(user->umid));
+		strlcpy(entry->servername, server->servername, NAMEDATALEN);
 
 		/* Now try to make the connection */
-		connect_pg_server(entry, server, user);
+		connect_pg_server(entry, server, user, standby_hosts);
+		if (entry->conn == NULL)
+		{
+			entry->connect_failed_at = GetCurrentTimestamp();
+			return entry;
+		}
 
-		elog(DEBUG3, "new postgres_fdw connection %p for server \"%s\" (user mapping oid %u, userid %u)",
-			 entry->conn, server->servername, user->umid, user->userid);
+		elog(DEBUG3, "new postgres_fdw connection %p for %sserver \"%s\" (user mapping oid %u, userid %u)",
+			 entry->conn, standby ? "standby of " : "", server->servername,
+			 user->umid, user->userid);
 	}
 
-	/*
-	 * Start a new transaction or subtransaction if needed.
-	 */
-	begin_remote_xact(entry);
+	return entry;
+}
 
-	/* Remember if caller will prepare statements */
-	entry->have_prep_stmt |= will_prep_stmt;
+/*
+ * Wait until standby replays WAL up to the position master has written by
+ * now, at most StandbyWaitTimeout ms, and start remote transaction there.
+ * Remote snapshot is taken after that, so it sees at least what the master
+ * would show us.  Returns false, leaving the standby alone, if it didn't
+ * catch up or anything went wrong with it.
+ */
+static bool
+begin_standby_xact(ConnCacheEntry *standby, ConnCacheEntry *master)
+{
+	const char *lsn_sql = "SELECT pg_current_wal_insert_lsn()";
+	int			curlevel = GetCurrentTransactionNestLevel();
+	StringInfoData sql;
+	PGresult   *res;
+	bool		caught_up;
+	int			i;
 
-	if (copy_from_started)
-		*copy_from_started = &(entry->copy_from_started);
+	res = pgfdw_exec_query(master, lsn_sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		pgfdw_report_error(ERROR, res, master->conn, true, lsn_sql);
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT shardman.wait_replay('%s', %d)",
+					 PQgetvalue(res, 0, 0), StandbyWaitTimeout);
+	PQclear(res);
 
-	return entry;
+	if (!standby_exec(standby, sql.data, &res))
+		return false;
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		pgfdw_report_error(LOG, res, standby->conn, true, sql.data);
+		return false;
+	}
+	caught_up = strcmp(PQgetvalue(res, 0, 0), "t") == 0;
+	PQclear(res);
+	if (!caught_up)
+	{
+		elog(DEBUG1, "standby of server \"%s\" lags, reading from master",
+			 standby->servername);
+		return false;
+	}
+
+	/* as begin_remote_xact would do, in one round trip */
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, "START TRANSACTION READ ONLY%s",
+					 UseRepeatableRead ? " ISOLATION LEVEL REPEATABLE READ" : "");
+	for (i = 2; i <= curlevel; i++)
+		appendStringInfo(&sql, "; SAVEPOINT s%d", i);
+
+	if (!standby_exec(standby, sql.data, &res))
+		return false;
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		/* remote transaction state is unknown, don't reuse the connection */
+		pgfdw_report_error(LOG, res, standby->conn, true, sql.data);
+		disconnect_pg_server(standby);
+		standby->connect_failed_at = GetCurrentTimestamp();
+		return false;
+	}
+	PQclear(res);
+	standby->xact_depth = curlevel;
+	return true;
+}
+
+/*
+ * Run query on standby without throwing errors.  If the standby doesn't
+ * answer, the connection is closed and false returned; otherwise *result is
+ * the last result, which caller must check and clear.
+ */
+static bool
+standby_exec(ConnCacheEntry *standby, const char *sql, PGresult **result)
+{
+	TimestampTz endtime;
+
+	/* Wait for replay plus ample time for the network */
+	endtime = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										  StandbyWaitTimeout +
+										  STANDBY_QUERY_TIMEOUT);
+
+	ConnectionEntryFinishPending(standby);
+	if (!PQsendQuery(standby->conn, sql) ||
+		pgfdw_get_cleanup_result(standby, endtime, result))
+	{
+		pgfdw_report_error(LOG, NULL, standby->conn, false, sql);
+		disconnect_pg_server(standby);
+		standby->connect_failed_at = GetCurrentTimestamp();
+		return false;
+	}
+	return true;
 }
 
 PGconn *
@@ -270,15 +503,101 @@ GetConnection(UserMapping *user, bool will_prep_stmt)
 	return GetConnectionCopyFrom(user, will_prep_stmt, NULL);
 }
 
+/*
+ * Remember that the current transaction modifies something on the remote
+ * server.
+ *
+ * Only such connections take part in two-phase commit; transactions which
+ * merely read from the server are committed without it.  This must be called
+ * before anything is written, i.e. when the modification is set up.
+ */
+void
+ConnectionEntryMarkModified(ConnCacheEntry *entry)
+{
+	Assert(entry->xact_depth > 0);
+
+	if (!entry->modified)
+	{
+		entry->modified = true;
+		fdwTransState->nparticipants += 1;
+	}
+}
+
+/*
+ * Remember that a query was sent on the connection without waiting for its
+ * result.  Anyone who needs the connection afterwards must first call
+ * ConnectionEntryFinishPending, which runs the callback to collect the
+ * result on behalf of the query's owner.
+ *
+ * This allows scans of foreign tables on different servers to run
+ * concurrently: each of them sends its query as early as possible and only
+ * waits for the result when it actually needs it.
+ */
+void
+ConnectionEntrySetPending(ConnCacheEntry *entry, PgFdwPendingCallback callback,
+						  void *arg)
+{
+	Assert(entry->pending_cb == NULL);
+	entry->pending_cb = callback;
+	entry->pending_arg = arg;
+}
+
+/*
+ * Return the argument registered with the query in flight on the connection,
+ * or NULL if there is none.
+ */
+void *
+ConnectionEntryGetPending(ConnCacheEntry *entry)
+{
+	return entry->pending_cb ? entry->pending_arg : NULL;
+}
+
+/*
+ * Collect the result of the query in flight on the connection, if any, so
+ * that the connection can be used for something else.
+ */
+void
+ConnectionEntryFinishPending(ConnCacheEntry *entry)
+{
+	PgFdwPendingCallback callback = entry->pending_cb;
+	void	   *arg = entry->pending_arg;
+
+	if (callback == NULL)
+		return;
+
+	/* Forget the query first, so that the callback could use the connection */
+	entry->pending_cb = NULL;
+	entry->pending_arg = NULL;
+	callback(arg);
+}
+
+/*
+ * Account rows received by a foreign scan, and the size of their values.
+ */
+void
+ConnectionEntryCountFetch(ConnCacheEntry *entry, int64 rows, int64 bytes)
+{
+	entry->stats.rows_fetched += rows;
+	entry->stats.bytes_fetched += bytes;
+}
+
 /*
  * Connect to remote server using specified server and user mapping properties.
+ *
+ * If standby_hosts is given, connect to one of these instead.  Each backend
+ * starts from a different one, so that the load is spread over all of them,
+ * and libpq tries the rest if it is down.  Failure to reach them is not an
+ * error: entry is just left without connection.
  */
 static void
-connect_pg_server(ConnCacheEntry *entry, ForeignServer *server, UserMapping *user)
+connect_pg_server(ConnCacheEntry *entry, ForeignServer *server, UserMapping *user,
+				  List *standby_hosts)
 {
 	PGconn	   *volatile conn = NULL;
 
 	entry->wait_set = NULL;
+	entry->pending_cb = NULL;
+	entry->pending_arg = NULL;
 
 	/*
 	 * Use PG_TRY block to ensure closing connection on error.
@@ -288,14 +607,16 @@ connect_pg_server(ConnCacheEntry *entry, ForeignServer *server, UserMapping *use
 		const char **keywords;
 		const char **values;
 		int			n;
+		char	   *options;
 
 		/*
 		 * Construct connection params from generic options of ForeignServer
 		 * and UserMapping.  (Some of them might not be libpq options, in
-		 * which case we'll just waste a few array slots.)  Add 3 extra slots
-		 * for fallback_application_name, client_encoding, end marker.
+		 * which case we'll just waste a few array slots.)  Add 7 extra slots
+		 * for host and port of standbys, fallback_application_name,
+		 * client_encoding, application_name, options, end marker.
 		 */
-		n = list_length(server->options) + list_length(user->options) + 3;
+		n = list_length(server->options) + list_length(user->options) + 7;
 		keywords = (const char **) palloc(n * sizeof(char *));
 		values = (const char **) palloc(n * sizeof(char *));
 
@@ -305,6 +626,48 @@ connect_pg_server(ConnCacheEntry *entry, ForeignServer *server, UserMapping *use
 		n += ExtractConnectionOptions(user->options,
 									  keywords + n, values + n);
 
+		if (standby_hosts != NIL)
+		{
+			StringInfoData hosts;
+			StringInfoData ports;
+			int			nhosts = list_length(standby_hosts);
+			int			i;
+			int			j;
+
+			initStringInfo(&hosts);
+			initStringInfo(&ports);
+			for (i = 0; i < nhosts; i++)
+			{
+				char	   *host = list_nth(standby_hosts,
+											(MyProcPid + i) % nhosts);
+				char	   *colon = strrchr(host, ':');
+
+				appendStringInfo(&hosts, "%s%.*s", i > 0 ? "," : "",
+								 (int) (colon - host), host);
+				appendStringInfo(&ports, "%s%s", i > 0 ? "," : "", colon + 1);
+			}
+
+			/* drop master's address, if any */
+			for (i = j = 0; i < n; i++)
+			{
+				if (strcmp(keywords[i], "host") == 0 ||
+					strcmp(keywords[i], "hostaddr") == 0 ||
+					strcmp(keywords[i], "port") == 0)
+					continue;
+				keywords[j] = keywords[i];
+				values[j] = values[i];
+				j++;
+			}
+			n = j;
+
+			keywords[n] = "host";
+			values[n] = hosts.data;
+			n++;
+			keywords[n] = "port";
+			values[n] = ports.data;
+			n++;
+		}
+
 		/* Use "postgres_fdw" as fallback_application_name. */
 		keywords[n] = "fallback_application_name";
 		values[n] = "postgres_fdw";
@@ -315,43 +678,71 @@ connect_pg_server(ConnCacheEntry *entry, ForeignServer *server, UserMapping *use
 		values[n] = GetDatabaseEncodingName();
 		n++;
 
+		/*
+		 * Let the remote backend know who we are, see lock_graph.  Since this
+		 * and the session settings go in the startup packet, the connection
+		 * is ready for use right away, without any further round trips.
+		 */
+		keywords[n] = "application_name";
+		values[n] = psprintf("pgfdw:%lld:%d",
+							 (long long) GetSystemIdentifier(), MyProcPid);
+		n++;
+
+		options = remote_session_options(keywords, values);
+		keywords[n] = "options";
+		values[n] = options;
+		n++;
+
 		keywords[n] = values[n] = NULL;
 
 		/* verify connection parameters and make connection */
 		check_conn_params(keywords, values, user);
 
 		conn = PQconnectdbParams(keywords, values, false);
-		if (!conn || PQstatus(conn) != CONNECTION_OK)
-			ereport(ERROR,
+		if (standby_hosts != NIL && (!conn || PQstatus(conn) != CONNECTION_OK))
+		{
+			ereport(LOG,
 					(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
-					 errmsg("could not connect to server \"%s\"",
+					 errmsg("could not connect to any standby of server \"%s\"",
 							server->servername),
 					 errdetail_internal("%s", pchomp(PQerrorMessage(conn)))));
+			PQfinish(conn);
+			conn = NULL;
+		}
+		else
+		{
+			if (!conn || PQstatus(conn) != CONNECTION_OK)
+				ereport(ERROR,
+						(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
+						 errmsg("could not connect to server \"%s\"",
+								server->servername),
+						 errdetail_internal("%s", pchomp(PQerrorMessage(conn)))));
 
-		/*
-		 * Check that non-superuser has used password to establish connection;
-		 * otherwise, he's piggybacking on the postgres server's user
-		 * identity. See also dblink_security_check() in contrib/dblink.
-		 */
-		if (!superuser_arg(user->userid) && !PQconnectionUsedPassword(conn))
-			ereport(ERROR,
-					(errcode(ERRCODE_S_R_E_PROHIBITED_SQL_STATEMENT_ATTEMPTED),
-					 errmsg("password is required"),
-					 errdetail("Non-superuser cannot connect if the server does not request a password."),
-					 errhint("Target server's authentication method must be changed.")));
-
-		entry->conn = conn;
-
-		/* Here we will wait for the results */
-		/* xxx check for postmaster death? */
-		entry->wait_set = CreateWaitEventSet(TopMemoryContext, 2);
-		AddWaitEventToSet(entry->wait_set, WL_LATCH_SET, PGINVALID_SOCKET,
-						  MyLatch, NULL);
-		AddWaitEventToSet(entry->wait_set, WL_SOCKET_READABLE, PQsocket(conn), NULL, NULL);
-
-		/* Prepare new session for use */
-		configure_remote_session(entry);
+			/*
+			 * Check that non-superuser has used password to establish
+			 * connection; otherwise, he's piggybacking on the postgres
+			 * server's user identity. See also dblink_security_check() in
+			 * contrib/dblink.
+			 */
+			if (!superuser_arg(user->userid) && !PQconnectionUsedPassword(conn))
+				ereport(ERROR,
+						(errcode(ERRCODE_S_R_E_PROHIBITED_SQL_STATEMENT_ATTEMPTED),
+						 errmsg("password is required"),
+						 errdetail("Non-superuser cannot connect if the server does not request a password."),
+						 errhint("Target server's authentication method must be changed.")));
+
+			entry->conn = conn;
+			entry->last_used = GetCurrentTimestamp();
+
+			/* Here we will wait for the results */
+			/* xxx check for postmaster death? */
+			entry->wait_set = CreateWaitEventSet(TopMemoryContext, 2);
+			AddWaitEventToSet(entry->wait_set, WL_LATCH_SET, PGINVALID_SOCKET,
+							  MyLatch, NULL);
+			AddWaitEventToSet(entry->wait_set, WL_SOCKET_READABLE, PQsocket(conn), NULL, NULL);
+		}
 
+		pfree(options);
 		pfree(keywords);
 		pfree(values);
 	}
@@ -384,7 +775,10 @@ disconnect_pg_server(ConnCacheEntry *entry)
 		entry->wait_set = NULL;
 		PQfinish(entry->conn);
 		entry->conn = NULL;
+		entry->pending_cb = NULL;
+		entry->pending_arg = NULL;
 	}
+	forget_prepared_scans(entry);
 }
 
 /*
@@ -417,7 +811,9 @@ check_conn_params(const char **keywords, const char **values, UserMapping *user)
 }
 
 /*
- * Issue SET commands to make sure remote session is configured properly.
+ * Build the "options" connection parameter making sure remote session is
+ * configured properly.  Options given in connection parameters, if any, are
+ * kept, but ours take precedence.
  *
  * We do this just once at connection, assuming nothing will change the
  * values later.  Since we'll never send volatile function calls to the
@@ -427,13 +823,21 @@ check_conn_params(const char **keywords, const char **values, UserMapping *user)
  * but once you admit the possibility of a malicious view definition,
  * there are any number of ways to break things.
  */
-static void
-configure_remote_session(ConnCacheEntry *entry)
+static char *
+remote_session_options(const char **keywords, const char **values)
 {
-	int			remoteversion = PQserverVersion(entry->conn);
+	StringInfoData buf;
+	int			i;
+
+	initStringInfo(&buf);
+	for (i = 0; keywords[i] != NULL; i++)
+	{
+		if (strcmp(keywords[i], "options") == 0)
+			appendStringInfo(&buf, "%s ", values[i]);
+	}
 
 	/* Force the search path to contain only pg_catalog (see deparse.c) */
-	do_sql_command(entry, "SET search_path = pg_catalog");
+	appendStringInfoString(&buf, "-c search_path=pg_catalog");
 
 	/*
 	 * Set remote timezone; this is basically just cosmetic, since all
@@ -441,23 +845,21 @@ configure_remote_session(ConnCacheEntry *entry)
 	 * anyway.  However it makes the regression test outputs more predictable.
 	 *
 	 * We don't risk setting remote zone equal to ours, since the remote
-	 * server might use a different timezone database.  Instead, use UTC
-	 * (quoted, because very old servers are picky about case).
+	 * server might use a different timezone database.  Instead, use UTC.
 	 */
-	do_sql_command(entry, "SET timezone = 'UTC'");
+	appendStringInfoString(&buf, " -c timezone=UTC");
 
 	/*
 	 * Set values needed to ensure unambiguous data output from remote.  (This
 	 * logic should match what pg_dump does.  See also set_transmission_modes
-	 * in postgres_fdw.c.)
+	 * in postgres_fdw.c.)  The remote version isn't known before connecting,
+	 * so we assume it is at least 9.0, as anything in one cluster is.
 	 */
-	do_sql_command(entry, "SET datestyle = ISO");
-	if (remoteversion >= 80400)
-		do_sql_command(entry, "SET intervalstyle = postgres");
-	if (remoteversion >= 90000)
-		do_sql_command(entry, "SET extra_float_digits = 3");
-	else
-		do_sql_command(entry, "SET extra_float_digits = 2");
+	appendStringInfoString(&buf, " -c datestyle=ISO");
+	appendStringInfoString(&buf, " -c intervalstyle=postgres");
+	appendStringInfoString(&buf, " -c extra_float_digits=3");
+
+	return buf.data;
 }
 
 /*
@@ -470,6 +872,7 @@ do_sql_command(ConnCacheEntry *entry, const char *sql)
 	PGconn	   *conn = entry->conn;
 	PGresult   *res;
 
+	ConnectionEntryFinishPending(entry);
 	if (!PQsendQuery(conn, sql))
 		pgfdw_report_error(ERROR, NULL, conn, false, sql);
 	res = pgfdw_get_result(entry, sql);
@@ -479,6 +882,20 @@ do_sql_command(ConnCacheEntry *entry, const char *sql)
 	PQclear(res);
 }
 
+/*
+ * Our global snapshot, exported on first use in the transaction.
+ */
+static GlobalCSN
+get_global_csn(void)
+{
+	if (!IsolationUsesXactSnapshot() || IsolationIsSerializable())
+		elog(ERROR, "Global snapshots support only REPEATABLE READ");
+
+	if (fdwTransState->global_csn == 0)
+		fdwTransState->global_csn = ExportGlobalSnapshot();
+	return fdwTransState->global_csn;
+}
+
 /*
  * Start remote transaction or subtransaction, if needed.
  *
@@ -493,8 +910,7 @@ static void
 begin_remote_xact(ConnCacheEntry *entry)
 {
 	int			curlevel = GetCurrentTransactionNestLevel();
-	char		sql[128];
-
+	char		sql[256];
 
 	/* Start main transaction if we haven't yet */
 	if (entry->xact_depth <= 0)
@@ -502,36 +918,23 @@ begin_remote_xact(ConnCacheEntry *entry)
 		elog(DEBUG3, "starting remote transaction on connection %p",
 			 entry->conn);
 
-		if (UseGlobalSnapshots && (!IsolationUsesXactSnapshot() ||
-								   IsolationIsSerializable()))
-			elog(ERROR, "Global snapshots support only REPEATABLE READ");
+		snprintf(sql, sizeof(sql), "START TRANSACTION %s",
+				 IsolationIsSerializable() ? "ISOLATION LEVEL SERIALIZABLE" :
+				 UseRepeatableRead ? "ISOLATION LEVEL REPEATABLE READ" : "");
 
-		sprintf(sql, "START TRANSACTION %s; set application_name='pgfdw:%lld:%d';",
-				IsolationIsSerializable() ? "ISOLATION LEVEL SERIALIZABLE" :
-				UseRepeatableRead ? "ISOLATION LEVEL REPEATABLE READ" : "",
-				(long long) GetSystemIdentifier(), MyProcPid);
+		/*
+		 * Import our snapshot in the same round trip; if START TRANSACTION
+		 * fails, the server won't run it.
+		 */
+		if (UseGlobalSnapshots)
+			snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql),
+					 "; SELECT pg_global_snapshot_import("UINT64_FORMAT")",
+					 get_global_csn());
 
 		entry->changing_xact_state = true;
 		do_sql_command(entry, sql);
 		entry->xact_depth = 1;
 		entry->changing_xact_state = false;
-
-		if (UseGlobalSnapshots)
-		{
-			char import_sql[128];
-
-			/* Export our snapshot */
-			if (fdwTransState->global_csn == 0)
-				fdwTransState->global_csn = ExportGlobalSnapshot();
-
-			snprintf(import_sql, sizeof(import_sql),
-				"SELECT pg_global_snapshot_import("UINT64_FORMAT")",
-				fdwTransState->global_csn);
-
-			do_sql_command(entry, import_sql);
-		}
-
-		fdwTransState->nparticipants += 1;
 	}
 
 	/*
@@ -595,6 +998,98 @@ GetPrepStmtNumber(ConnCacheEntry *entry)
 	return ++prep_stmt_number;
 }
 
+/*
+ * Name of the statement prepared for scan query on entry's connection, or
+ * NULL if it is not prepared there yet.
+ *
+ * Unlike statements of foreign modifications, these are not deallocated once
+ * the scan ends, so each query is parsed by the remote server only once per
+ * connection. They live until the connection is closed or DEALLOCATE ALL is
+ * done after errors.
+ */
+const char *
+GetPreparedScan(ConnCacheEntry *entry, const char *query)
+{
+	PrepScanEntry *prep;
+
+	if (entry->prep_scans == NULL)
+		return NULL;
+	prep = hash_search(entry->prep_scans, &query, HASH_FIND, NULL);
+	return prep != NULL ? prep->name : NULL;
+}
+
+/*
+ * Remember that scan query was prepared as statement name on entry's
+ * connection.
+ */
+void
+RememberPreparedScan(ConnCacheEntry *entry, const char *query,
+					 const char *name)
+{
+	PrepScanEntry *prep;
+	char	   *key;
+	bool		found;
+
+	if (entry->prep_scans == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(char *);
+		ctl.entrysize = sizeof(PrepScanEntry);
+		ctl.hash = prep_scan_hash;
+		ctl.match = prep_scan_match;
+		ctl.hcxt = CacheMemoryContext;
+		entry->prep_scans = hash_create("postgres_fdw prepared scans", 8,
+										&ctl,
+										HASH_ELEM | HASH_FUNCTION |
+										HASH_COMPARE | HASH_CONTEXT);
+	}
+
+	/* Copy the key first, so the entry never points to caller's memory */
+	key = MemoryContextStrdup(CacheMemoryContext, query);
+	prep = hash_search(entry->prep_scans, &key, HASH_ENTER, &found);
+	if (found)
+		pfree(key);
+	strlcpy(prep->name, name, NAMEDATALEN);
+}
+
+/* Keys of prep_scans are pointers to query texts */
+static uint32
+prep_scan_hash(const void *key, Size keysize)
+{
+	const char *query = *(char *const *) key;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) query,
+								   strlen(query)));
+}
+
+static int
+prep_scan_match(const void *key1, const void *key2, Size keysize)
+{
+	return strcmp(*(char *const *) key1, *(char *const *) key2);
+}
+
+/*
+ * Forget scans prepared on entry's connection, as it is closed or they are
+ * about to be deallocated.
+ */
+static void
+forget_prepared_scans(ConnCacheEntry *entry)
+{
+	HASH_SEQ_STATUS scan;
+	PrepScanEntry *prep;
+
+	if (entry->prep_scans == NULL)
+		return;
+
+	hash_seq_init(&scan, entry->prep_scans);
+	while ((prep = (PrepScanEntry *) hash_seq_search(&scan)))
+		pfree(prep->query);
+	hash_destroy(entry->prep_scans);
+	entry->prep_scans = NULL;
+}
+
 /*
  * Submit a query and wait for the result.
  *
@@ -605,6 +1100,9 @@ GetPrepStmtNumber(ConnCacheEntry *entry)
 PGresult *
 pgfdw_exec_query(ConnCacheEntry *entry, const char *query)
 {
+	/* Make sure nobody else's result is still on the way */
+	ConnectionEntryFinishPending(entry);
+
 	/*
 	 * Submit a query.  Since we don't use non-blocking mode, this also can
 	 * block.  But its risk is relatively small, so we ignore that for now.
@@ -632,6 +1130,8 @@ pgfdw_get_result(ConnCacheEntry *entry, const char *query)
 	PGconn	   *conn = entry->conn;
 	PGresult   *volatile last_res = NULL;
 
+	entry->stats.round_trips++;
+
 	/* In what follows, do not leak any PGresults on an error. */
 	PG_TRY();
 	{
@@ -642,9 +1142,15 @@ pgfdw_get_result(ConnCacheEntry *entry, const char *query)
 			while (PQisBusy(conn))
 			{
 				WaitEvent	ev;
+				instr_time	start;
+				instr_time	duration;
 
 				/* Sleep until there's something to do */
+				INSTR_TIME_SET_CURRENT(start);
 				WaitEventSetWait(entry->wait_set, -1L, &ev, 1, PG_WAIT_EXTENSION);
+				INSTR_TIME_SET_CURRENT(duration);
+				INSTR_TIME_SUBTRACT(duration, start);
+				entry->stats.wait_time += INSTR_TIME_GET_MILLISEC(duration);
 				ResetLatch(MyLatch);
 
 				CHECK_FOR_INTERRUPTS();
@@ -739,26 +1245,281 @@ pgfdw_report_error(int elevel, PGresult *res, PGconn *conn,
 		PQclear(res);
 }
 
+/*
+ * COPY FROM data is accumulated per connection up to this size before being
+ * handed to libpq.
+ */
+#define PGFDW_COPY_BUF_SIZE		(64 * 1024)
+
+/*
+ * libpq is in nonblocking mode during COPY FROM and would queue any amount
+ * of data for a slow server; once this much is queued, we wait for it to be
+ * sent, meanwhile pushing data to the other servers as well.
+ */
+#define PGFDW_COPY_MAX_QUEUED	(1024 * 1024)
+
+/*
+ * Switch connection to the mode used for streaming COPY FROM data, after
+ * the COPY command has been accepted by the remote server.
+ */
+void
+pgfdw_copy_start(ConnCacheEntry *entry)
+{
+	if (PQsetnonblocking(entry->conn, 1) != 0)
+		pgfdw_report_error(ERROR, NULL, entry->conn, false,
+						   "postgres_fdw copy from");
+
+	if (entry->copy_buf == NULL)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+		entry->copy_buf = makeStringInfo();
+		enlargeStringInfo(entry->copy_buf, PGFDW_COPY_BUF_SIZE);
+		MemoryContextSwitchTo(oldcxt);
+	}
+	resetStringInfo(entry->copy_buf);
+	entry->copy_from_started = true;
+}
+
+/*
+ * Has the server given up COPY FROM on the connection, i.e. sent an error?
+ * If readable is true, the socket has data which is consumed first.
+ */
+static bool
+pgfdw_copy_failed(ConnCacheEntry *entry, bool readable)
+{
+	if (readable && PQconsumeInput(entry->conn) == 0)
+		return true;
+	return entry->conn->asyncStatus != PGASYNC_COPY_IN;
+}
+
+/*
+ * Report failure of COPY FROM on the connection, with the server's error if
+ * it has sent one.
+ */
+static void
+pgfdw_copy_report_error(ConnCacheEntry *entry)
+{
+	PGresult   *res = NULL;
+
+	if (entry->conn->asyncStatus != PGASYNC_COPY_IN)
+		res = PQgetResult(entry->conn);
+	pgfdw_report_error(ERROR, res, entry->conn, true,
+					   "postgres_fdw copy from");
+}
+
+/*
+ * Wait until everything libpq has queued for the given connection is sent.
+ *
+ * Data for all other servers currently receiving COPY FROM is pushed out
+ * while we wait, so that one busy server doesn't stall the others.  We also
+ * read what the servers send meanwhile: a server which has stopped reading
+ * its socket to report an error would otherwise never become writeable, and
+ * the error is thrown as soon as it arrives.
+ */
+static void
+pgfdw_copy_wait_flushed(ConnCacheEntry *target)
+{
+	for (;;)
+	{
+		HASH_SEQ_STATUS scan;
+		ConnCacheEntry *entry;
+		ConnCacheEntry *failed = NULL;
+		WaitEventSet *set;
+		WaitEvent	ev;
+		bool		target_done = false;
+		int			nwaiting = 0;
+		instr_time	start;
+		instr_time	duration;
+
+		/* Count the connections we might wait for */
+		hash_seq_init(&scan, ConnectionHash);
+		while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+		{
+			if (entry->conn != NULL && entry->copy_from_started)
+				nwaiting++;
+		}
+
+		set = CreateWaitEventSet(CurrentMemoryContext, nwaiting + 1);
+		AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+
+		hash_seq_init(&scan, ConnectionHash);
+		while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+		{
+			int			rc;
+
+			if (entry->conn == NULL || !entry->copy_from_started)
+				continue;
+
+			/* Send what we can without blocking */
+			rc = PQflush(entry->conn);
+			if (rc < 0 || pgfdw_copy_failed(entry, false))
+			{
+				failed = entry;
+				hash_seq_term(&scan);
+				break;
+			}
+			if (rc == 0 && entry == target)
+				target_done = true;
+			AddWaitEventToSet(set,
+							  WL_SOCKET_READABLE |
+							  (rc == 1 ? WL_SOCKET_WRITEABLE : 0),
+							  PQsocket(entry->conn), NULL, entry);
+		}
+
+		if (failed == NULL && !target_done)
+		{
+			INSTR_TIME_SET_CURRENT(start);
+			WaitEventSetWait(set, -1L, &ev, 1, PG_WAIT_EXTENSION);
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start);
+			target->stats.wait_time += INSTR_TIME_GET_MILLISEC(duration);
+
+			if ((ev.events & WL_SOCKET_READABLE) &&
+				pgfdw_copy_failed((ConnCacheEntry *) ev.user_data, true))
+				failed = (ConnCacheEntry *) ev.user_data;
+		}
+		FreeWaitEventSet(set);
+
+		if (failed != NULL)
+			pgfdw_copy_report_error(failed);
+		if (target_done)
+			return;
+
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Hand the accumulated COPY FROM data of the connection over to libpq.
+ */
+static void
+pgfdw_copy_send(ConnCacheEntry *entry)
+{
+	StringInfo	buf = entry->copy_buf;
+
+	if (buf->len > 0)
+	{
+		/*
+		 * In nonblocking mode libpq grows its output buffer rather than
+		 * refusing the data, so anything but 1 is a failure.  libpq also
+		 * parses pending input here, so an error the server has already sent
+		 * is noticed.
+		 */
+		if (PQputCopyData(entry->conn, buf->data, buf->len) != 1 ||
+			pgfdw_copy_failed(entry, false))
+			pgfdw_copy_report_error(entry);
+		resetStringInfo(buf);
+	}
+
+	if (entry->conn->outCount > PGFDW_COPY_MAX_QUEUED)
+		pgfdw_copy_wait_flushed(entry);
+}
+
+/*
+ * Send a piece of COPY FROM data to the remote server.  Data is buffered, so
+ * it actually goes out in large chunks.
+ */
+void
+pgfdw_copy_data(ConnCacheEntry *entry, const char *data, int len)
+{
+	Assert(entry->copy_from_started);
+
+	entry->stats.copy_bytes += len;
+	appendBinaryStringInfo(entry->copy_buf, data, len);
+	if (entry->copy_buf->len >= PGFDW_COPY_BUF_SIZE)
+		pgfdw_copy_send(entry);
+}
+
+/*
+ * Finish COPY FROM on all connections to which it was started.
+ *
+ * All servers are told about the end of data first, and only then we wait for
+ * their replies, so that they finish concurrently.
+ */
+void
+pgfdw_copy_end_all(void)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+
+	/* Send the rest of data and end-of-data marker everywhere */
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn == NULL || !entry->copy_from_started)
+			continue;
+
+		PG_TRY();
+		{
+			pgfdw_copy_send(entry);
+			if (PQputCopyEnd(entry->conn, NULL) != 1)
+				pgfdw_copy_report_error(entry);
+		}
+		PG_CATCH();
+		{
+			hash_seq_term(&scan);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	/* Now collect the results */
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		PGresult   *res;
+
+		if (entry->conn == NULL || !entry->copy_from_started)
+			continue;
+
+		PG_TRY();
+		{
+			pgfdw_copy_wait_flushed(entry);
+			entry->copy_from_started = false;
+			if (PQsetnonblocking(entry->conn, 0) != 0)
+				pgfdw_report_error(ERROR, NULL, entry->conn, false,
+								   "postgres_fdw copy from");
+
+			res = pgfdw_get_result(entry, "postgres_fdw copy from");
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+				pgfdw_report_error(ERROR, res, entry->conn, true,
+								   "postgres_fdw copy from");
+			PQclear(res);
+		}
+		PG_CATCH();
+		{
+			hash_seq_term(&scan);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+}
+
 /* Callback typedef for BroadcastStmt */
 typedef bool (*BroadcastCmdResHandler) (PGresult *result, void *arg);
 
-/* Broadcast sql in parallel to all ConnectionHash entries */
-static bool
-BroadcastStmt(char const * sql, unsigned expectedStatus,
-				BroadcastCmdResHandler handler, void *arg)
+/*
+ * Send sql to all ConnectionHash entries with open remote transaction which
+ * did (if modified is true) or did not modify anything, without waiting for
+ * the answers; BroadcastCollect gets them.
+ */
+static void
+BroadcastSend(char const *sql, bool modified)
 {
 	HASH_SEQ_STATUS scan;
 	ConnCacheEntry *entry;
-	bool		allOk = true;
 
-	/* Broadcast sql */
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
 		pgfdw_reject_incomplete_xact_state_change(entry);
 
-		if (entry->xact_depth > 0 && entry->conn != NULL)
+		if (entry->xact_depth > 0 && entry->conn != NULL &&
+			entry->modified == modified)
 		{
+			ConnectionEntryFinishPending(entry);
 			if (!PQsendQuery(entry->conn, sql))
 			{
 				PGresult   *res = PQgetResult(entry->conn);
@@ -769,42 +1530,106 @@ BroadcastStmt(char const * sql, unsigned expectedStatus,
 			}
 		}
 	}
+}
+
+/*
+ * Collect responses to sql sent by BroadcastSend with the same modified.
+ * sql might consist of several statements, in which case all of them but
+ * those giving expectedStatus must be utility commands; handler sees only the
+ * results of the latter. If a statement fails, the server skips the rest, so
+ * we get just the error. Time since start until each entry answered is
+ * accounted as the given 2PC phase.
+ *
+ * Failures are only reported as warnings and false is returned: results of
+ * all entries must be read before the caller decides what to do, e.g. sends
+ * ABORT PREPARED to those which have prepared.
+ */
+static bool
+BroadcastCollect(char const *sql, bool modified, unsigned expectedStatus,
+				 BroadcastCmdResHandler handler, void *arg,
+				 PgFdwStatsPhase phase, instr_time start)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	bool		allOk = true;
 
-	/* Collect responses */
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
-		if (entry->xact_depth > 0 && entry->conn != NULL)
+		if (entry->xact_depth > 0 && entry->conn != NULL &&
+			entry->modified == modified)
 		{
-			PGresult   *result = PQgetResult(entry->conn);
+			PGresult   *result;
+			bool		gotExpected = false;
+			instr_time	duration;
 
-			if (PQresultStatus(result) != expectedStatus ||
-				(handler && !handler(result, arg)))
+			entry->stats.round_trips++;
+			while ((result = PQgetResult(entry->conn)) != NULL)
 			{
-				elog(WARNING, "Failed command %s: status=%d, expected status=%d", sql, PQresultStatus(result), expectedStatus);
-				pgfdw_report_error(ERROR, result, entry->conn, true, sql);
+				ExecStatusType status = PQresultStatus(result);
+
+				if (status == expectedStatus)
+				{
+					gotExpected = true;
+					if (handler && !handler(result, arg))
+						status = PGRES_FATAL_ERROR;
+				}
+				if (status != expectedStatus && status != PGRES_COMMAND_OK)
+				{
+					elog(WARNING, "Failed command %s: status=%d, expected status=%d", sql, PQresultStatus(result), expectedStatus);
+					pgfdw_report_error(WARNING, result, entry->conn, false, sql);
+					allOk = false;
+				}
+				PQclear(result);
+			}
+			if (!gotExpected)
+			{
+				elog(WARNING, "Failed command %s: no result with expected status=%d", sql, expectedStatus);
 				allOk = false;
 			}
-			PQclear(result);
-			PQgetResult(entry->conn);	/* consume NULL result */
+
+			if (phase != PGFDW_PHASE_NONE)
+			{
+				INSTR_TIME_SET_CURRENT(duration);
+				INSTR_TIME_SUBTRACT(duration, start);
+				entry->stats.phase_count[phase]++;
+				entry->stats.phase_time[phase] += INSTR_TIME_GET_MILLISEC(duration);
+			}
 		}
 	}
 
 	return allOk;
 }
 
-/* Wrapper for broadcasting commands */
+/*
+ * Broadcast sql in parallel to all ConnectionHash entries with open remote
+ * transaction which did (if modified is true) or did not modify anything.
+ */
+static bool
+BroadcastStmt(char const *sql, bool modified, unsigned expectedStatus,
+			  BroadcastCmdResHandler handler, void *arg,
+			  PgFdwStatsPhase phase)
+{
+	instr_time	start;
+
+	INSTR_TIME_SET_CURRENT(start);
+	BroadcastSend(sql, modified);
+	return BroadcastCollect(sql, modified, expectedStatus, handler, arg,
+							phase, start);
+}
+
+/* Wrapper for broadcasting commands to 2PC participants */
 static bool
-BroadcastCmd(char const *sql)
+BroadcastCmd(char const *sql, PgFdwStatsPhase phase)
 {
-	return BroadcastStmt(sql, PGRES_COMMAND_OK, NULL, NULL);
+	return BroadcastStmt(sql, true, PGRES_COMMAND_OK, NULL, NULL, phase);
 }
 
-/* Wrapper for broadcasting statements */
+/* Wrapper for broadcasting statements to 2PC participants */
 static bool
-BroadcastFunc(char const *sql)
+BroadcastFunc(char const *sql, PgFdwStatsPhase phase)
 {
-	return BroadcastStmt(sql, PGRES_TUPLES_OK, NULL, NULL);
+	return BroadcastStmt(sql, true, PGRES_TUPLES_OK, NULL, NULL, phase);
 }
 
 /* Callback for selecting maximal csn */
@@ -827,6 +1652,38 @@ MaxCsnCB(PGresult *result, void *arg)
 	return true;
 }
 
+/*
+ * Broadcast PREPARE TRANSACTION and pg_global_snapshot_prepare() for it to
+ * participants, and COMMIT to nodes we only read from: those needn't 2PC.
+ *
+ * Both prepare statements go in one query string, so preparing costs a single
+ * round trip; if PREPARE fails, the server doesn't run the second one. COMMIT
+ * is sent before waiting for any answer, so it takes no round trip of its
+ * own either. Maximal prepare csn of the participants is accumulated in
+ * *max_csn. All answers are read even if some of them are failures, so on
+ * false the caller can ABORT PREPARED right away.
+ */
+static bool
+BroadcastPrepare(char const *gid, GlobalCSN *max_csn)
+{
+	const char *commit_sql = "COMMIT TRANSACTION";
+	char	   *sql;
+	instr_time	start;
+	bool		readersOk;
+
+	sql = psprintf("PREPARE TRANSACTION '%s'; "
+				   "SELECT pg_global_snapshot_prepare('%s')",
+				   gid, gid);
+
+	INSTR_TIME_SET_CURRENT(start);
+	BroadcastSend(commit_sql, false);
+	BroadcastSend(sql, true);
+	readersOk = BroadcastCollect(commit_sql, false, PGRES_COMMAND_OK,
+								 NULL, NULL, PGFDW_PHASE_NONE, start);
+	return BroadcastCollect(sql, true, PGRES_TUPLES_OK, MaxCsnCB, max_csn,
+							PGFDW_PHASE_PREPARE, start) && readersOk;
+}
+
 /*
  * pgfdw_xact_callback --- cleanup at main-transaction end.
  */
@@ -835,10 +1692,20 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 {
 	HASH_SEQ_STATUS scan;
 	ConnCacheEntry *entry;
+	TimestampTz now;
 
-	/* Quick exit if no connections were touched in this transaction. */
+	/*
+	 * Quick exit if no connections were touched in this transaction.  Idle
+	 * ones are still closed, otherwise they would stay open until some
+	 * transaction uses the fdw again.
+	 */
 	if (!xact_got_connection)
+	{
+		if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+			event == XACT_EVENT_PREPARE)
+			pgfdw_close_idle_connections();
 		return;
+	}
 
 	/*
 	 * Hack for shardman loader: it allows to do 2PC on user-issued
@@ -879,35 +1746,34 @@ pgfdw_xact_callback(XactEvent event, void *arg)
 			 */
 			return;
 		}
-		sql = psprintf("PREPARE TRANSACTION '%s'", fdwTransState->gid);
-		res = BroadcastCmd(sql);
+		pgfdw_trace_start();
+
+		/*
+		 * Broadcast PREPARE along with pg_global_snapshot_prepare(); nodes
+		 * we only read from are just committed
+		 */
+		res = BroadcastPrepare(fdwTransState->gid, &max_csn);
 		if (!res)
 			goto error;
 
-		/* Broadcast pg_global_snapshot_prepare() */
 		my_csn = GlobalSnapshotPrepareTwophase(fdwTransState->gid);
 
-		sql = psprintf("SELECT pg_global_snapshot_prepare('%s')",
-					   fdwTransState->gid);
-		res = BroadcastStmt(sql, PGRES_TUPLES_OK, MaxCsnCB, &max_csn);
-		if (!res)
-			goto error;
-
 		/* select maximal global csn */
 		if (my_csn > max_csn)
 			max_csn = my_csn;
 
 		/* Broadcast pg_global_snapshot_assign() */
+		fdwTransState->max_csn = max_csn;
 		GlobalSnapshotAssignCsnTwoPhase(fdwTransState->gid, max_csn);
 		sql = psprintf("SELECT pg_global_snapshot_assign('%s',"UINT64_FORMAT")",
 					   fdwTransState->gid, max_csn);
-		res = BroadcastFunc(sql);
+		res = BroadcastFunc(sql, PGFDW_PHASE_ASSIGN);
 
 error:
 		if (!res)
 		{
 			sql = psprintf("ABORT PREPARED '%s'", fdwTransState->gid);
-			BroadcastCmd(sql);
+			BroadcastCmd(sql, PGFDW_PHASE_NONE);
 			elog(ERROR, "failed to PREPARE transaction on remote node, ABORT PREPARED this xact");
 		}
 	}
@@ -946,39 +1812,37 @@ error:
 					 GetCurrentTransactionIdIfAny(),
 					 ++two_phase_xact_count,
 					 fdwTransState->nparticipants);
+			pgfdw_trace_start();
 
-			/* Broadcast PREPARE */
-			sql = psprintf("PREPARE TRANSACTION '%s'", fdwTransState->gid);
-			res = BroadcastCmd(sql);
+			/*
+			 * Broadcast PREPARE along with pg_global_snapshot_prepare();
+			 * nodes we only read from needn't 2PC, they are just committed
+			 * in the same round trip.
+			 */
+			res = BroadcastPrepare(fdwTransState->gid, &max_csn);
 			if (!res)
 				goto error_user2pc;
 
-			/* Broadcast pg_global_snapshot_prepare() */
 			if (include_local_tx)
 				my_csn = GlobalSnapshotPrepareCurrent();
 
-			sql = psprintf("SELECT pg_global_snapshot_prepare('%s')",
-						   fdwTransState->gid);
-			res = BroadcastStmt(sql, PGRES_TUPLES_OK, MaxCsnCB, &max_csn);
-			if (!res)
-				goto error_user2pc;
-
 			/* select maximal global csn */
 			if (include_local_tx && my_csn > max_csn)
 				max_csn = my_csn;
 
 			/* Broadcast pg_global_snapshot_assign() */
+			fdwTransState->max_csn = max_csn;
 			if (include_local_tx)
 				GlobalSnapshotAssignCsnCurrent(max_csn);
 			sql = psprintf("SELECT pg_global_snapshot_assign('%s',"UINT64_FORMAT")",
 						   fdwTransState->gid, max_csn);
-			res = BroadcastFunc(sql);
+			res = BroadcastFunc(sql, PGFDW_PHASE_ASSIGN);
 
 error_user2pc:
 			if (!res)
 			{
 				sql = psprintf("ABORT PREPARED '%s'", fdwTransState->gid);
-				BroadcastCmd(sql);
+				BroadcastCmd(sql, PGFDW_PHASE_NONE);
 				elog(ERROR, "Failed to PREPARE transaction on remote node");
 			}
 
@@ -993,13 +1857,26 @@ error_user2pc:
 	if (fdwTransState->two_phase_commit &&
 		(event == XACT_EVENT_PARALLEL_COMMIT || event == XACT_EVENT_COMMIT))
 	{
-		BroadcastCmd(psprintf("COMMIT PREPARED '%s'", fdwTransState->gid));
+		BroadcastCmd(psprintf("COMMIT PREPARED '%s'", fdwTransState->gid),
+					 PGFDW_PHASE_COMMIT);
+	}
+
+	/* Log the traced 2PC once we know how it ended */
+	if (fdwTransState->traced)
+	{
+		if (event == XACT_EVENT_PARALLEL_COMMIT || event == XACT_EVENT_COMMIT)
+			pgfdw_trace_report("committed");
+		else if (event == XACT_EVENT_PARALLEL_ABORT || event == XACT_EVENT_ABORT)
+			pgfdw_trace_report("aborted");
+		else if (event == XACT_EVENT_POST_PREPARE)
+			pgfdw_trace_report("prepared");
 	}
 
 	/*
 	 * Scan all connection cache entries to find open remote transactions, and
 	 * close them.
 	 */
+	now = GetCurrentTimestamp();
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
@@ -1007,6 +1884,19 @@ error_user2pc:
 		if (entry->conn == NULL)
 			continue;
 
+		/*
+		 * COPY FROM could only be left unfinished by an error; go back to
+		 * blocking mode which the rest of the code expects, unless abort
+		 * cleanup has already done that.
+		 */
+		if (entry->copy_from_started)
+		{
+			entry->copy_from_started = false;
+			resetStringInfo(entry->copy_buf);
+			if (PQsetnonblocking(entry->conn, 0) != 0)
+				entry->changing_xact_state = true;
+		}
+
 		/* If it has an open remote transaction, try to close it */
 		if (entry->xact_depth > 0)
 		{
@@ -1092,6 +1982,9 @@ error_user2pc:
 
 					/* Assume we might have lost track of prepared statements */
 					entry->have_error = true;
+					/* and DEALLOCATE ALL below drops prepared scans as well */
+					if (entry->have_prep_stmt)
+						forget_prepared_scans(entry);
 
 					/*
 					 * If a command has been submitted to the remote server by
@@ -1142,7 +2035,19 @@ error_user2pc:
 		}
 
 		/* Reset state to show we're out of a transaction */
+		if (entry->xact_depth > 0)
+			entry->last_used = now;
 		entry->xact_depth = 0;
+		entry->modified = false;
+
+		pgfdw_stats_flush(entry->serverid, &entry->stats);
+
+		/*
+		 * Whoever sent an asynchronous query is gone by now; on abort its
+		 * result was discarded by the cancellation above.
+		 */
+		entry->pending_cb = NULL;
+		entry->pending_arg = NULL;
 
 		/*
 		 * If the connection isn't in a good idle state, discard it to
@@ -1155,6 +2060,15 @@ error_user2pc:
 			elog(DEBUG3, "discarding connection %p", entry->conn);
 			disconnect_pg_server(entry);
 		}
+		else if (pgfdw_idle_expired(entry, now))
+		{
+			/*
+			 * Don't keep a remote backend busy for a server we don't talk to
+			 * anymore.
+			 */
+			elog(DEBUG3, "closing idle connection %p", entry->conn);
+			disconnect_pg_server(entry);
+		}
 	}
 
 	/*
@@ -1171,6 +2085,71 @@ error_user2pc:
 	memset(fdwTransState, '\0', sizeof(FdwTransactionState));
 }
 
+/*
+ * Decide whether the 2PC being started is traced.
+ */
+static void
+pgfdw_trace_start(void)
+{
+	fdwTransState->traced = Trace2PCSampleRate > 0 &&
+		random() <= Trace2PCSampleRate * MAX_RANDOM_VALUE;
+	if (fdwTransState->traced)
+		INSTR_TIME_SET_CURRENT(fdwTransState->trace_start);
+}
+
+/*
+ * Log the gid, csn and per-participant phase timings of the traced 2PC.
+ *
+ * Counters of the current transaction are not flushed yet, so phase times of
+ * the entries are exactly those of this 2PC.
+ */
+static void
+pgfdw_trace_report(const char *outcome)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	StringInfoData buf;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, fdwTransState->trace_start);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "2PC %s %s in %.3f ms, max csn " UINT64_FORMAT ", participants:",
+					 fdwTransState->gid, outcome,
+					 INSTR_TIME_GET_MILLISEC(duration),
+					 fdwTransState->max_csn);
+
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		static const char *const phase_names[PGFDW_NUM_PHASES] = {
+			"prepare", "assign", "commit"
+		};
+		int			phase;
+
+		if (entry->conn == NULL || entry->xact_depth == 0 || !entry->modified)
+			continue;
+
+		appendStringInfo(&buf, " %s (", entry->servername);
+		for (phase = 0; phase < PGFDW_NUM_PHASES; phase++)
+		{
+			if (phase > 0)
+				appendStringInfoString(&buf, ", ");
+			if (entry->stats.phase_count[phase] > 0)
+				appendStringInfo(&buf, "%s %.3f ms", phase_names[phase],
+								 entry->stats.phase_time[phase]);
+			else
+				appendStringInfo(&buf, "%s -", phase_names[phase]);
+		}
+		appendStringInfoChar(&buf, ')');
+	}
+
+	hp_elog(LOG, "%s", buf.data);
+	pfree(buf.data);
+	fdwTransState->traced = false;
+}
+
 /*
  * If there were any errors in subtransactions, and we
  * made prepared statements, do a DEALLOCATE ALL to make
@@ -1193,6 +2172,7 @@ deallocate_prepared_stmts(ConnCacheEntry *entry)
 
 	if (entry->have_prep_stmt && entry->have_error)
 	{
+		forget_prepared_scans(entry);
 		res = PQexec(entry->conn, "DEALLOCATE ALL");
 		PQclear(res);
 	}
@@ -1200,6 +2180,42 @@ deallocate_prepared_stmts(ConnCacheEntry *entry)
 	entry->have_error = false;
 }
 
+/*
+ * Is the connection unused for longer than postgres_fdw.idle_connection_timeout?
+ */
+static bool
+pgfdw_idle_expired(ConnCacheEntry *entry, TimestampTz now)
+{
+	return IdleConnectionTimeout > 0 && entry->xact_depth == 0 &&
+		TimestampDifferenceExceeds(entry->last_used, now,
+								   IdleConnectionTimeout * 1000);
+}
+
+/*
+ * Close idle connections at end of transaction which hasn't used any.
+ */
+static void
+pgfdw_close_idle_connections(void)
+{
+	HASH_SEQ_STATUS scan;
+	ConnCacheEntry *entry;
+	TimestampTz now;
+
+	if (IdleConnectionTimeout <= 0)
+		return;
+
+	now = GetCurrentTimestamp();
+	hash_seq_init(&scan, ConnectionHash);
+	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
+	{
+		if (entry->conn != NULL && pgfdw_idle_expired(entry, now))
+		{
+			elog(DEBUG3, "closing idle connection %p", entry->conn);
+			disconnect_pg_server(entry);
+		}
+	}
+}
+
 /*
  * pgfdw_subxact_callback --- cleanup at subtransaction end.
  */
@@ -1273,6 +2289,10 @@ pgfdw_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
 			/* Assume we might have lost track of prepared statements */
 			entry->have_error = true;
 
+			/* The owner of a query in flight, if any, is being aborted */
+			entry->pending_cb = NULL;
+			entry->pending_arg = NULL;
+
 			/*
 			 * If a command has been submitted to the remote server by using
 			 * an asynchronous execution function, the command might not have
@@ -1325,10 +2345,16 @@ pgfdw_inval_callback(Datum arg, int cacheid, uint32 hashvalue)
 
 	Assert(cacheid == FOREIGNSERVEROID || cacheid == USERMAPPINGOID);
 
+	/* Estimates might depend on the options, so forget them */
+	ResetRemoteEstimateCache();
+
 	/* ConnectionHash must exist already, if we're registered */
 	hash_seq_init(&scan, ConnectionHash);
 	while ((entry = (ConnCacheEntry *) hash_seq_search(&scan)))
 	{
+		/* standbys might have changed, no need to wait before retrying */
+		entry->connect_failed_at = 0;
+
 		/* Ignore invalid entries */
 		if (entry->conn == NULL)
 			continue;
@@ -1369,9 +2395,10 @@ pgfdw_reject_incomplete_xact_state_change(ConnCacheEntry *entry)
 
 	/* find server name to be shown in the message below */
 	tup = SearchSysCache1(USERMAPPINGOID,
-						  ObjectIdGetDatum(entry->key));
+						  ObjectIdGetDatum(entry->key.umid));
 	if (!HeapTupleIsValid(tup))
-		elog(ERROR, "cache lookup failed for user mapping %u", entry->key);
+		elog(ERROR, "cache lookup failed for user mapping %u",
+			 entry->key.umid);
 	umform = (Form_pg_user_mapping) GETSTRUCT(tup);
 	server = GetForeignServer(umform->umserver);
 	ReleaseSysCache(tup);
@@ -1409,7 +2436,12 @@ pgfdw_cancel_query(ConnCacheEntry *entry)
 	 */
 	if (conn->asyncStatus == PGASYNC_COPY_IN)
 	{
-		if (PQputCopyEnd(conn, "postgres_fdw: transaction abort on source node") != 1)
+		/* Forget unsent data, and wait for the CopyFail to be sent */
+		entry->copy_from_started = false;
+		if (entry->copy_buf)
+			resetStringInfo(entry->copy_buf);
+		if (PQsetnonblocking(conn, 0) != 0 ||
+			PQputCopyEnd(conn, "postgres_fdw: transaction abort on source node") != 1)
 		{
 			ereport(WARNING,
 					(errcode(ERRCODE_CONNECTION_FAILURE),
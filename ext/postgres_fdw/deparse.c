@@ -56,6 +56,7 @@
 #include "optimizer/var.h"
 #include "parser/parsetree.h"
 #include "utils/builtins.h"
+#include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
 #include "utils/syscache.h"
@@ -93,6 +94,20 @@ typedef struct foreign_loc_cxt
 	FDWCollateState state;		/* state of current collation choice */
 } foreign_loc_cxt;
 
+/*
+ * Ways of computing a partial aggregate state on the remote server.
+ */
+typedef enum
+{
+	PARTIAL_AGG_NONE,			/* can't be done */
+	PARTIAL_AGG_PLAIN,			/* the aggregate's result is its state, so
+								 * the remote computes it as usual */
+	PARTIAL_AGG_INT_AVG,		/* {count, sum} bigint array of avg(int2/4) */
+	PARTIAL_AGG_FLOAT_ACCUM		/* {N, sumX, sumX2} float8 array of avg,
+								 * variance and stddev on floats, PG11
+								 * layout only */
+} PartialAggKind;
+
 /*
  * Context for deparseExpr
  */
@@ -180,6 +195,12 @@ static void deparseRangeTblRef(StringInfo buf, PlannerInfo *root,
 				   RelOptInfo *foreignrel, bool make_subquery,
 				   Index ignore_rel, List **ignore_conds, List **params_list);
 static void deparseAggref(Aggref *node, deparse_expr_cxt *context);
+static PartialAggKind partial_agg_kind(Aggref *agg);
+static void deparsePartialAggArray(Aggref *node, PartialAggKind kind,
+					   deparse_expr_cxt *context);
+static void appendPartialAggCall(const char *funcname, Expr *arg,
+					 const char *argcast, bool square,
+					 Aggref *node, deparse_expr_cxt *context);
 static void appendGroupByClause(List *tlist, deparse_expr_cxt *context);
 static void appendAggOrderBy(List *orderList, List *targetList,
 				 deparse_expr_cxt *context);
@@ -686,8 +707,12 @@ foreign_expr_walker(Node *node,
 				if (!IS_UPPER_REL(glob_cxt->foreignrel))
 					return false;
 
-				/* Only non-split aggregates are pushable. */
-				if (agg->aggsplit != AGGSPLIT_SIMPLE)
+				/*
+				 * Only non-split aggregates are pushable, and partial ones
+				 * whose state we know how to compute remotely.
+				 */
+				if (agg->aggsplit != AGGSPLIT_SIMPLE &&
+					partial_agg_kind(agg) == PARTIAL_AGG_NONE)
 					return false;
 
 				/* As usual, it must be shippable. */
@@ -1706,6 +1731,38 @@ deparseInsertSql(StringInfo buf, RangeTblEntry *rte,
 						 returningList, retrieved_attrs);
 }
 
+/*
+ * Construct a multi-row INSERT from the single-row one built by
+ * deparseInsertSql, which sends num_params parameters per row.
+ *
+ * The original statement must have neither ON CONFLICT nor RETURNING clause,
+ * so that it ends with the VALUES list and more rows can just be appended.
+ */
+void
+rebuildInsertSql(StringInfo buf, const char *orig_query,
+				 int num_params, int num_rows)
+{
+	int			pindex = num_params + 1;
+	int			i;
+
+	appendStringInfoString(buf, orig_query);
+
+	for (i = 1; i < num_rows; i++)
+	{
+		int			j;
+
+		appendStringInfoString(buf, ", (");
+		for (j = 0; j < num_params; j++)
+		{
+			if (j > 0)
+				appendStringInfoString(buf, ", ");
+			appendStringInfo(buf, "$%d", pindex);
+			pindex++;
+		}
+		appendStringInfoChar(buf, ')');
+	}
+}
+
 /*
  * deparse remote UPDATE statement
  *
@@ -2894,8 +2951,18 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 	StringInfo	buf = context->buf;
 	bool		use_variadic;
 
-	/* Only basic, non-split aggregation accepted. */
-	Assert(node->aggsplit == AGGSPLIT_SIMPLE);
+	/* Only basic aggregation accepted, or partial one, see foreign_expr_walker */
+	if (node->aggsplit != AGGSPLIT_SIMPLE)
+	{
+		PartialAggKind kind = partial_agg_kind(node);
+
+		Assert(kind != PARTIAL_AGG_NONE);
+		if (kind != PARTIAL_AGG_PLAIN)
+		{
+			deparsePartialAggArray(node, kind, context);
+			return;
+		}
+	}
 
 	/* Check if need to print VARIADIC (cf. ruleutils.c) */
 	use_variadic = node->aggvariadic;
@@ -2977,6 +3044,132 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 	appendStringInfoChar(buf, ')');
 }
 
+/*
+ * Determine whether and how the state of a partial aggregate can be computed
+ * on the remote server. We only deal with the transition states which are
+ * either the aggregate's own result or arrays of count and sums, as the
+ * format of internal states is not something we could produce from SQL.
+ */
+static PartialAggKind
+partial_agg_kind(Aggref *agg)
+{
+	HeapTuple	tuple;
+	Form_pg_aggregate aggform;
+	PartialAggKind kind = PARTIAL_AGG_NONE;
+
+	/* This is what the planner uses for partial aggregation */
+	if (agg->aggsplit != AGGSPLIT_INITIAL_SERIAL)
+		return PARTIAL_AGG_NONE;
+
+	/* Partial aggregation of these isn't supported by the core anyway */
+	if (agg->aggdistinct != NIL || agg->aggorder != NIL ||
+		AGGKIND_IS_ORDERED_SET(agg->aggkind))
+		return PARTIAL_AGG_NONE;
+
+	tuple = SearchSysCache1(AGGFNOID, ObjectIdGetDatum(agg->aggfnoid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for aggregate %u", agg->aggfnoid);
+	aggform = (Form_pg_aggregate) GETSTRUCT(tuple);
+
+	if (!OidIsValid(aggform->aggfinalfn) &&
+		aggform->aggtranstype != INTERNALOID &&
+		aggform->aggtranstype == get_func_rettype(agg->aggfnoid))
+		kind = PARTIAL_AGG_PLAIN;
+	else if (aggform->aggtransfn == F_INT2_AVG_ACCUM ||
+			 aggform->aggtransfn == F_INT4_AVG_ACCUM)
+		kind = PARTIAL_AGG_INT_AVG;
+#if PG_VERSION_NUM < 120000
+	/*
+	 * float8_combine of PG11 and older takes {N, sum(X), sum(X*X)}, which
+	 * plain sums give us. Since PG12 the last element is sum((X - mean)^2)
+	 * of Youngs-Cramer, so combining our array there would silently break
+	 * variance and stddev.
+	 */
+	else if (aggform->aggtransfn == F_FLOAT4_ACCUM ||
+			 aggform->aggtransfn == F_FLOAT8_ACCUM)
+		kind = PARTIAL_AGG_FLOAT_ACCUM;
+#endif
+
+	ReleaseSysCache(tuple);
+
+	/* Array states are built of the only argument */
+	if (kind != PARTIAL_AGG_NONE && kind != PARTIAL_AGG_PLAIN &&
+		list_length(agg->args) != 1)
+		kind = PARTIAL_AGG_NONE;
+
+	return kind;
+}
+
+/*
+ * Deparse a partial aggregate whose state is an array of count and sums of
+ * its argument, see partial_agg_kind.
+ */
+static void
+deparsePartialAggArray(Aggref *node, PartialAggKind kind,
+					   deparse_expr_cxt *context)
+{
+	StringInfo	buf = context->buf;
+	Expr	   *arg = ((TargetEntry *) linitial(node->args))->expr;
+
+	appendStringInfoString(buf, "ARRAY[");
+	appendPartialAggCall("count", arg, NULL, false, node, context);
+	appendStringInfoString(buf, ", ");
+	if (kind == PARTIAL_AGG_INT_AVG)
+	{
+		appendPartialAggCall("sum", arg, NULL, false, node, context);
+		appendStringInfoString(buf, "]::bigint[]");
+	}
+	else
+	{
+		Assert(kind == PARTIAL_AGG_FLOAT_ACCUM);
+		appendPartialAggCall("sum", arg, "double precision", false, node,
+							 context);
+		appendStringInfoString(buf, ", ");
+		appendPartialAggCall("sum", arg, "double precision", true, node,
+							 context);
+		appendStringInfoString(buf, "]::double precision[]");
+	}
+}
+
+/*
+ * Append funcname(arg) with node's filter, optionally casting or squaring
+ * the argument. Sums are coalesced to 0, as the states start from zeros
+ * rather than NULL.
+ */
+static void
+appendPartialAggCall(const char *funcname, Expr *arg, const char *argcast,
+					 bool square, Aggref *node, deparse_expr_cxt *context)
+{
+	StringInfo	buf = context->buf;
+	bool		is_sum = strcmp(funcname, "count") != 0;
+	int			i;
+
+	if (is_sum)
+		appendStringInfoString(buf, "COALESCE(");
+	appendStringInfo(buf, "%s(", funcname);
+	for (i = 0; i < (square ? 2 : 1); i++)
+	{
+		if (i > 0)
+			appendStringInfoString(buf, " * ");
+		appendStringInfoChar(buf, '(');
+		deparseExpr(arg, context);
+		appendStringInfoChar(buf, ')');
+		if (argcast)
+			appendStringInfo(buf, "::%s", argcast);
+	}
+	appendStringInfoChar(buf, ')');
+
+	if (node->aggfilter != NULL)
+	{
+		appendStringInfoString(buf, " FILTER (WHERE ");
+		deparseExpr((Expr *) node->aggfilter, context);
+		appendStringInfoChar(buf, ')');
+	}
+
+	if (is_sum)
+		appendStringInfoString(buf, ", 0)");
+}
+
 /*
  * Append ORDER BY within aggregate function.
  */
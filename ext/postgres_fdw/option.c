@@ -108,7 +108,10 @@ postgres_fdw_validator(PG_FUNCTION_ARGS)
 		 * Validate option value, when we can do so without any context.
 		 */
 		if (strcmp(def->defname, "use_remote_estimate") == 0 ||
-			strcmp(def->defname, "updatable") == 0)
+			strcmp(def->defname, "updatable") == 0 ||
+			strcmp(def->defname, "async_capable") == 0 ||
+			strcmp(def->defname, "binary_format") == 0 ||
+			strcmp(def->defname, "prepare_scans") == 0)
 		{
 			/* these accept only boolean values */
 			(void) defGetBoolean(def);
@@ -132,6 +135,11 @@ postgres_fdw_validator(PG_FUNCTION_ARGS)
 			/* check list syntax, warn about uninstalled extensions */
 			(void) ExtractExtensionList(defGetString(def), true);
 		}
+		else if (strcmp(def->defname, "standby_hosts") == 0)
+		{
+			/* check list syntax */
+			(void) ExtractStandbyHosts(defGetString(def));
+		}
 		else if (strcmp(def->defname, "fetch_size") == 0)
 		{
 			int			fetch_size;
@@ -143,6 +151,17 @@ postgres_fdw_validator(PG_FUNCTION_ARGS)
 						 errmsg("%s requires a non-negative integer value",
 								def->defname)));
 		}
+		else if (strcmp(def->defname, "batch_size") == 0)
+		{
+			int			batch_size;
+
+			batch_size = strtol(defGetString(def), NULL, 10);
+			if (batch_size <= 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("%s requires a non-negative integer value",
+								def->defname)));
+		}
 	}
 
 	PG_RETURN_VOID();
@@ -177,6 +196,20 @@ InitPgFdwOptions(void)
 		/* fetch_size is available on both server and table */
 		{"fetch_size", ForeignServerRelationId, false},
 		{"fetch_size", ForeignTableRelationId, false},
+		/* batch_size is available on both server and table */
+		{"batch_size", ForeignServerRelationId, false},
+		{"batch_size", ForeignTableRelationId, false},
+		/* async_capable is available on both server and table */
+		{"async_capable", ForeignServerRelationId, false},
+		{"async_capable", ForeignTableRelationId, false},
+		/* binary_format is available on both server and table */
+		{"binary_format", ForeignServerRelationId, false},
+		{"binary_format", ForeignTableRelationId, false},
+		/* prepare_scans is available on both server and table */
+		{"prepare_scans", ForeignServerRelationId, false},
+		{"prepare_scans", ForeignTableRelationId, false},
+		/* standbys which may serve scans, maintained by shardman-monitor */
+		{"standby_hosts", ForeignServerRelationId, false},
 		{NULL, InvalidOid, false}
 	};
 
@@ -362,3 +395,38 @@ ExtractExtensionList(const char *extensionsString, bool warnOnMissing)
 	list_free(extlist);
 	return extensionOids;
 }
+
+/*
+ * Parse a comma-separated list of host:port pairs, as in standby_hosts
+ * option, and return a List of its entries.  Empty string gives NIL.
+ */
+List *
+ExtractStandbyHosts(const char *hostsString)
+{
+	List	   *hosts = NIL;
+	char	   *rawstring = pstrdup(hostsString);
+	char	   *entry = rawstring;
+
+	while (*entry != '\0')
+	{
+		char	   *next = strchr(entry, ',');
+		char	   *colon;
+
+		if (next != NULL)
+			*next = '\0';
+		colon = strrchr(entry, ':');
+		if (colon == NULL || colon == entry || colon[1] == '\0' ||
+			strspn(colon + 1, "0123456789") != strlen(colon + 1))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("parameter \"%s\" must be a list of host:port pairs",
+							"standby_hosts")));
+		hosts = lappend(hosts, entry);
+
+		if (next == NULL)
+			break;
+		entry = next + 1;
+	}
+
+	return hosts;
+}
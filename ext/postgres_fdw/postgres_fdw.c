@@ -14,12 +14,15 @@
 
 #include "postgres_fdw.h"
 
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "access/sysattr.h"
 #include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "funcapi.h"
 #include "miscadmin.h"
@@ -30,6 +33,7 @@
 #include "optimizer/pathnode.h"
 #include "optimizer/paths.h"
 #include "optimizer/planmain.h"
+#include "optimizer/prep.h"
 #include "optimizer/restrictinfo.h"
 #include "optimizer/var.h"
 #include "optimizer/tlist.h"
@@ -41,6 +45,8 @@
 #include "utils/rel.h"
 #include "utils/sampling.h"
 #include "utils/selfuncs.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 
 /* Default CPU cost to start up a foreign query. */
 #define DEFAULT_FDW_STARTUP_COST	100.0
@@ -51,6 +57,9 @@
 /* If no remote estimates, assume a sort costs 20% extra */
 #define DEFAULT_FDW_SORT_MULTIPLIER 1.2
 
+/* Max number of parameters of a statement the wire protocol allows */
+#define MAX_QUERY_PARAMS			65535
+
 /*
  * Indexes of FDW-private information stored in fdw_private lists.
  *
@@ -66,6 +75,12 @@ enum FdwScanPrivateIndex
 	FdwScanPrivateRetrievedAttrs,
 	/* Integer representing the desired fetch_size */
 	FdwScanPrivateFetchSize,
+	/* Boolean flag showing if the scan may be started asynchronously */
+	FdwScanPrivateAsyncCapable,
+	/* Boolean flag showing if rows may be fetched in binary format */
+	FdwScanPrivateBinaryFormat,
+	/* Boolean flag showing if a parameterized query should be prepared */
+	FdwScanPrivatePrepareScans,
 
 	/*
 	 * String describing join i.e. names of relations being joined and types
@@ -117,6 +132,16 @@ enum FdwDirectModifyPrivateIndex
 	FdwDirectModifyPrivateSetProcessed
 };
 
+/*
+ * Binary receive functions of the columns of a foreign scan, analogous to
+ * AttInMetadata.  Arrays are indexed by attribute number - 1.
+ */
+typedef struct AttRecvMetadata
+{
+	FmgrInfo   *attrecvfuncs;	/* receive functions of the columns */
+	Oid		   *attioparams;	/* type I/O parameters of the columns */
+} AttRecvMetadata;
+
 /*
  * Execution state of a foreign scan using postgres_fdw.
  */
@@ -126,6 +151,8 @@ typedef struct PgFdwScanState
 								 * for a foreign join scan. */
 	TupleDesc	tupdesc;		/* tuple descriptor of scan */
 	AttInMetadata *attinmeta;	/* attribute datatype conversion metadata */
+	AttRecvMetadata *recvmeta;	/* binary conversion metadata, if rows are
+								 * fetched in binary format */
 
 	/* extracted fdw_private data */
 	char	   *query;			/* text of SELECT command */
@@ -135,6 +162,8 @@ typedef struct PgFdwScanState
 	ConnCacheEntry	*conn_entry;	/* connection for the scan */
 	unsigned int cursor_number; /* quasi-unique ID for my cursor */
 	bool		cursor_exists;	/* have we created the cursor? */
+	char	   *p_name;			/* name of prepared statement, if created and
+								 * the scan isn't executed via cursor */
 	int			numParams;		/* number of parameters passed to query */
 	FmgrInfo   *param_flinfo;	/* output conversion functions for them */
 	List	   *param_exprs;	/* executable expressions for param values */
@@ -145,15 +174,27 @@ typedef struct PgFdwScanState
 	int			num_tuples;		/* # of tuples in array */
 	int			next_tuple;		/* index of next one to return */
 
+	/* batch fetched ahead while the current one is being returned */
+	HeapTuple  *next_tuples;	/* array of prefetched tuples */
+	int			next_num_tuples;	/* # of tuples in array */
+	bool		next_ready;		/* true if prefetched batch is valid */
+
 	/* batch-level state, for optimizing rewinds and avoiding useless fetch */
 	int			fetch_ct_2;		/* Min(# of fetches done, 2) */
 	bool		eof_reached;	/* true if last fetch reached EOF */
+	bool		fetch_pending;	/* FETCH sent, but result not collected yet */
 
 	/* working memory contexts */
 	MemoryContext batch_cxt;	/* context holding current batch of tuples */
+	MemoryContext next_batch_cxt;	/* context holding prefetched batch */
 	MemoryContext temp_cxt;		/* context for per-tuple temporary data */
 
 	int			fetch_size;		/* number of tuples per fetch */
+	bool		async_capable;	/* start the query at executor startup? */
+	bool		binary_format;	/* fetch in binary format when possible? */
+	bool		format_chosen;	/* have we decided on the format already? */
+	bool		prepared;		/* run the query as prepared statement instead
+								 * of cursor? */
 } PgFdwScanState;
 
 /*
@@ -179,6 +220,12 @@ typedef struct PgFdwModifyState
 	int			p_nums;			/* number of parameters to transmit */
 	FmgrInfo   *p_flinfo;		/* output conversion functions for them */
 
+	/* for INSERT sending several rows at once */
+	int			batch_size;		/* max # of rows per remote INSERT */
+	int			num_batched;	/* # of rows collected so far */
+	const char **batch_values;	/* their parameters, p_nums per row */
+	char	   *batch_query;	/* INSERT for a full batch, if built yet */
+
 	/* working memory context */
 	MemoryContext temp_cxt;		/* context for per-tuple temporary data */
 } PgFdwModifyState;
@@ -268,6 +315,42 @@ typedef struct
 
 bool		UseGlobalSnapshots;
 bool		UseRepeatableRead;
+double		Trace2PCSampleRate;
+int			IdleConnectionTimeout;
+bool		UseStandbyReads;
+int			StandbyWaitTimeout;
+
+static ExecutorFinish_hook_type PreviousExecutorFinishHook = NULL;
+
+/*
+ * Cache of remote estimates, see get_cached_remote_estimate.  Entries live
+ * in RemoteEstimateContext.
+ */
+typedef struct RemoteEstimateKey
+{
+	Oid			umid;			/* user mapping the EXPLAIN ran under */
+	uint32		sql_hash;		/* hash of the EXPLAIN statement */
+} RemoteEstimateKey;
+
+typedef struct RemoteEstimateEntry
+{
+	RemoteEstimateKey key;		/* hash key (must be first) */
+	char	   *sql;			/* EXPLAIN statement, to detect collisions */
+	TimestampTz fetched_at;		/* when we got the estimate */
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+} RemoteEstimateEntry;
+
+/* When the cache grows that big, start afresh */
+#define REMOTE_ESTIMATE_CACHE_SIZE	4096
+
+static HTAB *RemoteEstimateHash = NULL;
+static MemoryContext RemoteEstimateContext = NULL;
+
+/* How long cached remote estimates are used, in seconds; 0 disables */
+static int	remote_estimate_cache_ttl;
 
 /*
  * SQL functions
@@ -384,11 +467,23 @@ static void get_remote_estimate(const char *sql,
 					int *width,
 					Cost *startup_cost,
 					Cost *total_cost);
+static void get_cached_remote_estimate(const char *sql,
+						   UserMapping *user,
+						   double *rows,
+						   int *width,
+						   Cost *startup_cost,
+						   Cost *total_cost);
 static bool ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
 						  EquivalenceClass *ec, EquivalenceMember *em,
 						  void *arg);
+static bool scan_locks_rows(ForeignScan *fsplan, EState *estate);
 static void create_cursor(ForeignScanState *node);
+static void create_cursor_async(ForeignScanState *node);
+static void execute_prepared_scan(ForeignScanState *node);
 static void fetch_more_data(ForeignScanState *node);
+static void fetch_more_data_begin(ForeignScanState *node);
+static void fetch_more_data_finish(void *arg);
+static void fetch_more_data_wait(ForeignScanState *node);
 static void close_cursor(ConnCacheEntry *entry, unsigned int cursor_number);
 static PgFdwModifyState *create_foreign_modify(EState *estate,
 					  RangeTblEntry *rte,
@@ -398,8 +493,15 @@ static PgFdwModifyState *create_foreign_modify(EState *estate,
 					  char *query,
 					  List *target_attrs,
 					  bool has_returning,
-					  List *retrieved_attrs);
+					  List *retrieved_attrs,
+					  int batch_size);
+static int	get_batch_size_option(Relation rel);
 static void prepare_foreign_modify(PgFdwModifyState *fmstate);
+static void send_insert_batch(PgFdwModifyState *fmstate);
+static void finish_insert_batch(void *arg);
+static void flush_insert_batches(PgFdwModifyState *fmstate);
+static void flush_result_rel_batches(ResultRelInfo *resultRelInfo);
+static void pgfdw_ExecutorFinish(QueryDesc *queryDesc);
 static const char **convert_prep_stmt_params(PgFdwModifyState *fmstate,
 						 ItemPointer tupleid,
 						 TupleTableSlot *slot);
@@ -433,10 +535,12 @@ static int postgresAcquireSampleRowsFunc(Relation relation, int elevel,
 							  double *totaldeadrows);
 static void analyze_row_processor(PGresult *res, int row,
 					  PgFdwAnalyzeState *astate);
+static void choose_result_format(PgFdwScanState *fsstate, PGresult *res);
 static HeapTuple make_tuple_from_result_row(PGresult *res,
 						   int row,
 						   Relation rel,
 						   AttInMetadata *attinmeta,
+						   AttRecvMetadata *recvmeta,
 						   List *retrieved_attrs,
 						   ForeignScanState *fsstate,
 						   MemoryContext temp_context);
@@ -454,7 +558,8 @@ static void add_paths_with_pathkeys_for_rel(PlannerInfo *root, RelOptInfo *rel,
 static void add_foreign_grouping_paths(PlannerInfo *root,
 						   RelOptInfo *input_rel,
 						   RelOptInfo *grouped_rel,
-						   GroupPathExtraData *extra);
+						   GroupPathExtraData *extra,
+						   bool partial);
 static void apply_server_options(PgFdwRelationInfo *fpinfo);
 static void apply_table_options(PgFdwRelationInfo *fpinfo);
 static void merge_fdw_options(PgFdwRelationInfo *fpinfo,
@@ -565,6 +670,9 @@ postgresGetForeignRelSize(PlannerInfo *root,
 	fpinfo->fdw_tuple_cost = DEFAULT_FDW_TUPLE_COST;
 	fpinfo->shippable_extensions = NIL;
 	fpinfo->fetch_size = 100;
+	fpinfo->async_capable = false;
+	fpinfo->binary_format = false;
+	fpinfo->prepare_scans = false;
 
 	apply_server_options(fpinfo);
 	apply_table_options(fpinfo);
@@ -1296,9 +1404,12 @@ postgresGetForeignPlan(PlannerInfo *root,
 	 * Build the fdw_private list that will be available to the executor.
 	 * Items in the list must match order in enum FdwScanPrivateIndex.
 	 */
-	fdw_private = list_make3(makeString(sql.data),
+	fdw_private = list_make5(makeString(sql.data),
 							 retrieved_attrs,
-							 makeInteger(fpinfo->fetch_size));
+							 makeInteger(fpinfo->fetch_size),
+							 makeInteger(fpinfo->async_capable),
+							 makeInteger(fpinfo->binary_format));
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->prepare_scans));
 	if (IS_JOIN_REL(foreignrel) || IS_UPPER_REL(foreignrel))
 		fdw_private = lappend(fdw_private,
 							  makeString(fpinfo->relation_name->data));
@@ -1336,6 +1447,7 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 	UserMapping *user;
 	int			rtindex;
 	int			numParams;
+	bool		prepare_scans;
 
 	/*
 	 * Do nothing in EXPLAIN (no ANALYZE) case.  node->fdw_state stays NULL.
@@ -1367,10 +1479,28 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 	user = GetUserMapping(userid, table->serverid);
 
 	/*
-	 * Get connection to the foreign server.  Connection manager will
-	 * establish new connection if necessary.
+	 * A parameterized query is executed as prepared statement if the options
+	 * say so: it is parsed and planned by the remote server only once, and
+	 * each rescan just sends new parameter values.  The whole result is then
+	 * retrieved at once, so this suits selective scans, e.g. the inner side
+	 * of a nested loop looking up a few rows per outer row.
 	 */
-	fsstate->conn_entry = GetConnection(user, false);
+	prepare_scans = intVal(list_nth(fsplan->fdw_private,
+									FdwScanPrivatePrepareScans));
+	fsstate->prepared = prepare_scans && fsplan->fdw_exprs != NIL;
+
+	/*
+	 * Get connection to the foreign server, or to its standby.  Connection
+	 * manager will establish new connection if necessary.
+	 */
+	fsstate->conn_entry = GetConnectionForScan(user, fsstate->prepared);
+
+	/*
+	 * SELECT FOR UPDATE/SHARE takes row locks, so remote xact must not be
+	 * committed early as a read-only one.
+	 */
+	if (scan_locks_rows(fsplan, estate))
+		ConnectionEntryMarkModified(fsstate->conn_entry);
 
 	/* Assign a unique ID for my cursor */
 	fsstate->cursor_number = GetCursorNumber(fsstate->conn_entry);
@@ -1383,11 +1513,18 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 												 FdwScanPrivateRetrievedAttrs);
 	fsstate->fetch_size = intVal(list_nth(fsplan->fdw_private,
 										  FdwScanPrivateFetchSize));
+	fsstate->async_capable = intVal(list_nth(fsplan->fdw_private,
+											 FdwScanPrivateAsyncCapable));
+	fsstate->binary_format = intVal(list_nth(fsplan->fdw_private,
+											 FdwScanPrivateBinaryFormat));
 
 	/* Create contexts for batches of tuples and per-tuple temp workspace. */
 	fsstate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
 											   "postgres_fdw tuple data",
 											   ALLOCSET_DEFAULT_SIZES);
+	fsstate->next_batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+													"postgres_fdw tuple data",
+													ALLOCSET_DEFAULT_SIZES);
 	fsstate->temp_cxt = AllocSetContextCreate(estate->es_query_cxt,
 											  "postgres_fdw temporary data",
 											  ALLOCSET_SMALL_SIZES);
@@ -1421,6 +1558,18 @@ postgresBeginForeignScan(ForeignScanState *node, int eflags)
 							 &fsstate->param_flinfo,
 							 &fsstate->param_exprs,
 							 &fsstate->param_values);
+
+	/*
+	 * If allowed, send the query right away rather than on the first
+	 * IterateForeignScan call.  All partitions under an Append are
+	 * initialized before any of them is scanned, so this way the remote
+	 * servers execute their parts of the query concurrently, and a scan over
+	 * many foreign partitions takes about as long as the slowest of them
+	 * rather than the sum.  Parameter values are not available yet at this
+	 * point, so parameterized scans are started as usual.
+	 */
+	if (fsstate->async_capable && numParams == 0)
+		create_cursor_async(node);
 }
 
 /*
@@ -1446,8 +1595,11 @@ postgresIterateForeignScan(ForeignScanState *node)
 	 */
 	if (fsstate->next_tuple >= fsstate->num_tuples)
 	{
-		/* No point in another fetch if we already detected EOF, though. */
-		if (!fsstate->eof_reached)
+		/*
+		 * No point in another fetch if we already detected EOF, though,
+		 * unless the last batch is still waiting in the prefetch buffer.
+		 */
+		if (!fsstate->eof_reached || fsstate->next_ready)
 			fetch_more_data(node);
 		/* If we didn't get any tuples, must be end of data. */
 		if (fsstate->next_tuple >= fsstate->num_tuples)
@@ -1480,6 +1632,9 @@ postgresReScanForeignScan(ForeignScanState *node)
 	if (!fsstate->cursor_exists)
 		return;
 
+	/* Collect the batch in flight, if any, before touching the cursor */
+	fetch_more_data_wait(node);
+
 	/*
 	 * If any internal parameters affecting this node have changed, we'd
 	 * better destroy and recreate the cursor.  Otherwise, rewinding it should
@@ -1489,6 +1644,9 @@ postgresReScanForeignScan(ForeignScanState *node)
 	if (node->ss.ps.chgParam != NULL)
 	{
 		fsstate->cursor_exists = false;
+		/* No cursor to close; the statement is just executed again */
+		if (fsstate->prepared)
+			return;
 		snprintf(sql, sizeof(sql), "CLOSE c%u",
 				 fsstate->cursor_number);
 	}
@@ -1499,7 +1657,11 @@ postgresReScanForeignScan(ForeignScanState *node)
 	}
 	else
 	{
-		/* Easy: just rescan what we already have in memory, if anything */
+		/*
+		 * Easy: just rescan what we already have in memory, if anything.  The
+		 * only batch might be still sitting in the prefetch buffer; it will
+		 * be picked up by the next fetch_more_data call then.
+		 */
 		fsstate->next_tuple = 0;
 		return;
 	}
@@ -1518,6 +1680,7 @@ postgresReScanForeignScan(ForeignScanState *node)
 	fsstate->tuples = NULL;
 	fsstate->num_tuples = 0;
 	fsstate->next_tuple = 0;
+	fsstate->next_ready = false;
 	fsstate->fetch_ct_2 = 0;
 	fsstate->eof_reached = false;
 }
@@ -1537,7 +1700,11 @@ postgresEndForeignScan(ForeignScanState *node)
 
 	/* Close the cursor if open, to prevent accumulation of cursors */
 	if (fsstate->cursor_exists)
-		close_cursor(fsstate->conn_entry, fsstate->cursor_number);
+	{
+		fetch_more_data_wait(node);
+		if (!fsstate->prepared)
+			close_cursor(fsstate->conn_entry, fsstate->cursor_number);
+	}
 
 	/* Release remote connection */
 	ReleaseConnection(fsstate->conn_entry);
@@ -1718,6 +1885,7 @@ postgresBeginForeignModify(ModifyTableState *mtstate,
 	bool		has_returning;
 	List	   *retrieved_attrs;
 	RangeTblEntry *rte;
+	int			batch_size = 1;
 
 	/*
 	 * Do nothing in EXPLAIN (no ANALYZE) case.  resultRelInfo->ri_FdwState
@@ -1740,6 +1908,14 @@ postgresBeginForeignModify(ModifyTableState *mtstate,
 	rte = rt_fetch(resultRelInfo->ri_RangeTableIndex,
 				   mtstate->ps.state->es_range_table);
 
+	/*
+	 * Rows can be sent in batches only if we needn't report back anything
+	 * about each of them, see postgresExecForeignInsert.
+	 */
+	if (mtstate->operation == CMD_INSERT && !has_returning &&
+		castNode(ModifyTable, mtstate->ps.plan)->onConflictAction == ONCONFLICT_NONE)
+		batch_size = get_batch_size_option(resultRelInfo->ri_RelationDesc);
+
 	/* Construct an execution state. */
 	fmstate = create_foreign_modify(mtstate->ps.state,
 									rte,
@@ -1749,7 +1925,8 @@ postgresBeginForeignModify(ModifyTableState *mtstate,
 									query,
 									target_attrs,
 									has_returning,
-									retrieved_attrs);
+									retrieved_attrs,
+									batch_size);
 
 	resultRelInfo->ri_FdwState = fmstate;
 }
@@ -1771,6 +1948,24 @@ postgresExecForeignInsert(EState *estate,
 	PGresult   *res;
 	int			n_rows;
 
+	/*
+	 * In batch mode, just collect the row; rows go to the remote server in a
+	 * single multi-row INSERT once batch_size of them are collected, and we
+	 * don't wait for its completion either.  Since there is neither
+	 * RETURNING nor ON CONFLICT, the row counts as inserted right away;
+	 * errors will be reported by a later call or at the end of the
+	 * statement, see pgfdw_ExecutorFinish.
+	 */
+	if (fmstate->batch_size > 1)
+	{
+		p_values = convert_prep_stmt_params(fmstate, NULL, slot);
+		memcpy(&fmstate->batch_values[fmstate->num_batched * fmstate->p_nums],
+			   p_values, sizeof(char *) * fmstate->p_nums);
+		if (++fmstate->num_batched == fmstate->batch_size)
+			send_insert_batch(fmstate);
+		return slot;
+	}
+
 	/* Set up the prepared statement on the remote server, if we didn't yet */
 	if (!fmstate->p_name)
 		prepare_foreign_modify(fmstate);
@@ -1781,6 +1976,7 @@ postgresExecForeignInsert(EState *estate,
 	/*
 	 * Execute the prepared statement.
 	 */
+	ConnectionEntryFinishPending(fmstate->conn_entry);
 	if (!PQsendQueryPrepared(conn,
 							 fmstate->p_name,
 							 fmstate->p_nums,
@@ -1859,6 +2055,7 @@ postgresExecForeignUpdate(EState *estate,
 	/*
 	 * Execute the prepared statement.
 	 */
+	ConnectionEntryFinishPending(fmstate->conn_entry);
 	if (!PQsendQueryPrepared(conn,
 							 fmstate->p_name,
 							 fmstate->p_nums,
@@ -1937,6 +2134,7 @@ postgresExecForeignDelete(EState *estate,
 	/*
 	 * Execute the prepared statement.
 	 */
+	ConnectionEntryFinishPending(fmstate->conn_entry);
 	if (!PQsendQueryPrepared(conn,
 							 fmstate->p_name,
 							 fmstate->p_nums,
@@ -2070,7 +2268,7 @@ postgresBeginForeignInsert(ModifyTableState *mtstate,
 	deparseInsertSql(&sql, rte, resultRelation, rel, targetAttrs, doNothing,
 					 resultRelInfo->ri_returningList, &retrieved_attrs);
 
-	/* Construct an execution state. */
+	/* Construct an execution state; see postgresBeginForeignModify. */
 	fmstate = create_foreign_modify(mtstate->ps.state,
 									rte,
 									resultRelInfo,
@@ -2079,7 +2277,9 @@ postgresBeginForeignInsert(ModifyTableState *mtstate,
 									sql.data,
 									targetAttrs,
 									retrieved_attrs != NIL,
-									retrieved_attrs);
+									retrieved_attrs,
+									(retrieved_attrs == NIL && !doNothing) ?
+									get_batch_size_option(rel) : 1);
 
 	resultRelInfo->ri_FdwState = fmstate;
 }
@@ -2422,6 +2622,7 @@ postgresBeginDirectModify(ForeignScanState *node, int eflags)
 	 * establish new connection if necessary.
 	 */
 	dmstate->conn_entry = GetConnection(user, false);
+	ConnectionEntryMarkModified(dmstate->conn_entry);
 
 	/* Update the foreign-join-related fields. */
 	if (fsplan->scan.scanrelid == 0)
@@ -2676,7 +2877,6 @@ estimate_path_cost_size(PlannerInfo *root,
 		List	   *remote_param_join_conds;
 		List	   *local_param_join_conds;
 		StringInfoData sql;
-		ConnCacheEntry *conn_entry;
 		Selectivity local_sel;
 		QualCost	local_cost;
 		List	   *fdw_scan_tlist = NIL;
@@ -2718,10 +2918,8 @@ estimate_path_cost_size(PlannerInfo *root,
 								&retrieved_attrs, NULL);
 
 		/* Get the remote estimate */
-		conn_entry = GetConnection(fpinfo->user, false);
-		get_remote_estimate(sql.data, conn_entry, &rows, &width,
-							&startup_cost, &total_cost);
-		ReleaseConnection(conn_entry);
+		get_cached_remote_estimate(sql.data, fpinfo->user, &rows, &width,
+								   &startup_cost, &total_cost);
 
 		retrieved_rows = rows;
 
@@ -3046,6 +3244,114 @@ get_remote_estimate(const char *sql, ConnCacheEntry *conn_entry,
 	PG_END_TRY();
 }
 
+/*
+ * Get remote estimate for EXPLAIN statement sql executed as user, reusing
+ * the one we got recently for the same statement, if any.
+ *
+ * The planner asks for the same estimates over and over: for each
+ * partition of a partitioned table, each join and grouping combination it
+ * considers, and of course for each execution of the same query.  Remote
+ * stats don't change that fast, so cached values are fine for
+ * remote_estimate_cache_ttl seconds, unless server or user mapping options
+ * change, see ResetRemoteEstimateCache.
+ */
+static void
+get_cached_remote_estimate(const char *sql, UserMapping *user,
+						   double *rows, int *width,
+						   Cost *startup_cost, Cost *total_cost)
+{
+	RemoteEstimateKey key;
+	RemoteEstimateEntry *entry;
+	ConnCacheEntry *conn_entry;
+	TimestampTz now;
+	bool		found;
+
+	if (remote_estimate_cache_ttl > 0 && RemoteEstimateHash != NULL)
+	{
+		MemSet(&key, 0, sizeof(key));
+		key.umid = user->umid;
+		key.sql_hash = DatumGetUInt32(hash_any((const unsigned char *) sql,
+											   strlen(sql)));
+
+		now = GetCurrentTimestamp();
+		entry = hash_search(RemoteEstimateHash, &key, HASH_FIND, NULL);
+		if (entry != NULL && strcmp(entry->sql, sql) == 0 &&
+			!TimestampDifferenceExceeds(entry->fetched_at, now,
+										remote_estimate_cache_ttl * 1000))
+		{
+			*rows = entry->rows;
+			*width = entry->width;
+			*startup_cost = entry->startup_cost;
+			*total_cost = entry->total_cost;
+			return;
+		}
+	}
+
+	conn_entry = GetConnection(user, false);
+	get_remote_estimate(sql, conn_entry, rows, width,
+						startup_cost, total_cost);
+	ReleaseConnection(conn_entry);
+
+	if (remote_estimate_cache_ttl <= 0)
+		return;
+
+	/*
+	 * Remember the estimate.  Note that the cache might have been reset
+	 * while we were talking to the server.
+	 */
+	if (RemoteEstimateHash != NULL &&
+		hash_get_num_entries(RemoteEstimateHash) >= REMOTE_ESTIMATE_CACHE_SIZE)
+		ResetRemoteEstimateCache();
+	if (RemoteEstimateHash == NULL)
+	{
+		HASHCTL		ctl;
+
+		if (RemoteEstimateContext == NULL)
+			RemoteEstimateContext =
+				AllocSetContextCreate(CacheMemoryContext,
+									  "postgres_fdw remote estimates",
+									  ALLOCSET_DEFAULT_SIZES);
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(RemoteEstimateKey);
+		ctl.entrysize = sizeof(RemoteEstimateEntry);
+		ctl.hcxt = RemoteEstimateContext;
+		RemoteEstimateHash = hash_create("postgres_fdw remote estimates", 256,
+										 &ctl,
+										 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	MemSet(&key, 0, sizeof(key));
+	key.umid = user->umid;
+	key.sql_hash = DatumGetUInt32(hash_any((const unsigned char *) sql,
+										   strlen(sql)));
+	entry = hash_search(RemoteEstimateHash, &key, HASH_ENTER, &found);
+	if (found)
+		pfree(entry->sql);
+	entry->sql = MemoryContextStrdup(RemoteEstimateContext, sql);
+	entry->fetched_at = GetCurrentTimestamp();
+	entry->rows = *rows;
+	entry->width = *width;
+	entry->startup_cost = *startup_cost;
+	entry->total_cost = *total_cost;
+}
+
+/*
+ * Forget all cached remote estimates.  Called on foreign server and user
+ * mapping changes, as their options (e.g. the remote host) might affect the
+ * estimates.
+ */
+void
+ResetRemoteEstimateCache(void)
+{
+	if (RemoteEstimateHash == NULL)
+		return;
+
+	/* The hash lives in the context, so this frees everything */
+	RemoteEstimateHash = NULL;
+	MemoryContextReset(RemoteEstimateContext);
+}
+
 /*
  * Detect whether we want to process an EquivalenceClass member.
  *
@@ -3077,6 +3383,35 @@ ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
 	return true;
 }
 
+/*
+ * Does the remote query of the scan lock rows?  This must agree with
+ * deparseLockingClause.
+ */
+static bool
+scan_locks_rows(ForeignScan *fsplan, EState *estate)
+{
+	PlannedStmt *pstmt = estate->es_plannedstmt;
+	Bitmapset  *relids;
+	int			relid = -1;
+
+	if (fsplan->scan.scanrelid > 0)
+		relids = bms_make_singleton(fsplan->scan.scanrelid);
+	else
+		relids = fsplan->fs_relids;
+
+	while ((relid = bms_next_member(relids, relid)) >= 0)
+	{
+		PlanRowMark *rc;
+
+		if (list_member_int(pstmt->resultRelations, relid))
+			return true;
+		rc = get_plan_rowmark(pstmt->rowMarks, relid);
+		if (rc && rc->strength != LCS_NONE)
+			return true;
+	}
+	return false;
+}
+
 /*
  * Create cursor for node's query with current parameter values.
  */
@@ -3111,6 +3446,12 @@ create_cursor(ForeignScanState *node)
 		MemoryContextSwitchTo(oldcontext);
 	}
 
+	if (fsstate->prepared)
+	{
+		execute_prepared_scan(node);
+		return;
+	}
+
 	/* Construct the DECLARE CURSOR command */
 	initStringInfo(&buf);
 	appendStringInfo(&buf, "DECLARE c%u CURSOR FOR\n%s",
@@ -3123,6 +3464,7 @@ create_cursor(ForeignScanState *node)
 	 * the desired result.  This allows us to avoid assuming that the remote
 	 * server has the same OIDs we do for the parameters' types.
 	 */
+	ConnectionEntryFinishPending(entry);
 	if (!PQsendQueryParams(conn, buf.data, numParams,
 						   NULL, values, NULL, NULL, 0))
 		pgfdw_report_error(ERROR, NULL, conn, false, buf.data);
@@ -3143,6 +3485,7 @@ create_cursor(ForeignScanState *node)
 	fsstate->tuples = NULL;
 	fsstate->num_tuples = 0;
 	fsstate->next_tuple = 0;
+	fsstate->next_ready = false;
 	fsstate->fetch_ct_2 = 0;
 	fsstate->eof_reached = false;
 
@@ -3150,66 +3493,293 @@ create_cursor(ForeignScanState *node)
 	pfree(buf.data);
 }
 
+/*
+ * Execute node's query as prepared statement with the parameter values
+ * computed by create_cursor(), preparing it first if this query hasn't been
+ * prepared on the connection yet (see GetPreparedScan).
+ * The result is collected by fetch_more_data() like that of a FETCH, except
+ * it always contains all the rows.
+ */
+static void
+execute_prepared_scan(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	ConnCacheEntry *entry = fsstate->conn_entry;
+	PGconn	   *conn = ConnectionEntryGetConn(entry);
+
+	ConnectionEntryFinishPending(entry);
+
+	if (fsstate->p_name == NULL)
+	{
+		const char *prepared = GetPreparedScan(entry, fsstate->query);
+
+		if (prepared != NULL)
+			fsstate->p_name = pstrdup(prepared);
+	}
+
+	if (fsstate->p_name == NULL)
+	{
+		char		prep_name[NAMEDATALEN];
+		PGresult   *res;
+
+		snprintf(prep_name, sizeof(prep_name), "pgsql_fdw_prep_%u",
+				 GetPrepStmtNumber(entry));
+
+		/* As in create_cursor(), leave parameter types to the remote server */
+		if (!PQsendPrepare(conn, prep_name, fsstate->query,
+						   fsstate->numParams, NULL))
+			pgfdw_report_error(ERROR, NULL, conn, false, fsstate->query);
+
+		/*
+		 * We don't use a PG_TRY block here, so be careful not to throw error
+		 * without releasing the PGresult.
+		 */
+		res = pgfdw_get_result(entry, fsstate->query);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			pgfdw_report_error(ERROR, res, conn, true, fsstate->query);
+		PQclear(res);
+
+		RememberPreparedScan(entry, fsstate->query, prep_name);
+		fsstate->p_name = pstrdup(prep_name);
+	}
+
+	/* Binary format can be requested once the first result told us it's ok */
+	if (!PQsendQueryPrepared(conn, fsstate->p_name, fsstate->numParams,
+							 fsstate->param_values, NULL, NULL,
+							 fsstate->recvmeta != NULL ? 1 : 0))
+		pgfdw_report_error(ERROR, NULL, conn, false, fsstate->query);
+
+	/* Show no tuples have been retrieved; the result is on the way */
+	fsstate->cursor_exists = true;
+	fsstate->tuples = NULL;
+	fsstate->num_tuples = 0;
+	fsstate->next_tuple = 0;
+	fsstate->next_ready = false;
+	fsstate->fetch_ct_2 = 0;
+	fsstate->eof_reached = false;
+	fsstate->fetch_pending = true;
+	ConnectionEntrySetPending(entry, fetch_more_data_finish, node);
+}
+
+/*
+ * Send DECLARE CURSOR for node's query together with the first FETCH, and
+ * don't wait for the result: fetch_more_data() will collect it when the
+ * tuples are actually needed, or anybody else will do so on our behalf
+ * before using the connection.  The query must not have parameters.
+ */
+static void
+create_cursor_async(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	ConnCacheEntry *entry = fsstate->conn_entry;
+	PGconn	   *conn = ConnectionEntryGetConn(entry);
+	StringInfoData buf;
+
+	Assert(fsstate->numParams == 0);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "DECLARE c%u CURSOR FOR\n%s;\nFETCH %d FROM c%u",
+					 fsstate->cursor_number, fsstate->query,
+					 fsstate->fetch_size, fsstate->cursor_number);
+
+	ConnectionEntryFinishPending(entry);
+	if (!PQsendQuery(conn, buf.data))
+		pgfdw_report_error(ERROR, NULL, conn, false, buf.data);
+
+	/*
+	 * Mark the cursor as created; if DECLARE fails, we will learn that while
+	 * collecting the result, and the transaction will be aborted anyway.
+	 */
+	fsstate->cursor_exists = true;
+	fsstate->tuples = NULL;
+	fsstate->num_tuples = 0;
+	fsstate->next_tuple = 0;
+	fsstate->next_ready = false;
+	fsstate->fetch_ct_2 = 0;
+	fsstate->eof_reached = false;
+	fsstate->fetch_pending = true;
+	ConnectionEntrySetPending(entry, fetch_more_data_finish, node);
+
+	pfree(buf.data);
+}
+
 /*
  * Fetch some more rows from the node's cursor.
+ *
+ * Batches are double-buffered: as soon as a batch is handed over to the
+ * executor, FETCH for the following one is sent, so that the remote server
+ * produces it and the network delivers it while we are busy returning the
+ * current rows.
  */
 static void
 fetch_more_data(ForeignScanState *node)
 {
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	MemoryContext cxt;
+
+	/* Request the next batch unless it is on the way or here already */
+	if (!fsstate->fetch_pending && !fsstate->next_ready)
+		fetch_more_data_begin(node);
+
+	fetch_more_data_wait(node);
+	Assert(fsstate->next_ready);
+
+	/*
+	 * Make the prefetched batch current.  The previous batch isn't referenced
+	 * anymore, its context will be reused for the next prefetch.
+	 */
+	cxt = fsstate->batch_cxt;
+	fsstate->batch_cxt = fsstate->next_batch_cxt;
+	fsstate->next_batch_cxt = cxt;
+	fsstate->tuples = fsstate->next_tuples;
+	fsstate->num_tuples = fsstate->next_num_tuples;
+	fsstate->next_tuple = 0;
+	fsstate->next_tuples = NULL;
+	fsstate->next_num_tuples = 0;
+	fsstate->next_ready = false;
+
+	/* Ask for the next batch right away, if there is one */
+	if (!fsstate->eof_reached)
+		fetch_more_data_begin(node);
+}
+
+/*
+ * Send FETCH for the next batch of rows without waiting for the result.
+ */
+static void
+fetch_more_data_begin(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+	ConnCacheEntry *entry = fsstate->conn_entry;
+	PGconn	   *conn = ConnectionEntryGetConn(entry);
+	char		sql[64];
+
+	Assert(!fsstate->fetch_pending && !fsstate->next_ready);
+
+	snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
+			 fsstate->fetch_size, fsstate->cursor_number);
+
+	/*
+	 * Once we know that all the columns can be transferred in binary, ask for
+	 * that; the extended protocol is needed to choose the result format.
+	 */
+	ConnectionEntryFinishPending(entry);
+	if (fsstate->recvmeta != NULL)
+	{
+		if (!PQsendQueryParams(conn, sql, 0, NULL, NULL, NULL, NULL, 1))
+			pgfdw_report_error(ERROR, NULL, conn, false, sql);
+	}
+	else if (!PQsendQuery(conn, sql))
+		pgfdw_report_error(ERROR, NULL, conn, false, sql);
+
+	fsstate->fetch_pending = true;
+	ConnectionEntrySetPending(entry, fetch_more_data_finish, node);
+}
+
+/*
+ * Wait for the FETCH sent by fetch_more_data_begin() or create_cursor_async(),
+ * if it hasn't been collected yet.
+ */
+static void
+fetch_more_data_wait(ForeignScanState *node)
+{
+	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
+
+	if (!fsstate->fetch_pending)
+		return;
+
+	/*
+	 * The result could only have been lost if the remote (sub)transaction it
+	 * was running in has been aborted.
+	 */
+	if (ConnectionEntryGetPending(fsstate->conn_entry) != node)
+		elog(ERROR, "result of asynchronous fetch from cursor c%u was lost",
+			 fsstate->cursor_number);
+
+	ConnectionEntryFinishPending(fsstate->conn_entry);
+	Assert(!fsstate->fetch_pending);
+}
+
+/*
+ * Collect the result of FETCH in flight and store the rows in the prefetch
+ * buffer.  This is registered as pending callback of the connection, so it
+ * might be called by whoever needs the connection next, while the executor
+ * is still working with the node's current batch.
+ */
+static void
+fetch_more_data_finish(void *arg)
+{
+	ForeignScanState *node = (ForeignScanState *) arg;
 	PgFdwScanState *fsstate = (PgFdwScanState *) node->fdw_state;
 	PGresult   *volatile res = NULL;
 	MemoryContext oldcontext;
 
+	Assert(!fsstate->next_ready);
+	fsstate->fetch_pending = false;
+
 	/*
-	 * We'll store the tuples in the batch_cxt.  First, flush the previous
-	 * batch.
+	 * We'll store the tuples in the next_batch_cxt.  First, flush whatever
+	 * was left there from an already consumed batch.
 	 */
-	fsstate->tuples = NULL;
-	MemoryContextReset(fsstate->batch_cxt);
-	oldcontext = MemoryContextSwitchTo(fsstate->batch_cxt);
+	fsstate->next_tuples = NULL;
+	MemoryContextReset(fsstate->next_batch_cxt);
+	oldcontext = MemoryContextSwitchTo(fsstate->next_batch_cxt);
 
 	/* PGresult must be released before leaving this function. */
 	PG_TRY();
 	{
 		ConnCacheEntry *entry = fsstate->conn_entry;
 		PGconn	   *conn = ConnectionEntryGetConn(entry);
-		char		sql[64];
 		int			numrows;
+		int			nfields;
+		int64		nbytes = 0;
 		int			i;
+		int			j;
 
-		snprintf(sql, sizeof(sql), "FETCH %d FROM c%u",
-				 fsstate->fetch_size, fsstate->cursor_number);
-
-		res = pgfdw_exec_query(entry, sql);
+		res = pgfdw_get_result(entry, fsstate->query);
 		/* On error, report the original query, not the FETCH. */
 		if (PQresultStatus(res) != PGRES_TUPLES_OK)
 			pgfdw_report_error(ERROR, res, conn, false, fsstate->query);
 
+		/* The first batch tells us the remote column types */
+		if (!fsstate->format_chosen)
+			choose_result_format(fsstate, res);
+
 		/* Convert the data into HeapTuples */
 		numrows = PQntuples(res);
-		fsstate->tuples = (HeapTuple *) palloc0(numrows * sizeof(HeapTuple));
-		fsstate->num_tuples = numrows;
-		fsstate->next_tuple = 0;
+		nfields = PQnfields(res);
+		fsstate->next_tuples = (HeapTuple *) palloc0(numrows * sizeof(HeapTuple));
+		fsstate->next_num_tuples = numrows;
 
 		for (i = 0; i < numrows; i++)
 		{
 			Assert(IsA(node->ss.ps.plan, ForeignScan));
 
-			fsstate->tuples[i] =
+			fsstate->next_tuples[i] =
 				make_tuple_from_result_row(res, i,
 										   fsstate->rel,
 										   fsstate->attinmeta,
+										   PQbinaryTuples(res) ?
+										   fsstate->recvmeta : NULL,
 										   fsstate->retrieved_attrs,
 										   node,
 										   fsstate->temp_cxt);
+			for (j = 0; j < nfields; j++)
+				nbytes += PQgetlength(res, i, j);
 		}
+		ConnectionEntryCountFetch(entry, numrows, nbytes);
 
 		/* Update fetch_ct_2 */
 		if (fsstate->fetch_ct_2 < 2)
 			fsstate->fetch_ct_2++;
 
-		/* Must be EOF if we didn't get as many tuples as we asked for. */
-		fsstate->eof_reached = (numrows < fsstate->fetch_size);
+		/*
+		 * Must be EOF if we didn't get as many tuples as we asked for, or if
+		 * this was the complete result of a prepared statement.
+		 */
+		fsstate->eof_reached = (fsstate->prepared ||
+								numrows < fsstate->fetch_size);
+		fsstate->next_ready = true;
 
 		PQclear(res);
 		res = NULL;
@@ -3225,6 +3795,77 @@ fetch_more_data(ForeignScanState *node)
 	MemoryContextSwitchTo(oldcontext);
 }
 
+/*
+ * Decide whether the rest of the scan can be fetched in binary format, given
+ * the first result, which always comes in text format.
+ *
+ * Binary representation is only understood if the remote column has exactly
+ * the type of the local one, its OID is the same on both sides, and the type
+ * has a receive function; in any other case, including system columns, we
+ * stay with text for the whole scan.
+ */
+static void
+choose_result_format(PgFdwScanState *fsstate, PGresult *res)
+{
+	TupleDesc	tupdesc = fsstate->tupdesc;
+	MemoryContext oldcontext;
+	AttRecvMetadata *recvmeta;
+	ListCell   *lc;
+	int			j;
+
+	fsstate->format_chosen = true;
+
+	if (!fsstate->binary_format || fsstate->retrieved_attrs == NIL ||
+		list_length(fsstate->retrieved_attrs) != PQnfields(res))
+		return;
+
+	j = 0;
+	foreach(lc, fsstate->retrieved_attrs)
+	{
+		int			i = lfirst_int(lc);
+		Oid			typid;
+		HeapTuple	tup;
+		bool		has_receive;
+
+		if (i <= 0)
+			return;
+
+		typid = TupleDescAttr(tupdesc, i - 1)->atttypid;
+		if (PQftype(res, j) != typid || !is_builtin(typid))
+			return;
+
+		tup = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+		if (!HeapTupleIsValid(tup))
+			elog(ERROR, "cache lookup failed for type %u", typid);
+		has_receive = OidIsValid(((Form_pg_type) GETSTRUCT(tup))->typreceive);
+		ReleaseSysCache(tup);
+		if (!has_receive)
+			return;
+
+		j++;
+	}
+
+	/* Everything is fine, look up the receive functions */
+	oldcontext = MemoryContextSwitchTo(GetMemoryChunkContext(fsstate));
+
+	recvmeta = (AttRecvMetadata *) palloc(sizeof(AttRecvMetadata));
+	recvmeta->attrecvfuncs = (FmgrInfo *) palloc0(tupdesc->natts *
+												  sizeof(FmgrInfo));
+	recvmeta->attioparams = (Oid *) palloc0(tupdesc->natts * sizeof(Oid));
+	foreach(lc, fsstate->retrieved_attrs)
+	{
+		int			i = lfirst_int(lc);
+		Oid			recvfunc;
+
+		getTypeBinaryInputInfo(TupleDescAttr(tupdesc, i - 1)->atttypid,
+							   &recvfunc, &recvmeta->attioparams[i - 1]);
+		fmgr_info(recvfunc, &recvmeta->attrecvfuncs[i - 1]);
+	}
+	fsstate->recvmeta = recvmeta;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
 /*
  * Force assorted GUC parameters to settings that ensure that we'll output
  * data values in a form that is unambiguous to the remote server.
@@ -3310,7 +3951,8 @@ create_foreign_modify(EState *estate,
 					  char *query,
 					  List *target_attrs,
 					  bool has_returning,
-					  List *retrieved_attrs)
+					  List *retrieved_attrs,
+					  int batch_size)
 {
 	PgFdwModifyState *fmstate;
 	Relation	rel = resultRelInfo->ri_RelationDesc;
@@ -3339,6 +3981,7 @@ create_foreign_modify(EState *estate,
 
 	/* Open connection; report that we'll create a prepared statement. */
 	fmstate->conn_entry = GetConnection(user, true);
+	ConnectionEntryMarkModified(fmstate->conn_entry);
 	fmstate->p_name = NULL;		/* prepared statement not made yet */
 
 	/* Set up remote query information. */
@@ -3395,9 +4038,192 @@ create_foreign_modify(EState *estate,
 
 	Assert(fmstate->p_nums <= n_params);
 
+	/*
+	 * Set up for batched INSERT.  The wire protocol limits the number of
+	 * parameters of a statement, which caps the batch size.
+	 */
+	if (fmstate->p_nums > 0)
+		batch_size = Min(batch_size, MAX_QUERY_PARAMS / fmstate->p_nums);
+	else
+		batch_size = 1;
+	fmstate->batch_size = batch_size;
+	fmstate->num_batched = 0;
+	fmstate->batch_query = NULL;
+	if (batch_size > 1)
+	{
+		Assert(operation == CMD_INSERT && !has_returning);
+		fmstate->batch_values = (const char **)
+			palloc(sizeof(char *) * fmstate->p_nums * batch_size);
+	}
+
 	return fmstate;
 }
 
+/*
+ * Determine batch size for a given foreign table.  The option specified for
+ * a table has precedence.
+ */
+static int
+get_batch_size_option(Relation rel)
+{
+	ForeignTable *table = GetForeignTable(RelationGetRelid(rel));
+	ForeignServer *server = GetForeignServer(table->serverid);
+	List	   *options;
+	ListCell   *lc;
+
+	/* we use 1 by default, which means "no batching" */
+	int			batch_size = 1;
+
+	options = list_concat(list_copy(table->options),
+						  list_copy(server->options));
+
+	/* See if either table or server specifies batch_size. */
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "batch_size") == 0)
+		{
+			batch_size = strtol(defGetString(def), NULL, 10);
+			break;
+		}
+	}
+
+	return batch_size;
+}
+
+/*
+ * send_insert_batch
+ *		Send the collected rows to the remote server as one INSERT
+ *
+ * We don't wait for the result; it is collected by finish_insert_batch
+ * when the connection is needed next, e.g. for the next batch.
+ */
+static void
+send_insert_batch(PgFdwModifyState *fmstate)
+{
+	ConnCacheEntry *entry = fmstate->conn_entry;
+	PGconn	   *conn = ConnectionEntryGetConn(entry);
+	const char *sql;
+	StringInfoData buf;
+
+	Assert(fmstate->num_batched > 0);
+
+	/* The statement for a full batch is the same each time, so keep it */
+	if (fmstate->num_batched == fmstate->batch_size &&
+		fmstate->batch_query != NULL)
+		sql = fmstate->batch_query;
+	else
+	{
+		MemoryContext oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(GetMemoryChunkContext(fmstate));
+		initStringInfo(&buf);
+		rebuildInsertSql(&buf, fmstate->query, fmstate->p_nums,
+						 fmstate->num_batched);
+		MemoryContextSwitchTo(oldcontext);
+
+		sql = buf.data;
+		if (fmstate->num_batched == fmstate->batch_size)
+			fmstate->batch_query = buf.data;
+	}
+
+	/* Only one batch can be in flight, so this also waits for the previous */
+	ConnectionEntryFinishPending(entry);
+	if (!PQsendQueryParams(conn, sql, fmstate->num_batched * fmstate->p_nums,
+						   NULL, fmstate->batch_values, NULL, NULL, 0))
+		pgfdw_report_error(ERROR, NULL, conn, false, sql);
+	ConnectionEntrySetPending(entry, finish_insert_batch, fmstate);
+
+	/* libpq has copied the parameters, so we can forget them */
+	fmstate->num_batched = 0;
+	MemoryContextReset(fmstate->temp_cxt);
+}
+
+/*
+ * finish_insert_batch
+ *		Collect the result of an INSERT sent by send_insert_batch
+ */
+static void
+finish_insert_batch(void *arg)
+{
+	PgFdwModifyState *fmstate = (PgFdwModifyState *) arg;
+	PGresult   *res;
+
+	/*
+	 * We don't use a PG_TRY block here, so be careful not to throw error
+	 * without releasing the PGresult.
+	 */
+	res = pgfdw_get_result(fmstate->conn_entry, fmstate->query);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		pgfdw_report_error(ERROR, res,
+						   ConnectionEntryGetConn(fmstate->conn_entry),
+						   true, fmstate->query);
+	PQclear(res);
+}
+
+/*
+ * flush_insert_batches
+ *		Send the rows collected for a batch, and make sure all batches are
+ *		inserted
+ */
+static void
+flush_insert_batches(PgFdwModifyState *fmstate)
+{
+	if (fmstate->batch_size <= 1)
+		return;
+
+	if (fmstate->num_batched > 0)
+		send_insert_batch(fmstate);
+	if (ConnectionEntryGetPending(fmstate->conn_entry) == fmstate)
+		ConnectionEntryFinishPending(fmstate->conn_entry);
+}
+
+/*
+ * flush_result_rel_batches
+ *		flush_insert_batches for a result relation, if it is our foreign
+ *		table being modified row by row
+ */
+static void
+flush_result_rel_batches(ResultRelInfo *resultRelInfo)
+{
+	if (resultRelInfo->ri_FdwRoutine == NULL ||
+		resultRelInfo->ri_FdwRoutine->ExecForeignInsert != postgresExecForeignInsert ||
+		resultRelInfo->ri_usesFdwDirectModify ||
+		resultRelInfo->ri_FdwState == NULL)
+		return;
+
+	flush_insert_batches((PgFdwModifyState *) resultRelInfo->ri_FdwState);
+}
+
+/*
+ * pgfdw_ExecutorFinish
+ *		Wait for batched INSERTs before the statement's AFTER triggers
+ *
+ * Without this, rows of the last batch would be sent only at ExecutorEnd,
+ * and a remote error would show up later than the statement which caused
+ * it, e.g. in a trigger querying the table.  Main ModifyTable is complete
+ * by now; data-modifying CTEs run to completion in ExecutorFinish itself
+ * are flushed by EndForeignModify.
+ */
+static void
+pgfdw_ExecutorFinish(QueryDesc *queryDesc)
+{
+	EState	   *estate = queryDesc->estate;
+	ListCell   *lc;
+	int			i;
+
+	for (i = 0; i < estate->es_num_result_relations; i++)
+		flush_result_rel_batches(&estate->es_result_relations[i]);
+	foreach(lc, estate->es_tuple_routing_result_relations)
+		flush_result_rel_batches((ResultRelInfo *) lfirst(lc));
+
+	if (PreviousExecutorFinishHook)
+		PreviousExecutorFinishHook(queryDesc);
+	else
+		standard_ExecutorFinish(queryDesc);
+}
+
 /*
  * prepare_foreign_modify
  *		Establish a prepared statement for execution of INSERT/UPDATE/DELETE
@@ -3423,6 +4249,7 @@ prepare_foreign_modify(PgFdwModifyState *fmstate)
 	 * the prepared statements we use in this module are simple enough that
 	 * the remote server will make the right choices.
 	 */
+	ConnectionEntryFinishPending(fmstate->conn_entry);
 	if (!PQsendPrepare(conn,
 					   p_name,
 					   fmstate->query,
@@ -3527,6 +4354,7 @@ store_returning_result(PgFdwModifyState *fmstate,
 		newtup = make_tuple_from_result_row(res, 0,
 											fmstate->rel,
 											fmstate->attinmeta,
+											NULL,
 											fmstate->retrieved_attrs,
 											NULL,
 											fmstate->temp_cxt);
@@ -3551,6 +4379,9 @@ finish_foreign_modify(PgFdwModifyState *fmstate)
 {
 	Assert(fmstate != NULL);
 
+	/* Normally done by pgfdw_ExecutorFinish already, but not for CTEs */
+	flush_insert_batches(fmstate);
+
 	/* If we created a prepared statement, destroy it */
 	if (fmstate->p_name)
 	{
@@ -3736,6 +4567,7 @@ execute_dml_stmt(ForeignScanState *node)
 	 * the desired result.  This allows us to avoid assuming that the remote
 	 * server has the same OIDs we do for the parameters' types.
 	 */
+	ConnectionEntryFinishPending(entry);
 	if (!PQsendQueryParams(conn, dmstate->query, numParams,
 						   NULL, values, NULL, NULL, 0))
 		pgfdw_report_error(ERROR, NULL, conn, false, dmstate->query);
@@ -3805,6 +4637,7 @@ get_returning_data(ForeignScanState *node)
 												dmstate->next_tuple,
 												dmstate->rel,
 												dmstate->attinmeta,
+												NULL,
 												dmstate->retrieved_attrs,
 												node,
 												dmstate->temp_cxt);
@@ -4398,6 +5231,7 @@ analyze_row_processor(PGresult *res, int row, PgFdwAnalyzeState *astate)
 		astate->rows[pos] = make_tuple_from_result_row(res, row,
 													   astate->rel,
 													   astate->attinmeta,
+													   NULL,
 													   astate->retrieved_attrs,
 													   NULL,
 													   astate->temp_cxt);
@@ -5029,6 +5863,12 @@ apply_server_options(PgFdwRelationInfo *fpinfo)
 				ExtractExtensionList(defGetString(def), false);
 		else if (strcmp(def->defname, "fetch_size") == 0)
 			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "async_capable") == 0)
+			fpinfo->async_capable = defGetBoolean(def);
+		else if (strcmp(def->defname, "binary_format") == 0)
+			fpinfo->binary_format = defGetBoolean(def);
+		else if (strcmp(def->defname, "prepare_scans") == 0)
+			fpinfo->prepare_scans = defGetBoolean(def);
 	}
 }
 
@@ -5050,6 +5890,12 @@ apply_table_options(PgFdwRelationInfo *fpinfo)
 			fpinfo->use_remote_estimate = defGetBoolean(def);
 		else if (strcmp(def->defname, "fetch_size") == 0)
 			fpinfo->fetch_size = strtol(defGetString(def), NULL, 10);
+		else if (strcmp(def->defname, "async_capable") == 0)
+			fpinfo->async_capable = defGetBoolean(def);
+		else if (strcmp(def->defname, "binary_format") == 0)
+			fpinfo->binary_format = defGetBoolean(def);
+		else if (strcmp(def->defname, "prepare_scans") == 0)
+			fpinfo->prepare_scans = defGetBoolean(def);
 	}
 }
 
@@ -5084,6 +5930,9 @@ merge_fdw_options(PgFdwRelationInfo *fpinfo,
 	fpinfo->shippable_extensions = fpinfo_o->shippable_extensions;
 	fpinfo->use_remote_estimate = fpinfo_o->use_remote_estimate;
 	fpinfo->fetch_size = fpinfo_o->fetch_size;
+	fpinfo->async_capable = fpinfo_o->async_capable;
+	fpinfo->binary_format = fpinfo_o->binary_format;
+	fpinfo->prepare_scans = fpinfo_o->prepare_scans;
 
 	/* Merge the table level options from either side of the join. */
 	if (fpinfo_i)
@@ -5105,6 +5954,14 @@ merge_fdw_options(PgFdwRelationInfo *fpinfo,
 		 * relation sizes.
 		 */
 		fpinfo->fetch_size = Max(fpinfo_o->fetch_size, fpinfo_i->fetch_size);
+
+		/* Start the join early only if both sides allow that. */
+		fpinfo->async_capable = fpinfo_o->async_capable &&
+			fpinfo_i->async_capable;
+		fpinfo->binary_format = fpinfo_o->binary_format &&
+			fpinfo_i->binary_format;
+		fpinfo->prepare_scans = fpinfo_o->prepare_scans &&
+			fpinfo_i->prepare_scans;
 	}
 }
 
@@ -5458,6 +6315,9 @@ foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
  *		corresponding operations are safe to push down.
  *
  * Right now, we only support aggregate, grouping and having clause pushdown.
+ * Besides complete aggregation, partial one is supported, so that for a
+ * partitioned table with foreign partitions each of them computes partial
+ * aggregates while the local server combines them.
  */
 static void
 postgresGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
@@ -5475,7 +6335,9 @@ postgresGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
 		return;
 
 	/* Ignore stages we don't support; and skip any duplicate calls. */
-	if (stage != UPPERREL_GROUP_AGG || output_rel->fdw_private)
+	if ((stage != UPPERREL_GROUP_AGG &&
+		 stage != UPPERREL_PARTIAL_GROUP_AGG) ||
+		output_rel->fdw_private)
 		return;
 
 	fpinfo = (PgFdwRelationInfo *) palloc0(sizeof(PgFdwRelationInfo));
@@ -5483,7 +6345,8 @@ postgresGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
 	output_rel->fdw_private = fpinfo;
 
 	add_foreign_grouping_paths(root, input_rel, output_rel,
-							   (GroupPathExtraData *) extra);
+							   (GroupPathExtraData *) extra,
+							   stage == UPPERREL_PARTIAL_GROUP_AGG);
 }
 
 /*
@@ -5491,12 +6354,13 @@ postgresGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
  *		Add foreign path for grouping and/or aggregation.
  *
  * Given input_rel represents the underlying scan.  The paths are added to the
- * given grouped_rel.
+ * given grouped_rel, which is partially grouped rel if partial is true.
  */
 static void
 add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
 						   RelOptInfo *grouped_rel,
-						   GroupPathExtraData *extra)
+						   GroupPathExtraData *extra,
+						   bool partial)
 {
 	Query	   *parse = root->parse;
 	PgFdwRelationInfo *ifpinfo = input_rel->fdw_private;
@@ -5513,7 +6377,8 @@ add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
 		return;
 
 	Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
-		   extra->patype == PARTITIONWISE_AGGREGATE_FULL);
+		   extra->patype == PARTITIONWISE_AGGREGATE_FULL ||
+		   (partial && extra->patype == PARTITIONWISE_AGGREGATE_PARTIAL));
 
 	/* save the input_rel as outerrel in fpinfo */
 	fpinfo->outerrel = input_rel;
@@ -5531,9 +6396,11 @@ add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
 	 * Assess if it is safe to push down aggregation and grouping.
 	 *
 	 * Use HAVING qual from extra. In case of child partition, it will have
-	 * translated Vars.
+	 * translated Vars.  HAVING is applied after combining partial results,
+	 * so it is never pushed down together with partial aggregation.
 	 */
-	if (!foreign_grouping_ok(root, grouped_rel, extra->havingQual))
+	if (!foreign_grouping_ok(root, grouped_rel,
+							 partial ? NULL : extra->havingQual))
 		return;
 
 	/* Estimate the cost of push down */
@@ -5575,6 +6442,7 @@ make_tuple_from_result_row(PGresult *res,
 						   int row,
 						   Relation rel,
 						   AttInMetadata *attinmeta,
+						   AttRecvMetadata *recvmeta,
 						   List *retrieved_attrs,
 						   ForeignScanState *fsstate,
 						   MemoryContext temp_context)
@@ -5633,7 +6501,7 @@ make_tuple_from_result_row(PGresult *res,
 		int			i = lfirst_int(lc);
 		char	   *valstr;
 
-		/* fetch next column's textual value */
+		/* fetch next column's textual (or binary) value */
 		if (PQgetisnull(res, row, j))
 			valstr = NULL;
 		else
@@ -5650,11 +6518,35 @@ make_tuple_from_result_row(PGresult *res,
 			/* ordinary column */
 			Assert(i <= tupdesc->natts);
 			nulls[i - 1] = (valstr == NULL);
-			/* Apply the input function even to nulls, to support domains */
-			values[i - 1] = InputFunctionCall(&attinmeta->attinfuncs[i - 1],
-											  valstr,
-											  attinmeta->attioparams[i - 1],
-											  attinmeta->atttypmods[i - 1]);
+			if (recvmeta)
+			{
+				StringInfoData buf;
+
+				/* libpq keeps binary values writable and null-terminated */
+				if (valstr != NULL)
+				{
+					buf.data = valstr;
+					buf.len = PQgetlength(res, row, j);
+					buf.maxlen = buf.len + 1;
+					buf.cursor = 0;
+				}
+				values[i - 1] = ReceiveFunctionCall(&recvmeta->attrecvfuncs[i - 1],
+													valstr ? &buf : NULL,
+													recvmeta->attioparams[i - 1],
+													attinmeta->atttypmods[i - 1]);
+				if (valstr != NULL && buf.cursor != buf.len)
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							 errmsg("incorrect binary data format")));
+			}
+			else
+			{
+				/* Apply the input function even to nulls, to support domains */
+				values[i - 1] = InputFunctionCall(&attinmeta->attinfuncs[i - 1],
+												  valstr,
+												  attinmeta->attioparams[i - 1],
+												  attinmeta->atttypmods[i - 1]);
+			}
 		}
 		else if (i == SelfItemPointerAttributeNumber)
 		{
@@ -5851,6 +6743,7 @@ postgresBeginForeignCopyFrom(EState *estate, ResultRelInfo *rinfo,
 	ForeignTable	*table;
 	UserMapping		*user;
 	StringInfoData 	sql;
+	ConnCacheEntry	*conn_entry;
 	PGconn	   		*conn;
 	PGresult   		*res;
 	bool			*copy_from_started;
@@ -5866,11 +6759,12 @@ postgresBeginForeignCopyFrom(EState *estate, ResultRelInfo *rinfo,
 	/* Get info about foreign table. */
 	table = GetForeignTable(RelationGetRelid(rel));
 	user = GetUserMapping(userid, table->serverid);
-	rinfo->ri_FdwState = user;
 
 	/* Get (open, if not yet) connection */
-	conn = ConnectionEntryGetConn(
-		GetConnectionCopyFrom(user, false, &copy_from_started));
+	conn_entry = GetConnectionCopyFrom(user, false, &copy_from_started);
+	conn = ConnectionEntryGetConn(conn_entry);
+	ConnectionEntryMarkModified(conn_entry);
+	rinfo->ri_FdwState = conn_entry;
 	/* We already did COPY FROM to this server */
 	if (*copy_from_started)
 		return;
@@ -5884,6 +6778,7 @@ postgresBeginForeignCopyFrom(EState *estate, ResultRelInfo *rinfo,
 	initStringInfo(&sql);
 	deparseCopyFromSql(&sql, rel, cstate, dest_relname);
 
+	ConnectionEntryFinishPending(conn_entry);
 	res = PQexec(conn, sql.data);
 	if (PQresultStatus(res) != PGRES_COPY_IN)
 	{
@@ -5891,54 +6786,42 @@ postgresBeginForeignCopyFrom(EState *estate, ResultRelInfo *rinfo,
 	}
 	PQclear(res);
 
-	*copy_from_started = true;
+	/* Rows for all partitions on this server go through one COPY stream */
+	pgfdw_copy_start(conn_entry);
 }
 
-/* COPY FROM next row to foreign table */
+/*
+ * COPY FROM next row to foreign table
+ *
+ * Rows are only buffered here and go to the server in large chunks, without
+ * blocking on a server which is slow to accept them as long as others can
+ * make progress.  Binary format is rejected upfront by deparseCopyFromSql,
+ * since in binary mode the core doesn't leave the raw row in line_buf.
+ */
 static void
 postgresForeignNextCopyFrom(EState *estate, ResultRelInfo *rinfo,
 							CopyState cstate)
 {
-	bool		*copy_from_started;
-	UserMapping *user = (UserMapping *) rinfo->ri_FdwState;
-	PGconn		*conn = ConnectionEntryGetConn(
-		GetConnectionCopyFrom(user, false, &copy_from_started));
+	ConnCacheEntry *conn_entry = (ConnCacheEntry *) rinfo->ri_FdwState;
 
-	Assert(copy_from_started);
 	Assert(!cstate->binary);
-	/* TODO: distinuish failure and nonblocking-send EAGAIN */
-	if (PQputline(conn, cstate->line_buf.data) || PQputnbytes(conn, "\n", 1))
-	{
-		pgfdw_report_error(ERROR, NULL, conn, false, cstate->line_buf.data);
-	}
+	pgfdw_copy_data(conn_entry, cstate->line_buf.data, cstate->line_buf.len);
+	pgfdw_copy_data(conn_entry, "\n", 1);
 }
 
-/* Finish COPY FROM */
+/*
+ * Finish COPY FROM
+ *
+ * This is called for each foreign partition rows were routed to; the first
+ * call finishes COPY on all the servers at once.
+ */
 static void
 postgresEndForeignCopyFrom(EState *estate, ResultRelInfo *rinfo)
 {
-	bool		*copy_from_started;
-	UserMapping *user = (UserMapping *) rinfo->ri_FdwState;
-	ConnCacheEntry *conn_entry = GetConnectionCopyFrom(user, false,
-													   &copy_from_started);
-	PGconn		*conn = ConnectionEntryGetConn(conn_entry);
-	PGresult	*res;
+	ConnCacheEntry *conn_entry = (ConnCacheEntry *) rinfo->ri_FdwState;
 
-	if (*copy_from_started)
-	{
-		/* TODO: PQgetResult? */
-		if (PQendcopy(conn))
-		{
-			pgfdw_report_error(ERROR, NULL, conn, false, "end postgres_fdw copy from");
-		}
-		while ((res = PQgetResult(conn)) != NULL)
-		{
-			/* TODO: get error? */
-			PQclear(res);
-		}
-		*copy_from_started = false;
-		ReleaseConnection(conn_entry);
-	}
+	pgfdw_copy_end_all();
+	ReleaseConnection(conn_entry);
 }
 
 void
@@ -5952,4 +6835,34 @@ postgres_fdw_PG_init(void)
 							 "Use repeatable read isilation error for remote transactions", NULL,
 							 &UseRepeatableRead, true, PGC_USERSET, 0, NULL,
 							 NULL, NULL);
+	DefineCustomIntVariable("postgres_fdw.remote_estimate_cache_ttl",
+							"How long to reuse remote estimates obtained with use_remote_estimate",
+							"Zero disables caching of the estimates.",
+							&remote_estimate_cache_ttl, 60, 0, INT_MAX / 1000,
+							PGC_USERSET, GUC_UNIT_S, NULL, NULL, NULL);
+	DefineCustomRealVariable("postgres_fdw.trace_2pc_sample_rate",
+							 "Fraction of two-phase commits to trace",
+							 "Traces of sampled transactions are written to the server log: gid, chosen csn and how long each phase took on each participant.",
+							 &Trace2PCSampleRate, 0.0, 0.0, 1.0, PGC_SUSET, 0,
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("postgres_fdw.idle_connection_timeout",
+							"Closes connections to foreign servers not used for this long",
+							"Checked at transaction end; zero keeps connections for the session lifetime.",
+							&IdleConnectionTimeout, 0, 0, INT_MAX / 1000,
+							PGC_USERSET, GUC_UNIT_S, NULL, NULL, NULL);
+	DefineCustomBoolVariable("postgres_fdw.standby_reads",
+							 "Sends scans of read-only transactions to standbys of foreign servers",
+							 "Used for servers with standby_hosts option; a standby is read from only once it has replayed the master's WAL written before the remote transaction would start. Ignored with global snapshots, which standbys can't provide.",
+							 &UseStandbyReads, false, PGC_USERSET, 0, NULL,
+							 NULL, NULL);
+	DefineCustomIntVariable("postgres_fdw.standby_wait_timeout",
+							"How long to wait for a standby to catch up before reading from the master instead",
+							NULL,
+							&StandbyWaitTimeout, 100, 0, INT_MAX,
+							PGC_USERSET, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	PreviousExecutorFinishHook = ExecutorFinish_hook;
+	ExecutorFinish_hook = pgfdw_ExecutorFinish;
+
+	pgfdw_stats_init();
 }
@@ -27,6 +27,39 @@
  */
 typedef struct ConnCacheEntry ConnCacheEntry;
 
+/*
+ * Callback collecting the result of a query sent asynchronously on a
+ * connection, see ConnectionEntrySetPending.
+ */
+typedef void (*PgFdwPendingCallback) (void *arg);
+
+/*
+ * Phases of two-phase commit whose latency is accounted per server.
+ */
+typedef enum PgFdwStatsPhase
+{
+	PGFDW_PHASE_PREPARE,		/* PREPARE with pg_global_snapshot_prepare() */
+	PGFDW_PHASE_ASSIGN,			/* pg_global_snapshot_assign() */
+	PGFDW_PHASE_COMMIT,			/* COMMIT PREPARED */
+	PGFDW_NUM_PHASES,
+	PGFDW_PHASE_NONE = PGFDW_NUM_PHASES /* anything else, not accounted */
+} PgFdwStatsPhase;
+
+/*
+ * Counters of communication with a foreign server, see stats.c.  Times are
+ * in milliseconds.
+ */
+typedef struct PgFdwStatsCounters
+{
+	int64		round_trips;	/* queries we waited the result of */
+	double		wait_time;		/* time spent waiting on the socket */
+	int64		rows_fetched;	/* rows received by foreign scans */
+	int64		bytes_fetched;	/* size of their values */
+	int64		copy_bytes;		/* COPY FROM data sent */
+	int64		phase_count[PGFDW_NUM_PHASES];	/* 2PC phases performed */
+	double		phase_time[PGFDW_NUM_PHASES];	/* and total time they took */
+} PgFdwStatsCounters;
+
 /*
  * FDW-specific planner information kept in RelOptInfo.fdw_private for a
  * postgres_fdw foreign table.  For a baserel, this struct is created by
@@ -84,6 +117,9 @@ typedef struct PgFdwRelationInfo
 	UserMapping *user;			/* only set in use_remote_estimate mode */
 
 	int			fetch_size;		/* fetch size for this remote table */
+	bool		async_capable;	/* start remote scans at executor startup? */
+	bool		binary_format;	/* fetch rows in binary format if possible? */
+	bool		prepare_scans;	/* prepare parameterized scan queries? */
 
 	/*
 	 * Name of the relation while EXPLAINing ForeignScan. It is used for join
@@ -122,19 +158,35 @@ extern void	postgres_fdw_PG_init(void);
 /* in postgres_fdw.c */
 extern int	set_transmission_modes(void);
 extern void reset_transmission_modes(int nestlevel);
+extern void ResetRemoteEstimateCache(void);
 
 /* in connection.c */
 extern ConnCacheEntry *GetConnection(UserMapping *user, bool will_prep_stmt);
 extern ConnCacheEntry *GetConnectionCopyFrom(UserMapping *user, bool will_prep_stmt,
 											 bool **copy_from_started);
+extern ConnCacheEntry *GetConnectionForScan(UserMapping *user,
+											bool will_prep_stmt);
 extern PGconn *ConnectionEntryGetConn(ConnCacheEntry *entry);
 extern void ReleaseConnection(ConnCacheEntry *entry);
+extern void ConnectionEntryMarkModified(ConnCacheEntry *entry);
+extern void ConnectionEntrySetPending(ConnCacheEntry *entry,
+						  PgFdwPendingCallback callback, void *arg);
+extern void *ConnectionEntryGetPending(ConnCacheEntry *entry);
+extern void ConnectionEntryFinishPending(ConnCacheEntry *entry);
+extern void ConnectionEntryCountFetch(ConnCacheEntry *entry, int64 rows,
+						  int64 bytes);
 extern unsigned int GetCursorNumber(ConnCacheEntry *entry);
 extern unsigned int GetPrepStmtNumber(ConnCacheEntry *entry);
+extern const char *GetPreparedScan(ConnCacheEntry *entry, const char *query);
+extern void RememberPreparedScan(ConnCacheEntry *entry, const char *query,
+					 const char *name);
 extern PGresult *pgfdw_get_result(ConnCacheEntry *entry, const char *query);
 extern PGresult *pgfdw_exec_query(ConnCacheEntry *entry, const char *query);
 extern void pgfdw_report_error(int elevel, PGresult *res, PGconn *conn,
 				   bool clear, const char *sql);
+extern void pgfdw_copy_start(ConnCacheEntry *entry);
+extern void pgfdw_copy_data(ConnCacheEntry *entry, const char *data, int len);
+extern void pgfdw_copy_end_all(void);
 
 /* in option.c */
 extern int ExtractConnectionOptions(List *defelems,
@@ -142,6 +194,7 @@ extern int ExtractConnectionOptions(List *defelems,
 						 const char **values);
 extern List *ExtractExtensionList(const char *extensionsString,
 					 bool warnOnMissing);
+extern List *ExtractStandbyHosts(const char *hostsString);
 
 /* in deparse.c */
 extern void classifyConditions(PlannerInfo *root,
@@ -156,6 +209,8 @@ extern void deparseInsertSql(StringInfo buf, RangeTblEntry *rte,
 				 Index rtindex, Relation rel,
 				 List *targetAttrs, bool doNothing, List *returningList,
 				 List **retrieved_attrs);
+extern void rebuildInsertSql(StringInfo buf, const char *orig_query,
+				 int num_params, int num_rows);
 extern void deparseUpdateSql(StringInfo buf, RangeTblEntry *rte,
 				 Index rtindex, Relation rel,
 				 List *targetAttrs, List *returningList,
@@ -194,11 +249,19 @@ extern const char *get_jointype_name(JoinType jointype);
 extern void deparseCopyFromSql(StringInfo buf, Relation rel, CopyState cstate,
 							   const char *dest_relname);
 
+/* in stats.c */
+extern void pgfdw_stats_init(void);
+extern void pgfdw_stats_flush(Oid serverid, PgFdwStatsCounters *counters);
+
 /* in shippable.c */
 extern bool is_builtin(Oid objectId);
 extern bool is_shippable(Oid objectId, Oid classId, PgFdwRelationInfo *fpinfo);
 
 extern bool UseRepeatableRead;
 extern bool UseGlobalSnapshots;
+extern double Trace2PCSampleRate;
+extern int	IdleConnectionTimeout;
+extern bool UseStandbyReads;
+extern int	StandbyWaitTimeout;
 
 #endif							/* POSTGRES_FDW_H */
@@ -0,0 +1,282 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.c
+ *		  Cumulative statistics of communication with foreign servers
+ *
+ * Each backend counts round trips, waiting, fetched data and 2PC phase
+ * latencies per connection (see ConnCacheEntry) and adds them to the shared
+ * per-server counters at transaction end, so the hot paths never touch
+ * shared memory.  The counters live only if the library is loaded via
+ * shared_preload_libraries.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "postgres_fdw.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+/* Max number of servers we keep counters for; the rest is not accounted */
+#define PGFDW_STATS_MAX_SERVERS 1024
+
+/* Number of output columns of fdw_server_stats() */
+#define PGFDW_STATS_COLS (6 + 2 * PGFDW_NUM_PHASES)
+
+/* Shared hash table entry */
+typedef struct PgFdwStatsEntry
+{
+	Oid			serverid;		/* hash key (must be first) */
+	slock_t		mutex;			/* protects the counters */
+	PgFdwStatsCounters counters;
+} PgFdwStatsEntry;
+
+/* Global shared state */
+typedef struct PgFdwStatsShared
+{
+	LWLock	   *lock;			/* protects hashtable search/modification */
+} PgFdwStatsShared;
+
+PG_FUNCTION_INFO_V1(fdw_server_stats);
+PG_FUNCTION_INFO_V1(fdw_stats_reset);
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static PgFdwStatsShared *pgfdw_stats = NULL;
+static HTAB *pgfdw_stats_hash = NULL;
+
+static void pgfdw_stats_shmem_startup(void);
+
+/*
+ * Reserve shared memory for the counters; called from _PG_init.
+ */
+void
+pgfdw_stats_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(PgFdwStatsShared)) +
+						   hash_estimate_size(PGFDW_STATS_MAX_SERVERS,
+											  sizeof(PgFdwStatsEntry)));
+	RequestNamedLWLockTranche("shardman fdw stats", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pgfdw_stats_shmem_startup;
+}
+
+static void
+pgfdw_stats_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pgfdw_stats = ShmemInitStruct("shardman fdw stats",
+								  sizeof(PgFdwStatsShared),
+								  &found);
+	if (!found)
+		pgfdw_stats->lock = &(GetNamedLWLockTranche("shardman fdw stats"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(PgFdwStatsEntry);
+	pgfdw_stats_hash = ShmemInitHash("shardman fdw stats hash",
+									 PGFDW_STATS_MAX_SERVERS,
+									 PGFDW_STATS_MAX_SERVERS,
+									 &info,
+									 HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Add backend-local counters of the server to the shared ones and zero them.
+ */
+void
+pgfdw_stats_flush(Oid serverid, PgFdwStatsCounters *counters)
+{
+	PgFdwStatsEntry *entry;
+	int			i;
+
+	/* Nothing could have happened without talking to the server */
+	if (counters->round_trips == 0)
+		return;
+
+	if (pgfdw_stats == NULL)
+	{
+		memset(counters, 0, sizeof(PgFdwStatsCounters));
+		return;
+	}
+
+	LWLockAcquire(pgfdw_stats->lock, LW_SHARED);
+
+	entry = (PgFdwStatsEntry *) hash_search(pgfdw_stats_hash, &serverid,
+											HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		bool		found;
+
+		/* Need exclusive lock to make a new entry */
+		LWLockRelease(pgfdw_stats->lock);
+		LWLockAcquire(pgfdw_stats->lock, LW_EXCLUSIVE);
+
+		entry = (PgFdwStatsEntry *) hash_search(pgfdw_stats_hash, &serverid,
+												HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			/* Out of entries; just forget about it */
+			LWLockRelease(pgfdw_stats->lock);
+			memset(counters, 0, sizeof(PgFdwStatsCounters));
+			return;
+		}
+		if (!found)
+		{
+			SpinLockInit(&entry->mutex);
+			memset(&entry->counters, 0, sizeof(PgFdwStatsCounters));
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->counters.round_trips += counters->round_trips;
+	entry->counters.wait_time += counters->wait_time;
+	entry->counters.rows_fetched += counters->rows_fetched;
+	entry->counters.bytes_fetched += counters->bytes_fetched;
+	entry->counters.copy_bytes += counters->copy_bytes;
+	for (i = 0; i < PGFDW_NUM_PHASES; i++)
+	{
+		entry->counters.phase_count[i] += counters->phase_count[i];
+		entry->counters.phase_time[i] += counters->phase_time[i];
+	}
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(pgfdw_stats->lock);
+
+	memset(counters, 0, sizeof(PgFdwStatsCounters));
+}
+
+static void
+check_stats_available(void)
+{
+	if (pgfdw_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("fdw statistics must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * Return counters of all servers, one row per server.
+ */
+Datum
+fdw_server_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	PgFdwStatsEntry *entry;
+
+	check_stats_available();
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts != PGFDW_STATS_COLS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgfdw_stats->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgfdw_stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PGFDW_STATS_COLS];
+		bool		nulls[PGFDW_STATS_COLS];
+		PgFdwStatsCounters tmp;
+		int			i = 0;
+		int			phase;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		values[i++] = ObjectIdGetDatum(entry->serverid);
+		values[i++] = Int64GetDatumFast(tmp.round_trips);
+		values[i++] = Float8GetDatumFast(tmp.wait_time);
+		values[i++] = Int64GetDatumFast(tmp.rows_fetched);
+		values[i++] = Int64GetDatumFast(tmp.bytes_fetched);
+		values[i++] = Int64GetDatumFast(tmp.copy_bytes);
+		for (phase = 0; phase < PGFDW_NUM_PHASES; phase++)
+		{
+			values[i++] = Int64GetDatumFast(tmp.phase_count[phase]);
+			values[i++] = Float8GetDatumFast(tmp.phase_time[phase]);
+		}
+		Assert(i == PGFDW_STATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgfdw_stats->lock);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * Zero counters of all servers.
+ */
+Datum
+fdw_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	PgFdwStatsEntry *entry;
+
+	check_stats_available();
+
+	LWLockAcquire(pgfdw_stats->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgfdw_stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		memset(&entry->counters, 0, sizeof(PgFdwStatsCounters));
+
+	LWLockRelease(pgfdw_stats->lock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,100 @@
+use strict;
+use warnings;
+
+use PostgresNode;
+use TestLib;
+use Test::More tests => 3;
+
+# Node which only locks rows with SELECT FOR UPDATE/SHARE must be prepared
+# along with the writers instead of being committed early as a reader.
+
+my $master = get_new_node("master");
+$master->init;
+$master->append_conf('postgresql.conf', qq(
+	shared_preload_libraries = 'shardman'
+	max_prepared_transactions = 30
+	postgres_fdw.use_global_snapshots = on
+	track_global_snapshots = on
+	default_transaction_isolation = 'REPEATABLE READ'
+));
+$master->start;
+
+my @shards;
+foreach my $name ("shard1", "shard2")
+{
+	my $node = get_new_node($name);
+	$node->init;
+	$node->append_conf('postgresql.conf', qq(
+		max_prepared_transactions = 30
+		global_snapshot_defer_time = 15
+		track_global_snapshots = on
+	));
+	$node->start;
+	push @shards, $node;
+}
+my ($shard1, $shard2) = @shards;
+
+$master->safe_psql('postgres', "CREATE EXTENSION shardman");
+
+foreach my $node (@shards)
+{
+	my $port = $node->port;
+	my $host = $node->host;
+
+	$node->safe_psql('postgres', qq[
+		CREATE TABLE accounts(id integer primary key, amount integer);
+		INSERT INTO accounts SELECT id, 0 FROM generate_series(1, 10) id;
+	]);
+
+	$master->safe_psql('postgres', qq[
+		CREATE SERVER shard_$port FOREIGN DATA WRAPPER shardman_postgres_fdw
+				options(dbname 'postgres', host '$host', port '$port');
+		CREATE FOREIGN TABLE accounts_$port(id integer, amount integer)
+				server shard_$port options(table_name 'accounts');
+		CREATE USER MAPPING for CURRENT_USER SERVER shard_$port;
+	]);
+}
+
+my ($port1, $port2) = ($shard1->port, $shard2->port);
+
+sub prepares
+{
+	my ($port) = @_;
+	return $master->safe_psql('postgres', qq[
+		SELECT prepares FROM shardman.fdw_server_stats() s
+			JOIN pg_foreign_server fs ON fs.oid = s.srvid
+			WHERE fs.srvname = 'shard_$port'
+	]) || 0;
+}
+
+# plain read is committed early, without PREPARE
+my $before = prepares($port1);
+$master->safe_psql('postgres', qq[
+	BEGIN;
+	SELECT * FROM accounts_$port1 WHERE id = 1;
+	UPDATE accounts_$port2 SET amount = amount + 1 WHERE id = 1;
+	COMMIT;
+]);
+is(prepares($port1), $before, 'reader is not prepared');
+
+$before = prepares($port1);
+$master->safe_psql('postgres', qq[
+	BEGIN;
+	SELECT * FROM accounts_$port1 WHERE id = 1 FOR UPDATE;
+	UPDATE accounts_$port2 SET amount = amount + 1 WHERE id = 1;
+	COMMIT;
+]);
+is(prepares($port1), $before + 1, 'FOR UPDATE node is prepared');
+
+$before = prepares($port1);
+$master->safe_psql('postgres', qq[
+	BEGIN;
+	SELECT * FROM accounts_$port1 WHERE id = 1 FOR SHARE;
+	UPDATE accounts_$port2 SET amount = amount + 1 WHERE id = 1;
+	COMMIT;
+]);
+is(prepares($port1), $before + 1, 'FOR SHARE node is prepared');
+
+$master->stop;
+$shard1->stop;
+$shard2->stop;
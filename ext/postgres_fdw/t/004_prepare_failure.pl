@@ -0,0 +1,105 @@
+use strict;
+use warnings;
+
+use PostgresNode;
+use TestLib;
+use Test::More tests => 6;
+
+# PREPARE of writers and COMMIT of readers are sent in one round trip; if any
+# of them fails, transactions already prepared must be aborted right away.
+
+my $master = get_new_node("master");
+$master->init;
+$master->append_conf('postgresql.conf', qq(
+	shared_preload_libraries = 'shardman'
+	max_prepared_transactions = 30
+	postgres_fdw.use_global_snapshots = on
+	track_global_snapshots = on
+	default_transaction_isolation = 'REPEATABLE READ'
+));
+$master->start;
+
+my @shards;
+foreach my $name ("shard1", "shard2", "shard3")
+{
+	my $node = get_new_node($name);
+	$node->init;
+	$node->append_conf('postgresql.conf', qq(
+		max_prepared_transactions = 30
+		global_snapshot_defer_time = 15
+		track_global_snapshots = on
+	));
+	$node->start;
+	push @shards, $node;
+}
+my ($shard1, $shard2, $shard3) = @shards;
+
+$master->safe_psql('postgres', "CREATE EXTENSION shardman");
+
+# Writing into dups violates deferred constraint at PREPARE or COMMIT time;
+# reading dup_view writes into it behind the coordinator's back.
+foreach my $node (@shards)
+{
+	my $port = $node->port;
+	my $host = $node->host;
+
+	$node->safe_psql('postgres', qq[
+		CREATE TABLE accounts(id integer primary key, amount integer);
+		INSERT INTO accounts SELECT id, 0 FROM generate_series(1, 10) id;
+		CREATE TABLE dups(id integer UNIQUE DEFERRABLE INITIALLY DEFERRED);
+		CREATE FUNCTION make_dups() RETURNS integer AS
+			'INSERT INTO dups VALUES (1), (1); SELECT 1' LANGUAGE sql VOLATILE;
+		CREATE VIEW dup_view AS SELECT make_dups() AS x;
+	]);
+
+	$master->safe_psql('postgres', qq[
+		CREATE SERVER shard_$port FOREIGN DATA WRAPPER shardman_postgres_fdw
+				options(dbname 'postgres', host '$host', port '$port');
+		CREATE FOREIGN TABLE accounts_$port(id integer, amount integer)
+				server shard_$port options(table_name 'accounts');
+		CREATE FOREIGN TABLE dups_$port(id integer)
+				server shard_$port options(table_name 'dups');
+		CREATE FOREIGN TABLE dup_view_$port(x integer)
+				server shard_$port options(table_name 'dup_view');
+		CREATE USER MAPPING for CURRENT_USER SERVER shard_$port;
+	]);
+}
+
+my ($port1, $port2, $port3) = map { $_->port } @shards;
+
+sub check_clean
+{
+	my ($name) = @_;
+	foreach my $node ($shard1, $shard2)
+	{
+		is($node->safe_psql('postgres', qq[
+			SELECT (SELECT count(*) FROM pg_prepared_xacts) ||
+				':' || (SELECT sum(amount) FROM accounts)]),
+		   '0:0', "$name: no prepared xacts and no changes on " . $node->name);
+	}
+}
+
+# PREPARE fails on one of the writers
+my $ret = $master->psql('postgres', qq[
+	BEGIN;
+	UPDATE accounts_$port1 SET amount = amount + 1 WHERE id = 1;
+	UPDATE accounts_$port2 SET amount = amount + 1 WHERE id = 1;
+	INSERT INTO dups_$port2 VALUES (1), (1);
+	COMMIT;
+]);
+isnt($ret, 0, 'commit fails if PREPARE fails');
+check_clean('failed PREPARE');
+
+# COMMIT of the reader fails
+$ret = $master->psql('postgres', qq[
+	BEGIN;
+	UPDATE accounts_$port1 SET amount = amount + 1 WHERE id = 1;
+	UPDATE accounts_$port2 SET amount = amount + 1 WHERE id = 1;
+	SELECT * FROM dup_view_$port3;
+	COMMIT;
+]);
+isnt($ret, 0, 'commit fails if reader COMMIT fails');
+check_clean('failed reader COMMIT');
+
+$master->stop;
+$_->stop foreach @shards;
@@ -0,0 +1,69 @@
+use strict;
+use warnings;
+
+use PostgresNode;
+use TestLib;
+use Test::More tests => 5;
+
+# INSERT into foreign table with batch_size sends rows in multi-row INSERTs
+# without waiting for them; all of them must be done, and errors reported,
+# by the end of the statement.
+
+my $master = get_new_node("master");
+$master->init;
+$master->append_conf('postgresql.conf', qq(
+	shared_preload_libraries = 'shardman'
+));
+$master->start;
+
+my $shard = get_new_node("shard");
+$shard->init;
+$shard->start;
+
+my $port = $shard->port;
+my $host = $shard->host;
+
+$shard->safe_psql('postgres',
+	"CREATE TABLE accounts(id integer primary key, amount integer)");
+
+$master->safe_psql('postgres', qq[
+	CREATE EXTENSION shardman;
+	CREATE SERVER shard FOREIGN DATA WRAPPER shardman_postgres_fdw
+			options(dbname 'postgres', host '$host', port '$port');
+	CREATE USER MAPPING for CURRENT_USER SERVER shard;
+	CREATE FOREIGN TABLE accounts(id integer, amount integer)
+			server shard options(table_name 'accounts', batch_size '100');
+
+	CREATE TABLE seen(n bigint);
+	CREATE FUNCTION count_accounts() RETURNS trigger AS \$\$
+	BEGIN
+		INSERT INTO seen SELECT count(*) FROM accounts;
+		RETURN NULL;
+	END \$\$ LANGUAGE plpgsql;
+	CREATE TRIGGER count_accounts AFTER INSERT ON accounts
+		FOR EACH STATEMENT EXECUTE PROCEDURE count_accounts();
+]);
+
+# full batches and the incomplete last one
+$master->safe_psql('postgres',
+	"INSERT INTO accounts SELECT id, 0 FROM generate_series(1, 1050) id");
+is($shard->safe_psql('postgres', "SELECT count(*) FROM accounts"), '1050',
+   'all rows inserted');
+is($master->safe_psql('postgres', "SELECT n FROM seen"), '1050',
+   'AFTER STATEMENT trigger sees all rows');
+
+# remote error in the last batch fails the statement itself, not COMMIT
+my ($ret, $stdout, $stderr) = $master->psql('postgres', qq[
+	BEGIN;
+	INSERT INTO accounts SELECT id, 0 FROM generate_series(2000, 2010) id;
+	INSERT INTO accounts VALUES (1, 0);
+	SELECT 'after insert';
+	COMMIT;
+]);
+isnt($ret, 0, 'duplicate key is reported');
+unlike($stdout, qr/after insert/, 'error is reported by the INSERT');
+is($shard->safe_psql('postgres', "SELECT count(*) FROM accounts"), '1050',
+   'failed transaction inserted nothing');
+
+$master->stop;
+$shard->stop;
@@ -0,0 +1,118 @@
+use strict;
+use warnings;
+
+use PostgresNode;
+use TestLib;
+use Test::More tests => 14;
+
+# Queries on sharded table through one of the repgroups: scans of foreign
+# partitions, aggregate pushdown, direct routing and COPY.
+
+my @rgs;
+foreach my $rgid (1, 2)
+{
+	my $node = get_new_node("rg$rgid");
+	$node->init;
+	$node->append_conf('postgresql.conf', qq(
+		shared_preload_libraries = 'shardman'
+		shardman.rgid = $rgid
+		max_prepared_transactions = 30
+	));
+	$node->start;
+	push @rgs, $node;
+}
+my ($rg1, $rg2) = @rgs;
+
+# what shardmanctl addrepgroup would do
+foreach my $i (0 .. $#rgs)
+{
+	my $node = $rgs[$i];
+	my $script = qq[
+		SET shardman.broadcast_utility = off;
+		CREATE EXTENSION shardman;
+		INSERT INTO shardman.repgroups VALUES (@{[$i + 1]}, NULL);
+	];
+	foreach my $j (0 .. $#rgs)
+	{
+		next if ($j == $i);
+		my $rgid = $j + 1;
+		my $host = $rgs[$j]->host;
+		my $port = $rgs[$j]->port;
+		$script .= qq[
+			CREATE SERVER hp_rg_$rgid FOREIGN DATA WRAPPER shardman_postgres_fdw
+					options(dbname 'postgres', host '$host', port '$port');
+			CREATE USER MAPPING for CURRENT_USER SERVER hp_rg_$rgid;
+			INSERT INTO shardman.repgroups
+				SELECT $rgid, oid FROM pg_foreign_server WHERE srvname = 'hp_rg_$rgid';
+		];
+	}
+	$node->safe_psql('postgres', $script);
+}
+
+$rg1->safe_psql('postgres', qq[
+	CREATE TABLE accounts(id integer primary key, amount integer, f float8)
+		PARTITION BY HASH (id);
+	SELECT shardman.hash_shard_table('accounts', 4);
+	INSERT INTO accounts SELECT id, id % 100, id * 0.5 FROM generate_series(1, 1000) id;
+]);
+
+# rows in partitions stored on the node itself
+sub local_rows
+{
+	my ($node, $cond) = @_;
+	return $node->safe_psql('postgres', qq[
+		SELECT count(*) FROM accounts a JOIN pg_class c ON c.oid = a.tableoid
+			WHERE c.relkind = 'r' AND $cond]);
+}
+
+# scans of foreign partitions
+is($rg1->safe_psql('postgres', "SELECT count(*), sum(amount) FROM accounts"),
+   '1000|49500', 'all partitions are scanned');
+is($rg2->safe_psql('postgres', "SELECT count(*) FROM accounts a, accounts b WHERE a.id = b.id"),
+   '1000', 'join of partitioned scans');
+is($rg1->safe_psql('postgres', "SELECT count(*) FROM (SELECT * FROM accounts LIMIT 10) s"),
+   '10', 'scan stopped early');
+
+# aggregate pushdown
+my $agg = qq[SELECT amount % 7 AS g, count(*), sum(amount), avg(amount), avg(f), max(id)
+	FROM accounts GROUP BY g ORDER BY g];
+my $agg_on = $rg1->safe_psql('postgres', $agg);
+my $agg_off = $rg1->safe_psql('postgres',
+	"SET shardman.aggregate_pushdown = off; $agg");
+is($agg_on, $agg_off, 'pushed down aggregates give the same results');
+like($rg1->safe_psql('postgres', "EXPLAIN (COSTS OFF) $agg"),
+	 qr/Aggregate on/, 'aggregates are pushed down');
+unlike($rg1->safe_psql('postgres',
+		"SET shardman.aggregate_pushdown = off; EXPLAIN (COSTS OFF) $agg"),
+	   qr/Aggregate on/, 'aggregate pushdown can be turned off');
+
+# direct routing
+unlike($rg1->safe_psql('postgres', "EXPLAIN (COSTS OFF) SELECT * FROM accounts WHERE id = 42"),
+	   qr/Append/, 'point query is routed to the partition');
+like($rg1->safe_psql('postgres',
+		"SET shardman.direct_routing = off; EXPLAIN (COSTS OFF) SELECT * FROM accounts WHERE id = 42"),
+	 qr/Append/, 'direct routing can be turned off');
+is($rg1->safe_psql('postgres', "SELECT id, amount FROM accounts WHERE id = 42"),
+   '42|42', 'routed SELECT');
+$rg2->safe_psql('postgres', qq[
+	UPDATE accounts SET amount = -1 WHERE id = 42;
+	DELETE FROM accounts WHERE id = 43;
+]);
+is($rg1->safe_psql('postgres', "SELECT id, amount FROM accounts WHERE id IN (42, 43)"),
+   '42|-1', 'routed UPDATE and DELETE');
+
+# COPY routes rows to partitions on both repgroups
+my $copy = "COPY accounts FROM STDIN;\n" .
+	join('', map { "$_\t0\t0\n" } (2001 .. 2100)) . "\\.\n";
+$rg1->safe_psql('postgres', $copy);
+is($rg1->safe_psql('postgres', "SELECT count(*) FROM accounts WHERE id > 2000"),
+   '100', 'COPY inserts all rows');
+cmp_ok(local_rows($rg2, 'id > 2000'), '>', 0, 'COPY reaches foreign partitions');
+
+# failure on remote partition fails the whole COPY
+my $ret = $rg1->psql('postgres', $copy);
+isnt($ret, 0, 'COPY of duplicates fails');
+is($rg1->safe_psql('postgres', "SELECT count(*) FROM accounts"), '1099',
+   'failed COPY inserts nothing');
+
+$_->stop foreach @rgs;
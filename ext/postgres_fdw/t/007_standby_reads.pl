@@ -0,0 +1,90 @@
+use strict;
+use warnings;
+
+use PostgresNode;
+use TestLib;
+use Test::More tests => 6;
+
+# With postgres_fdw.standby_reads, scans of read-only transactions go to the
+# standby listed in standby_hosts, once it has replayed what the master had
+# written; anything else, and any standby failure, is served by the master.
+
+my $shard = get_new_node("shard");
+$shard->init(allows_streaming => 1);
+$shard->append_conf('postgresql.conf', qq(
+	max_prepared_transactions = 30
+	track_global_snapshots = on
+));
+$shard->start;
+$shard->safe_psql('postgres', qq[
+	CREATE EXTENSION shardman;
+	CREATE TABLE accounts(id integer primary key, amount integer);
+	CREATE VIEW recovery AS SELECT pg_is_in_recovery() AS r;
+]);
+$shard->backup('backup');
+
+my $standby = get_new_node("standby");
+$standby->init_from_backup($shard, 'backup', has_streaming => 1);
+$standby->start;
+
+my $master = get_new_node("master");
+$master->init;
+$master->append_conf('postgresql.conf', qq(
+	shared_preload_libraries = 'shardman'
+	max_prepared_transactions = 30
+	track_global_snapshots = on
+	postgres_fdw.standby_reads = on
+	postgres_fdw.standby_wait_timeout = 5000
+));
+$master->start;
+
+my $host = $shard->host;
+my $port = $shard->port;
+my $standby_hosts = $standby->host . ":" . $standby->port;
+$master->safe_psql('postgres', qq[
+	CREATE EXTENSION shardman;
+	CREATE SERVER shard FOREIGN DATA WRAPPER shardman_postgres_fdw
+			options(dbname 'postgres', host '$host', port '$port',
+					standby_hosts '$standby_hosts');
+	CREATE USER MAPPING for CURRENT_USER SERVER shard;
+	CREATE FOREIGN TABLE accounts(id integer, amount integer)
+			server shard options(table_name 'accounts');
+	CREATE FOREIGN TABLE recovery(r boolean)
+			server shard options(table_name 'recovery');
+]);
+
+is($master->safe_psql('postgres', "SELECT r FROM recovery"), 'f',
+   'read-write transaction reads from master');
+is($master->safe_psql('postgres', qq[
+	BEGIN READ ONLY;
+	SELECT r FROM recovery;
+	COMMIT;
+]), 't', 'read-only transaction reads from standby');
+is($master->safe_psql('postgres', qq[
+	SET postgres_fdw.use_global_snapshots = on;
+	BEGIN READ ONLY;
+	SELECT r FROM recovery;
+	COMMIT;
+]), 'f', 'global snapshots are taken on master only');
+
+# standby waits for what was just written
+is($master->safe_psql('postgres', qq[
+	INSERT INTO accounts SELECT id, 0 FROM generate_series(1, 100) id;
+	BEGIN READ ONLY;
+	SELECT count(*) FROM accounts;
+	SELECT r FROM recovery;
+	COMMIT;
+]), "100\nt", 'standby sees preceding writes');
+
+# broken standby is skipped without errors
+$standby->stop;
+my ($ret, $stdout, $stderr) = $master->psql('postgres', qq[
+	BEGIN READ ONLY;
+	SELECT count(*), bool_or(r) FROM accounts, recovery;
+	COMMIT;
+]);
+is($ret, 0, 'no errors without standby');
+is($stdout, '100|f', 'master is read without standby');
+
+$master->stop;
+$shard->stop;
@@ -0,0 +1,311 @@
+/* -------------------------------------------------------------------------
+ *
+ * router.c
+ *   Direct routing of single-partition queries to the partition.
+ *
+ * Point query on sharded table, like SELECT/UPDATE/DELETE ... WHERE id = $1,
+ * is planned by Postgres as usual partitioned table query: all partitions
+ * are opened, locked and expanded, only to prune everything but one
+ * later. With many partitions this costs much more than planning the query
+ * itself. When partition key is compared to a constant, we already know the
+ * partition, so we hash the key the same way tuple routing does and put
+ * the partition in place of the table before planning. The planner then
+ * deals with single (typically foreign) relation.
+ *
+ * The table itself stays in range table, not referenced by the query, so
+ * that permissions are still checked against it and the plan is invalidated
+ * when its partitions change.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/stratnum.h"
+#include "catalog/pg_class.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/params.h"
+#include "parser/parsetree.h"
+#include "partitioning/partbounds.h"
+#include "storage/lmgr.h"
+#include "utils/lsyscache.h"
+#include "utils/partcache.h"
+#include "utils/rel.h"
+
+#include "shardman.h"
+#include "meta.h"
+
+static bool FindPartKeyValue(Node *quals, PartitionKey key,
+							 ParamListInfo boundParams, Datum *value);
+static bool PartKeyAssigned(List *targetList, AttrNumber partattr);
+static Oid	HashPartitionForValue(Relation parent, PartitionKey key,
+								  Datum value);
+static bool SameAttributes(TupleDesc parentdesc, TupleDesc childdesc);
+
+/*
+ * If parse is a plain SELECT, UPDATE or DELETE of single sharded table
+ * restricted by its partition key being equal to a constant, substitute the
+ * partition holding the key for the table. Returns true if done.
+ *
+ * When in doubt, we just don't route: the query is planned as usual then.
+ */
+bool
+RouteToPartition(Query *parse, ParamListInfo boundParams)
+{
+	RangeTblEntry *rte;
+	RangeTblEntry *childrte;
+	Relation	parent;
+	Relation	child;
+	PartitionKey key;
+	Datum		value;
+	Oid			childoid;
+	LOCKMODE	lockmode;
+	bool		same_attrs;
+
+	if (parse->commandType != CMD_SELECT &&
+		parse->commandType != CMD_UPDATE &&
+		parse->commandType != CMD_DELETE)
+		return false;
+	if (parse->utilityStmt != NULL || parse->cteList != NIL ||
+		parse->hasSubLinks || parse->hasRowSecurity ||
+		parse->setOperations != NULL ||
+		list_length(parse->rtable) != 1 ||
+		list_length(parse->jointree->fromlist) != 1 ||
+		!IsA(linitial(parse->jointree->fromlist), RangeTblRef))
+		return false;
+
+	rte = rt_fetch(1, parse->rtable);
+	if (rte->rtekind != RTE_RELATION || !rte->inh ||
+		rte->relkind != RELKIND_PARTITIONED_TABLE ||
+		rte->securityQuals != NIL || rte->tablesample != NULL ||
+		!RelIsSharded(rte->relid))
+		return false;
+
+	/* already locked by parser or AcquireRewriteLocks */
+	parent = heap_open(rte->relid, NoLock);
+	key = RelationGetPartitionKey(parent);
+	if (key->strategy != PARTITION_STRATEGY_HASH || key->partnatts != 1 ||
+		key->partattrs[0] == 0)
+		goto no_route;
+	/* statement triggers of the table would be skipped */
+	if (parse->commandType != CMD_SELECT && parent->trigdesc != NULL)
+		goto no_route;
+	/* moving the row to another partition requires the table */
+	if (parse->commandType == CMD_UPDATE &&
+		PartKeyAssigned(parse->targetList, key->partattrs[0]))
+		goto no_route;
+	if (!FindPartKeyValue(parse->jointree->quals, key, boundParams, &value))
+		goto no_route;
+
+	childoid = HashPartitionForValue(parent, key, value);
+	if (!OidIsValid(childoid))
+		goto no_route;
+
+	/* lock partition as expand_inherited_rtentry would */
+	if (parse->resultRelation == 1)
+		lockmode = RowExclusiveLock;
+	else if (get_parse_rowmark(parse, 1) != NULL)
+		lockmode = RowShareLock;
+	else
+		lockmode = AccessShareLock;
+	LockRelationOid(childoid, lockmode);
+
+	/*
+	 * Vars of the query are left as they are, so attribute numbers must be
+	 * the same. This is normally the case for partitions created by
+	 * hash_shard_table, unless the table has dropped columns.
+	 */
+	child = heap_open(childoid, NoLock);
+	same_attrs = SameAttributes(RelationGetDescr(parent),
+								RelationGetDescr(child)) &&
+		(child->rd_rel->relkind == RELKIND_RELATION ||
+		 child->rd_rel->relkind == RELKIND_FOREIGN_TABLE);
+	if (!same_attrs)
+	{
+		heap_close(child, NoLock);
+		goto no_route;
+	}
+
+	childrte = copyObject(rte);
+	childrte->relid = childoid;
+	childrte->relkind = child->rd_rel->relkind;
+	childrte->inh = false;
+	childrte->requiredPerms = 0;
+	heap_close(child, NoLock);
+
+	hp_log3("routing query on %s directly to partition %s",
+			RelationGetRelationName(parent), get_rel_name(childoid));
+	heap_close(parent, NoLock);
+
+	/* table goes to the end, not referenced, and mustn't be expanded */
+	rte->inh = false;
+	parse->rtable = list_make2(childrte, rte);
+	return true;
+
+no_route:
+	heap_close(parent, NoLock);
+	return false;
+}
+
+/*
+ * Look for partkey = const among top-level AND-ed quals. Params are taken
+ * only if they are bound and marked const, as eval_const_expressions does,
+ * i.e. when we are building a custom plan.
+ */
+static bool
+FindPartKeyValue(Node *quals, PartitionKey key, ParamListInfo boundParams,
+				 Datum *value)
+{
+	OpExpr	   *op;
+	Node	   *leftop;
+	Node	   *rightop;
+	Var		   *var;
+
+	if (quals == NULL)
+		return false;
+
+	if (IsA(quals, List) ||
+		(IsA(quals, BoolExpr) && ((BoolExpr *) quals)->boolop == AND_EXPR))
+	{
+		List	   *args = IsA(quals, List) ? (List *) quals :
+		((BoolExpr *) quals)->args;
+		ListCell   *lc;
+
+		foreach(lc, args)
+		{
+			if (FindPartKeyValue(lfirst(lc), key, boundParams, value))
+				return true;
+		}
+		return false;
+	}
+
+	if (!IsA(quals, OpExpr))
+		return false;
+	op = (OpExpr *) quals;
+	if (list_length(op->args) != 2)
+		return false;
+	leftop = linitial(op->args);
+	rightop = lsecond(op->args);
+	if (!IsA(leftop, Var))
+	{
+		Node	   *tmp = leftop;
+
+		leftop = rightop;
+		rightop = tmp;
+	}
+	if (!IsA(leftop, Var))
+		return false;
+	var = (Var *) leftop;
+	if (var->varno != 1 || var->varlevelsup != 0 ||
+		var->varattno != key->partattrs[0])
+		return false;
+
+	/* must be the equality of partitioning opfamily on the key type */
+	if (get_op_opfamily_strategy(op->opno, key->partopfamily[0]) !=
+		HTEqualStrategyNumber)
+		return false;
+	if (exprType(rightop) != key->parttypid[0])
+		return false;
+
+	if (IsA(rightop, Const))
+	{
+		Const	   *c = (Const *) rightop;
+
+		if (c->constisnull)
+			return false;
+		*value = c->constvalue;
+		return true;
+	}
+
+	if (IsA(rightop, Param) && boundParams != NULL)
+	{
+		Param	   *param = (Param *) rightop;
+		ParamExternData *prm;
+		ParamExternData prmdata;
+
+		if (param->paramkind != PARAM_EXTERN ||
+			param->paramid <= 0 || param->paramid > boundParams->numParams)
+			return false;
+		if (boundParams->paramFetch != NULL)
+			prm = boundParams->paramFetch(boundParams, param->paramid,
+										  false, &prmdata);
+		else
+			prm = &boundParams->params[param->paramid - 1];
+		if (!OidIsValid(prm->ptype) || prm->ptype != param->paramtype ||
+			!(prm->pflags & PARAM_FLAG_CONST) || prm->isnull)
+			return false;
+		*value = prm->value;
+		return true;
+	}
+
+	return false;
+}
+
+/* Does UPDATE target list assign the partition key? */
+static bool
+PartKeyAssigned(List *targetList, AttrNumber partattr)
+{
+	ListCell   *lc;
+
+	foreach(lc, targetList)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (!tle->resjunk && tle->resno == partattr)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Partition of hash partitioned parent where tuple with given key value
+ * goes, see get_partition_for_tuple. InvalidOid if there is none.
+ */
+static Oid
+HashPartitionForValue(Relation parent, PartitionKey key, Datum value)
+{
+	PartitionDesc partdesc = RelationGetPartitionDesc(parent);
+	PartitionBoundInfo boundinfo = partdesc->boundinfo;
+	bool		isnull = false;
+	uint64		hash;
+	int			greatest_modulus;
+	int			part_index;
+
+	if (partdesc->nparts == 0)
+		return InvalidOid;
+
+	greatest_modulus = get_hash_partition_greatest_modulus(boundinfo);
+	hash = compute_hash_value(key->partnatts, key->partsupfunc, &value,
+							  &isnull);
+	part_index = boundinfo->indexes[hash % greatest_modulus];
+	if (part_index < 0)
+		return InvalidOid;
+	return partdesc->oids[part_index];
+}
+
+static bool
+SameAttributes(TupleDesc parentdesc, TupleDesc childdesc)
+{
+	int			i;
+
+	if (parentdesc->natts != childdesc->natts)
+		return false;
+	for (i = 0; i < parentdesc->natts; i++)
+	{
+		Form_pg_attribute pattr = TupleDescAttr(parentdesc, i);
+		Form_pg_attribute cattr = TupleDescAttr(childdesc, i);
+
+		if (pattr->attisdropped != cattr->attisdropped)
+			return false;
+		if (!pattr->attisdropped &&
+			(pattr->atttypid != cattr->atttypid ||
+			 pattr->atttypmod != cattr->atttypmod ||
+			 pattr->attcollation != cattr->attcollation))
+			return false;
+	}
+	return true;
+}
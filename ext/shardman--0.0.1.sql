@@ -35,6 +35,15 @@ create table parts (
 	primary key (rel, pnum)
 );
 
+-- backends cache repgroups and sharded_tables, tell them about changes
+create function meta_cache_inval() returns trigger as 'MODULE_PATHNAME' language C;
+create trigger repgroups_meta_cache_inval
+  after insert or update or delete or truncate on shardman.repgroups
+  for each statement execute function meta_cache_inval();
+create trigger sharded_tables_meta_cache_inval
+  after insert or update or delete or truncate on shardman.sharded_tables
+  for each statement execute function meta_cache_inval();
+
 -- fill relname and nspname on insertion to sharded_tables automatically
 create function sharded_tables_fill_relname() returns trigger as $$
 begin
@@ -64,6 +73,8 @@ declare
   fdw_part_name name;
   nparts int;
   me int := id from shardman.repgroups where srvid is null;
+  -- all the ddl, executed at once
+  script text := '';
 begin
   set local shardman.broadcast_utility to off;
   for relid, nparts in select st.rel, st.nparts from shardman.sharded_tables st loop
@@ -72,16 +83,21 @@ begin
       assert holder_rgid != me, 'new rg holds partitions';
       part_name := format('%s_%s', relname, pnum);
       fdw_part_name := format('%s_fdw', part_name);
-      execute format('drop table if exists %I', part_name);
-      execute format('drop foreign table if exists %I', fdw_part_name);
-      execute format('create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L)',
+      script := script || format(E'drop table if exists %I;\n', part_name);
+      script := script || format(E'drop foreign table if exists %I;\n', fdw_part_name);
+      script := script || format(E'create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L);\n',
 	                                   fdw_part_name, relname, nparts, pnum, holder_rgid, quote_ident(part_name));
     end loop;
   end loop;
+  if script != '' then
+    execute script;
+  end if;
 end $$ language plpgsql;
 
 /* ex wrapper */
 create function ex_sql(rgid int, cmd text) returns void as 'MODULE_PATHNAME' language C;
+/* execute scripts[i] on rgids[i], all rgs in parallel */
+create function ex_scripts_sql(rgids int[], scripts text[]) returns void as 'MODULE_PATHNAME' language C;
 /* Bcst wrapper */
 create function bcst_sql(cmd text) returns void as 'MODULE_PATHNAME' language C;
 /* BcstAll wrapper */
@@ -91,7 +107,8 @@ create function hash_shard_table(relid regclass, nparts int, colocate_with regcl
 declare
   rgids int[];
   nrgids int;
-  rgid int;
+  -- scripts[j] will be executed on rgids[j]
+  scripts text[];
   holder_rgid int not null = -1;
   -- raw relname without any quotation
   relname name := relname from pg_class where oid = relid;
@@ -113,6 +130,7 @@ begin
   -- Get repgroups in random order
   select array(select id from shardman.repgroups order by random()) into rgids;
   nrgids := array_length(rgids, 1);
+  scripts := array_fill(''::text, array[nrgids]);
 
   for i in 0..nparts-1 loop
     if colocate_with is null then
@@ -125,18 +143,21 @@ begin
     part_name := format('%s_%s', relname, i);
     fdw_part_name := format('%s_fdw', part_name);
     raise log 'putting part % on %', part_name, holder_rgid;
-    for rgid in select id from shardman.repgroups loop
-      if rgid = holder_rgid then
-        perform shardman.ex_sql(rgid, format('create table %I partition of %I for values with (modulus %s, remainder %s)',
-	                                   part_name, relname, nparts, i));
+    for j in 1..nrgids loop
+      if rgids[j] = holder_rgid then
+        scripts[j] := scripts[j] || format(E'create table %I partition of %I for values with (modulus %s, remainder %s);\n',
+	                                   part_name, relname, nparts, i);
       else
-        perform shardman.ex_sql(rgid, format('create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L)',
-	                                   fdw_part_name, relname, nparts, i, holder_rgid, quote_ident(part_name)));
+        scripts[j] := scripts[j] || format(E'create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L);\n',
+	                                   fdw_part_name, relname, nparts, i, holder_rgid, quote_ident(part_name));
       end if;
-      perform shardman.ex_sql(rgid, format('insert into shardman.parts values (%L::regclass, %s, %s)',
-                                             quote_ident(relname), i, holder_rgid));
+      scripts[j] := scripts[j] || format(E'insert into shardman.parts values (%L::regclass, %s, %s);\n',
+                                             quote_ident(relname), i, holder_rgid);
     end loop;
   end loop;
+
+  -- ship everything, one batch per rg
+  perform shardman.ex_scripts_sql(rgids, scripts);
 end $$ language plpgsql;
 
 -- update foreign tables everywhere according to the part move
@@ -148,26 +169,34 @@ declare
   fdw_part_name name := format('%s_fdw', part_name);
   nparts int not null := nparts from shardman.sharded_tables where rel = relid;
   rgid int;
+  script text;
+  -- scripts[j] will be executed on rgids[j]
+  rgids int[] := '{}';
+  scripts text[] := '{}';
 begin
   for rgid in select id from shardman.repgroups loop
     if rgid = dst_rgid then
       /* drop foreign, attach real */
-      perform shardman.ex_sql(rgid, format('drop foreign table %I', fdw_part_name));
-      perform shardman.ex_sql(rgid, format('alter table %I attach partition %I for values with (modulus %s, remainder %s)',
-                                             relname, part_name, nparts, pnum));
+      script := format(E'drop foreign table %I;\n', fdw_part_name) ||
+        format(E'alter table %I attach partition %I for values with (modulus %s, remainder %s);\n',
+               relname, part_name, nparts, pnum);
     elsif rgid = src_rgid then
       /* drop real, attach foreign */
-      perform shardman.ex_sql(rgid, format('drop table %I', part_name));
-      perform shardman.ex_sql(rgid, format('create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L)', fdw_part_name, relname, nparts, pnum, dst_rgid, quote_ident(part_name)));
+      script := format(E'drop table %I;\n', part_name) ||
+        format(E'create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L);\n', fdw_part_name, relname, nparts, pnum, dst_rgid, quote_ident(part_name));
     else
       /* recreate foreign */
-      perform shardman.ex_sql(rgid, format('drop foreign table %I', fdw_part_name));
-      perform shardman.ex_sql(rgid, format('create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L)', fdw_part_name, relname, nparts, pnum, dst_rgid, quote_ident(part_name)));
+      script := format(E'drop foreign table %I;\n', fdw_part_name) ||
+        format(E'create foreign table %I partition of %I for values with (modulus %s, remainder %s) server hp_rg_%s options (table_name %L);\n', fdw_part_name, relname, nparts, pnum, dst_rgid, quote_ident(part_name));
     end if;
-    perform shardman.ex_sql(rgid, format('update shardman.parts set rgid = %s where rel = %L::regclass and pnum = %s',
-                              dst_rgid, quote_ident(relname), pnum));
-
+    script := script || format('update shardman.parts set rgid = %s where rel = %L::regclass and pnum = %s',
+                               dst_rgid, quote_ident(relname), pnum);
+    rgids := rgids || rgid;
+    scripts := scripts || script;
   end loop;
+
+  -- ship everything, one batch per rg
+  perform shardman.ex_scripts_sql(rgids, scripts);
 end $$ language plpgsql;
 
 create function rmrepgroup(rmrgid int) returns void as $$
@@ -274,6 +303,15 @@ create view lock_graph(wait, hold) as
 create view lock_graph_native_types(wait_sysid, wait_pid, hold_sysid, hold_pid) as
     select (wait).node_sysid, (wait).pid, (hold).node_sysid, (hold).pid from lock_graph;
 
+-- Same edges as lock_graph_native_types, computed much cheaper in C. Lock
+-- waits younger than min_wait_ms are omitted; wait age is counted since
+-- the first call in this backend which saw it, so the caller should keep the
+-- connection, like monitor does. Edges to the backend itself (lock upgrade)
+-- are not reported.
+create function lock_graph_edges(min_wait_ms int, out wait_sysid bigint, out wait_pid int,
+								 out hold_sysid bigint, out hold_pid int)
+returns setof record as 'MODULE_PATHNAME' language C strict;
+
 -- rebalance stuff
 create function rebalance_cleanup() returns void as $$
 begin
@@ -383,3 +421,30 @@ LANGUAGE C STRICT;
 CREATE FOREIGN DATA WRAPPER shardman_postgres_fdw
   HANDLER postgres_fdw_handler
   VALIDATOR postgres_fdw_validator;
+
+-- Cumulative statistics of talking to other repgroups, collected by this node
+-- acting as coordinator. Times are in milliseconds. Preparing includes
+-- pg_global_snapshot_prepare() which is sent along with PREPARE.
+create function fdw_server_stats(
+  out srvid oid,
+  out round_trips bigint,
+  out wait_time float8,
+  out rows_fetched bigint,
+  out bytes_fetched bigint,
+  out copy_bytes bigint,
+  out prepares bigint,
+  out prepare_time float8,
+  out assigns bigint,
+  out assign_time float8,
+  out commits bigint,
+  out commit_time float8)
+returns setof record as 'MODULE_PATHNAME' language C strict;
+create function fdw_stats_reset() returns void as 'MODULE_PATHNAME' language C;
+create view fdw_stats as
+  select r.id as rgid, s.* from fdw_server_stats() s
+    left outer join repgroups r on r.srvid = s.srvid;
+
+-- Called by postgres_fdw on standby before reading from it, see
+-- postgres_fdw.standby_reads: wait until WAL is replayed up to lsn, at most
+-- timeout_ms. Returns false if it wasn't or if we are not a standby anymore.
+create function wait_replay(lsn pg_lsn, timeout_ms int) returns bool as 'MODULE_PATHNAME' language C strict;
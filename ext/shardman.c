@@ -11,13 +11,20 @@
 
 #include "access/htup_details.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_type.h"
 #include "commands/extension.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "utils/fmgroids.h"
 #include "fmgr.h"
 #include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/planner.h"
 #include "tcop/utility.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/rel.h"
 #include "utils/guc.h"
@@ -31,12 +38,25 @@ PG_MODULE_MAGIC;
 
 /* SQL funcs */
 PG_FUNCTION_INFO_V1(ex_sql);
+PG_FUNCTION_INFO_V1(ex_scripts_sql);
 PG_FUNCTION_INFO_V1(bcst_sql);
 PG_FUNCTION_INFO_V1(bcst_all_sql);
+PG_FUNCTION_INFO_V1(meta_cache_inval);
 
 /* GUC variables */
 int MyRgid;
 static bool broadcast_utility;
+static bool colocated_join_pushdown;
+static bool aggregate_pushdown;
+static bool direct_routing;
+
+/* What HPPlanner wants to know about the query */
+typedef struct ShardedRelsContext
+{
+	List	   *groups;			/* colocation groups of sharded rels seen */
+	bool		colocated;		/* seen two rels from the same group? */
+	bool		aggregates;		/* any aggregation or grouping? */
+} ShardedRelsContext;
 
 static bool AmCoordinator(void);
 static void HPProcessUtility(PlannedStmt *pstmt,
@@ -45,14 +65,20 @@ static void HPProcessUtility(PlannedStmt *pstmt,
 							 QueryEnvironment *queryEnv,
 							 DestReceiver *dest, char *completionTag);
 static void Ex(int rgid, char *sql);
+static void ExScripts(int nscripts, int *rgids, char **scripts);
 static void ExLocal(char *sql);
 static void BcstAll(char *sql);
 static void Bcst(char *sql);
 static void ExServer(Oid serverid, char *sql);
-static void do_sql_command(ConnCacheEntry *entry, char *sql);
+static ConnCacheEntry *ExServerSend(Oid serverid, char *sql);
+static void ExServerFinish(ConnCacheEntry *entry, char *sql);
 static bool ShardmanLoaded(void);
+static PlannedStmt *HPPlanner(Query *parse, int cursorOptions,
+							  ParamListInfo boundParams);
+static bool ShardedRelsWalker(Node *node, ShardedRelsContext *context);
 
 static ProcessUtility_hook_type PreviousProcessUtilityHook;
+static planner_hook_type PreviousPlannerHook;
 
 
 /*
@@ -81,9 +107,43 @@ _PG_init()
 		0, /* flags */
 		NULL, NULL, NULL); /* hooks */
 
+	DefineCustomBoolVariable(
+		"shardman.colocated_join_pushdown",
+		"Plan queries joining colocated sharded tables partition-wise",
+		"Partitions of colocated tables with the same number live on the same repgroup, so joining them partition by partition allows to push each join down to the repgroup. When on, enable_partitionwise_join is forced while planning such queries.",
+		&colocated_join_pushdown,
+		true,
+		PGC_USERSET,
+		0, /* flags */
+		NULL, NULL, NULL); /* hooks */
+
+	DefineCustomBoolVariable(
+		"shardman.aggregate_pushdown",
+		"Plan aggregation over sharded tables partition-wise",
+		"Allows each repgroup to aggregate its partitions, completely or partially, so that only aggregated rows travel. When on, enable_partitionwise_aggregate is forced while planning such queries.",
+		&aggregate_pushdown,
+		true,
+		PGC_USERSET,
+		0, /* flags */
+		NULL, NULL, NULL); /* hooks */
+
+	DefineCustomBoolVariable(
+		"shardman.direct_routing",
+		"Plan single-partition queries on sharded tables directly against the partition",
+		"When SELECT, UPDATE or DELETE of a single sharded table compares its partition key with a constant, the partition is known beforehand, so the table is replaced with it before planning instead of expanding and pruning all partitions.",
+		&direct_routing,
+		true,
+		PGC_USERSET,
+		0, /* flags */
+		NULL, NULL, NULL); /* hooks */
+
 	/* Install hooks */
 	PreviousProcessUtilityHook = ProcessUtility_hook;
 	ProcessUtility_hook = HPProcessUtility;
+	PreviousPlannerHook = planner_hook;
+	planner_hook = HPPlanner;
+
+	InitMetaCache();
 
 	postgres_fdw_PG_init();
 }
@@ -309,6 +369,114 @@ end_of_switch:
 	}
 }
 
+/*
+ * Make the planner consider partition-wise plans for queries over sharded
+ * tables, which allows to push work down to repgroups.
+ *
+ * If the query touches at least two tables (or one table twice) of the same
+ * colocation group, enable partition-wise join. Since partitions with equal
+ * numbers of such tables reside on the same repgroup, the join of each pair
+ * of foreign partitions is then pushed down to the holder, and only the
+ * result travels.
+ *
+ * If the query aggregates anything over sharded tables, enable
+ * partition-wise aggregation, so that each partition is aggregated by its
+ * holder, completely if grouping is by the partition key and partially
+ * otherwise, and we only combine the results.
+ *
+ * Before all that, query on single partition of sharded table is routed
+ * directly to it, see router.c.
+ */
+static PlannedStmt *HPPlanner(Query *parse, int cursorOptions,
+							  ParamListInfo boundParams)
+{
+	PlannedStmt *result;
+	bool save_enable_partitionwise_join = enable_partitionwise_join;
+	bool save_enable_partitionwise_aggregate = enable_partitionwise_aggregate;
+	ShardedRelsContext context = {NIL, false, false};
+	bool routed = false;
+
+	if (direct_routing && ShardmanLoaded())
+		routed = RouteToPartition(parse, boundParams);
+
+	if (!routed && (colocated_join_pushdown || aggregate_pushdown) &&
+		ShardmanLoaded())
+	{
+		(void) ShardedRelsWalker((Node *) parse, &context);
+
+		if (colocated_join_pushdown && context.colocated)
+		{
+			hp_log3("planning join partition-wise");
+			enable_partitionwise_join = true;
+		}
+		if (aggregate_pushdown && context.aggregates && context.groups != NIL)
+		{
+			hp_log3("planning aggregation partition-wise");
+			enable_partitionwise_aggregate = true;
+		}
+		list_free(context.groups);
+	}
+
+	PG_TRY();
+	{
+		if (PreviousPlannerHook != NULL)
+			result = PreviousPlannerHook(parse, cursorOptions, boundParams);
+		else
+			result = standard_planner(parse, cursorOptions, boundParams);
+	}
+	PG_CATCH();
+	{
+		enable_partitionwise_join = save_enable_partitionwise_join;
+		enable_partitionwise_aggregate = save_enable_partitionwise_aggregate;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	enable_partitionwise_join = save_enable_partitionwise_join;
+	enable_partitionwise_aggregate = save_enable_partitionwise_aggregate;
+
+	return result;
+}
+
+/*
+ * Collect into context the sharded tables referenced by the query and
+ * whether it aggregates. Returns true, stopping the walk, when there is
+ * nothing more to learn.
+ */
+static bool ShardedRelsWalker(Node *node, ShardedRelsContext *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, RangeTblEntry))
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) node;
+		Oid group;
+
+		if (rte->rtekind != RTE_RELATION)
+			return false;
+		group = ShardedRelColocationGroup(rte->relid);
+		if (!OidIsValid(group))
+			return false;
+		if (list_member_oid(context->groups, group))
+			context->colocated = true;
+		else
+			context->groups = lappend_oid(context->groups, group);
+		return context->colocated && context->aggregates;
+	}
+
+	if (IsA(node, Query))
+	{
+		Query *query = (Query *) node;
+
+		if (query->hasAggs || query->groupClause != NIL)
+			context->aggregates = true;
+		return query_tree_walker(query, ShardedRelsWalker,
+								 (void *) context, QTW_EXAMINE_RTES);
+	}
+
+	return expression_tree_walker(node, ShardedRelsWalker,
+								  (void *) context);
+}
 
 Datum
 ex_sql(PG_FUNCTION_ARGS) {
@@ -318,6 +486,49 @@ ex_sql(PG_FUNCTION_ARGS) {
 	PG_RETURN_VOID();
 }
 
+/*
+ * Execute scripts[i] on rgids[i] for all i, see ExScripts. NULL scripts are
+ * skipped.
+ */
+Datum
+ex_scripts_sql(PG_FUNCTION_ARGS) {
+	ArrayType *rgids_arr = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType *scripts_arr = PG_GETARG_ARRAYTYPE_P(1);
+	Datum *rgid_datums;
+	Datum *script_datums;
+	bool *rgid_nulls;
+	bool *script_nulls;
+	int nrgids;
+	int nscripts;
+	int *rgids;
+	char **scripts;
+	int n = 0;
+	int i;
+
+	deconstruct_array(rgids_arr, INT4OID, sizeof(int32), true, 'i',
+					  &rgid_datums, &rgid_nulls, &nrgids);
+	deconstruct_array(scripts_arr, TEXTOID, -1, false, 'i',
+					  &script_datums, &script_nulls, &nscripts);
+	if (nrgids != nscripts)
+		hp_elog(ERROR, "got %d rgids, but %d scripts", nrgids, nscripts);
+
+	rgids = palloc(sizeof(int) * nrgids);
+	scripts = palloc(sizeof(char *) * nscripts);
+	for (i = 0; i < nscripts; i++)
+	{
+		if (rgid_nulls[i])
+			hp_elog(ERROR, "rgid must not be null");
+		if (script_nulls[i])
+			continue;
+		rgids[n] = DatumGetInt32(rgid_datums[i]);
+		scripts[n] = TextDatumGetCString(script_datums[i]);
+		n++;
+	}
+
+	ExScripts(n, rgids, scripts);
+	PG_RETURN_VOID();
+}
+
 Datum
 bcst_sql(PG_FUNCTION_ARGS) {
 	char* sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
@@ -331,6 +542,21 @@ Datum bcst_all_sql(PG_FUNCTION_ARGS) {
 	PG_RETURN_VOID();
 }
 
+/*
+ * Statement-level trigger on metadata tables: make backends forget their
+ * cached copy of the table (see meta.c).
+ */
+Datum meta_cache_inval(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		hp_elog(ERROR, "meta_cache_inval: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+	return PointerGetDatum(NULL);
+}
+
 /* execute no-data-returning cmd on given rgid */
 static void Ex(int rgid, char *sql)
 {
@@ -351,6 +577,50 @@ static void Ex(int rgid, char *sql)
 	ExServer(serverid, sql);
 }
 
+/*
+ * Execute scripts[i], which may consist of several commands, on rgids[i].
+ * Scripts are sent to all external repgroups first, then local ones are
+ * executed, and only then we wait for the external ones, so that all
+ * repgroups work in parallel and each costs a single round trip.
+ */
+static void ExScripts(int nscripts, int *rgids, char **scripts)
+{
+	List *entries = NIL;
+	List *sent_scripts = NIL;
+	ListCell *lc1;
+	ListCell *lc2;
+	int i;
+
+	for (i = 0; i < nscripts; i++)
+	{
+		bool isnull;
+		Oid serverid = ServerIdByRgid(rgids[i], &isnull);
+
+		if (isnull)
+			continue;
+		hp_log2("sending script to external rgid %d", rgids[i]);
+		entries = lappend(entries, ExServerSend(serverid, scripts[i]));
+		sent_scripts = lappend(sent_scripts, scripts[i]);
+	}
+
+	for (i = 0; i < nscripts; i++)
+	{
+		bool isnull;
+
+		(void) ServerIdByRgid(rgids[i], &isnull);
+		if (!isnull)
+			continue;
+		Assert(rgids[i] == MyRgid);
+		ExLocal(scripts[i]);
+	}
+
+	forboth(lc1, entries, lc2, sent_scripts)
+		ExServerFinish((ConnCacheEntry *) lfirst(lc1), (char *) lfirst(lc2));
+
+	list_free(entries);
+	list_free(sent_scripts);
+}
+
 /* execute command locally via SPI */
 static void ExLocal(char *sql)
 {
@@ -378,66 +648,72 @@ static void BcstAll(char *sql)
 	Bcst(sql);
 }
 
-/* execute cmd on all *external* repgroups */
+/*
+ * execute cmd on all *external* repgroups. cmd is sent everywhere first and
+ * results are collected afterwards, so repgroups execute it in parallel.
+ */
 static void Bcst(char *sql)
 {
-	Relation rel;
-	SysScanDesc scan;
-	TupleDesc tupleDescriptor;
-	HeapTuple tuple;
+	List *servers = RepgroupsServers();
+	List *entries = NIL;
+	ListCell *lc;
 
-	rel = heap_open(RepgroupsOid(), AccessShareLock);
-	tupleDescriptor = RelationGetDescr(rel);
-
-	scan = systable_beginscan(rel, 0, true, NULL, 0, NULL);
-	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
-	{
-		Oid serverid;
-		bool isnull;
-
-		serverid = DatumGetObjectId(heap_getattr(tuple,
-												 Anum_repgroups_srvid,
-												 tupleDescriptor,
-												 &isnull));
-		if (!isnull)
-			ExServer(serverid, sql);
-	}
+	foreach(lc, servers)
+		entries = lappend(entries, ExServerSend(lfirst_oid(lc), sql));
+	foreach(lc, entries)
+		ExServerFinish((ConnCacheEntry *) lfirst(lc), sql);
 
-	systable_endscan(scan);
-	heap_close(rel, AccessShareLock);
+	list_free(entries);
+	list_free(servers);
 }
 
 /* execute cmd on given foreign server */
 static void ExServer(Oid serverid, char *sql)
+{
+	ExServerFinish(ExServerSend(serverid, sql), sql);
+}
+
+/*
+ * Send cmd to given foreign server without waiting for the result, which
+ * must be collected with ExServerFinish.
+ */
+static ConnCacheEntry *ExServerSend(Oid serverid, char *sql)
 {
 	UserMapping *user;
 	ConnCacheEntry *entry;
-	char *spathcmd;
+	PGconn *conn;
+	char *fullcmd;
 
 	user = GetUserMapping(GetUserId(), serverid);
 	entry = GetConnection(user, false);
+	ConnectionEntryMarkModified(entry);
 	pfree(user);
 
 	/*
 	 * postgres_fdw relies on search path being "pg_catalog", set current one
-	 * and restore it back later
+	 * and restore it back later. All of it goes in one query string to save
+	 * round trips; newlines guard against cmd ending with a comment. If cmd
+	 * fails, search path is not restored, but SET is rolled back anyway.
 	 */
-	spathcmd = psprintf("set search_path = %s", namespace_search_path);
-	do_sql_command(entry, spathcmd);
-	pfree(spathcmd);
-	do_sql_command(entry, sql);
-	do_sql_command(entry, "set search_path = pg_catalog");
+	fullcmd = psprintf("set search_path = %s;\n%s;\nset search_path = pg_catalog",
+					   namespace_search_path, sql);
+
+	conn = ConnectionEntryGetConn(entry);
+	ConnectionEntryFinishPending(entry);
+	if (!PQsendQuery(conn, fullcmd))
+		pgfdw_report_error(ERROR, NULL, conn, false, sql);
+	pfree(fullcmd);
+
+	return entry;
 }
 
-/* we could export this from connection.c */
-static void do_sql_command(ConnCacheEntry *entry, char *sql)
+/* Wait for the cmd sent by ExServerSend to complete */
+static void ExServerFinish(ConnCacheEntry *entry, char *sql)
 {
-	PGconn *conn;
+	PGconn *conn = ConnectionEntryGetConn(entry);
 	PGresult *res;
 
-	conn = ConnectionEntryGetConn(entry);
-	if (!PQsendQuery(conn, sql))
-		pgfdw_report_error(ERROR, NULL, conn, false, sql);
+	/* on error the rest of query string is skipped, so it is the last one */
 	res = pgfdw_get_result(entry, sql);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK &&
 		PQresultStatus(res) != PGRES_TUPLES_OK)
@@ -445,9 +721,7 @@ static void do_sql_command(ConnCacheEntry *entry, char *sql)
 	PQclear(res);
 }
 
-/* TODO: caching */
 static bool ShardmanLoaded()
 {
-	Oid extension_oid = get_extension_oid("shardman", true);
-	return extension_oid != InvalidOid;
+	return ShardmanExtensionOid() != InvalidOid;
 }
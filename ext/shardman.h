@@ -10,6 +10,9 @@
 #ifndef __SHARDMAN_H__
 #define __SHARDMAN_H__
 
+#include "nodes/params.h"
+#include "nodes/parsenodes.h"
+
 /* #ifndef DEBUG_LEVEL */
 /* #define DEBUG_LEVEL 0 */
 /* #endif */
@@ -36,4 +39,7 @@ extern int MyRgid;
 
 extern void _PG_init(void);
 
+/* router.c */
+extern bool RouteToPartition(Query *parse, ParamListInfo boundParams);
+
 #endif /* SHARDMAN_H */
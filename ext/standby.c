@@ -0,0 +1,74 @@
+/* -------------------------------------------------------------------------
+ *
+ * standby.c
+ *   Standby side of postgres_fdw.standby_reads.
+ *
+ * Before reading from a standby, coordinator makes it wait until WAL the
+ * master had written when the coordinator's transaction started is replayed.
+ * Startup process doesn't wake anyone up on replay progress, so we sleep on
+ * the latch between checks of the replay position, with intervals growing up
+ * to WAIT_REPLAY_MAX_SLEEP; interrupts still wake us immediately.
+ *
+ * Copyright (c) 2018, Postgres Professional
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/xlog.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+
+/* Longest sleep between checks of replay position, ms */
+#define WAIT_REPLAY_MAX_SLEEP 10
+
+PG_FUNCTION_INFO_V1(wait_replay);
+
+/*
+ * Wait until WAL is replayed up to lsn, at most timeout_ms. Returns false if
+ * it wasn't or if we are not a standby (anymore).
+ */
+Datum
+wait_replay(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	int			timeout_ms = PG_GETARG_INT32(1);
+	TimestampTz deadline;
+	long		sleep_ms = 1;
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout_ms);
+	for (;;)
+	{
+		TimestampTz now;
+		long		secs;
+		int			usecs;
+		long		left_ms;
+		int			rc;
+
+		if (!RecoveryInProgress())
+			PG_RETURN_BOOL(false);
+		if (GetXLogReplayRecPtr(NULL) >= lsn)
+			PG_RETURN_BOOL(true);
+
+		now = GetCurrentTimestamp();
+		if (now >= deadline)
+			PG_RETURN_BOOL(false);
+		TimestampDifference(now, deadline, &secs, &usecs);
+		left_ms = secs * 1000 + usecs / 1000 + 1;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   Min(sleep_ms, left_ms), PG_WAIT_EXTENSION);
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		sleep_ms = Min(sleep_ms * 2, WAIT_REPLAY_MAX_SLEEP);
+	}
+}
@@ -4,12 +4,19 @@ package cmd
 
 import (
 	"bufio"
+	"bytes"
 	"context"
+	"crypto/sha256"
+	"encoding/hex"
+	"encoding/json"
 	"fmt"
+	"io"
+	"io/ioutil"
 	"os"
 	"os/signal"
 	"path/filepath"
 	"regexp"
+	"sort"
 	"strconv"
 	"strings"
 	"syscall"
@@ -72,8 +79,23 @@ type bowlState struct {
 	// triggers retry if previous attempt failed
 	retryTimer *time.Timer
 	ls         *ladle.LadleStore
-	watchCh    <-chan clientv3.WatchResponse
 	dbusConn   *dbus.Conn
+
+	// watches on ladledata and clusterdata; both are canceled together
+	watchCancel context.CancelFunc
+	ldWatchCh   <-chan clientv3.WatchResponse
+	cdWatchCh   <-chan clientv3.WatchResponse
+
+	// cached view of the store, kept up to date by watch events
+	ld    *ladle.LadleData
+	ldRev int64
+	cd    *cluster.ClusterData
+	cdRev int64
+
+	// units we have successfully configured: unit name -> hash of its
+	// config. Unit with an entry here is enabled and was (re)started with
+	// exactly this config.
+	applied map[string]string
 }
 
 const retryStoreConnInterval = 2 * time.Second
@@ -81,6 +103,7 @@ const retryStoreConnInterval = 2 * time.Second
 func bowlMain(c *cobra.Command, args []string) {
 	var b = &bowlState{
 		retryTimer: time.NewTimer(0),
+		applied:    make(map[string]string),
 	}
 
 	var err error
@@ -115,6 +138,7 @@ func bowlMain(c *cobra.Command, args []string) {
 
 		select {
 		case <-ctx.Done():
+			stopWatch(b)
 			if b.ls != nil {
 				b.ls.Close()
 				b.ls = nil
@@ -133,38 +157,147 @@ func bowlMain(c *cobra.Command, args []string) {
 					continue
 				}
 			}
-			if b.watchCh == nil {
-				lctx := clientv3.WithRequireLeader(ctx)
-				cli := b.ls.Store.GetClient()
-				b.watchCh = cli.Watch(lctx, b.ls.LadleDataStorePath())
+			// Something went wrong or we are just starting; don't trust
+			// anything we remember and check everything from scratch.
+			if err = bowlLoad(ctx, b); err != nil {
+				hl.Errorf("%v", err)
+				b.retryTimer = time.NewTimer(retryStoreConnInterval)
+				continue
 			}
-			bowlReconfigure(ctx, b)
+			bowlReconfigure(b)
 
-		case wresp, ok := <-b.watchCh:
-			if !ok {
-				// ctx is canceled; or etcd unrecoverable error,
-				// in which case error must have been sent previously
-				hl.Debugf("watch chan is closed")
+		case wresp, ok := <-b.ldWatchCh:
+			changed, wok := applyWatchResp(b, wresp, ok)
+			if !wok {
 				goto recreateWatch
 			}
-			if wresp.Canceled {
-				// etcd unrecoverable error, hmm
-				hl.Errorf("store (watch) failed: %v", wresp.Err())
-				goto recreateWatch
+			if changed {
+				bowlReconfigure(b)
 			}
+			continue
 
-			bowlReconfigure(ctx, b)
+		case wresp, ok := <-b.cdWatchCh:
+			changed, wok := applyWatchResp(b, wresp, ok)
+			if !wok {
+				goto recreateWatch
+			}
+			if changed {
+				bowlReconfigure(b)
+			}
 			continue
 
 		recreateWatch:
 			// xxx we are not recreating client here, hoping
 			// client has fine retry logic
+			stopWatch(b)
 			b.retryTimer = time.NewTimer(retryStoreConnInterval)
-			b.watchCh = nil
 		}
 	}
 }
 
+// Read ladledata and clusterdata anew and (re)start watching them from the
+// revision we have read.
+func bowlLoad(ctx context.Context, b *bowlState) error {
+	stopWatch(b)
+
+	// Read both keys at one store revision. Keys' own ModRevisions won't do
+	// as watch start: they might be already compacted.
+	pairs, rev, err := b.ls.Store.GetMany(ctx, b.ls.LadleDataStorePath(), b.ls.ClusterDataPath())
+	if err != nil {
+		return fmt.Errorf("Error retrieving ladle and cluster data: %v", err)
+	}
+	var ld *ladle.LadleData
+	var cd *cluster.ClusterData
+	if pairs[0] != nil {
+		ld = &ladle.LadleData{}
+		if err = json.Unmarshal(pairs[0].Value, ld); err != nil {
+			return fmt.Errorf("failed to decode ladledata: %v", err)
+		}
+	}
+	if pairs[1] != nil {
+		cd = &cluster.ClusterData{}
+		if err = json.Unmarshal(pairs[1].Value, cd); err != nil {
+			return fmt.Errorf("failed to decode clusterdata: %v", err)
+		}
+	}
+	b.ld, b.ldRev, b.cd, b.cdRev = ld, rev, cd, rev
+	// forget what we applied: units might have been touched by someone else
+	b.applied = make(map[string]string)
+
+	// Anything with revision <= rev is already in what we have read.
+	wctx, cancel := context.WithCancel(clientv3.WithRequireLeader(ctx))
+	cli := b.ls.Store.GetClient()
+	b.watchCancel = cancel
+	b.ldWatchCh = cli.Watch(wctx, b.ls.LadleDataStorePath(), clientv3.WithRev(rev+1))
+	b.cdWatchCh = cli.Watch(wctx, b.ls.ClusterDataPath(), clientv3.WithRev(rev+1))
+	return nil
+}
+
+func stopWatch(b *bowlState) {
+	if b.watchCancel != nil {
+		b.watchCancel()
+	}
+	b.watchCancel = nil
+	b.ldWatchCh = nil
+	b.cdWatchCh = nil
+}
+
+// Apply watch events to cached ladledata/clusterdata. Returns whether
+// anything changed and whether the watch is still usable.
+func applyWatchResp(b *bowlState, wresp clientv3.WatchResponse, ok bool) (bool, bool) {
+	if !ok {
+		// ctx is canceled; or etcd unrecoverable error,
+		// in which case error must have been sent previously
+		hl.Debugf("watch chan is closed")
+		return false, false
+	}
+	if wresp.Canceled {
+		// etcd unrecoverable error, hmm; e.g. revision compacted
+		hl.Errorf("store (watch) failed: %v", wresp.Err())
+		return false, false
+	}
+
+	changed := false
+	for _, ev := range wresp.Events {
+		key := string(ev.Kv.Key)
+		rev := ev.Kv.ModRevision
+		switch key {
+		case b.ls.LadleDataStorePath():
+			if rev <= b.ldRev {
+				continue
+			}
+			b.ldRev = rev
+			b.ld = nil
+			if ev.Type != clientv3.EventTypeDelete {
+				var ld = &ladle.LadleData{}
+				if err := json.Unmarshal(ev.Kv.Value, ld); err != nil {
+					hl.Errorf("failed to decode ladledata: %v", err)
+					return false, false
+				}
+				b.ld = ld
+			}
+			changed = true
+
+		case b.ls.ClusterDataPath():
+			if rev <= b.cdRev {
+				continue
+			}
+			b.cdRev = rev
+			b.cd = nil
+			if ev.Type != clientv3.EventTypeDelete {
+				var cd = &cluster.ClusterData{}
+				if err := json.Unmarshal(ev.Kv.Value, cd); err != nil {
+					hl.Errorf("failed to decode clusterdata: %v", err)
+					return false, false
+				}
+				b.cd = cd
+			}
+			changed = true
+		}
+	}
+	return changed, true
+}
+
 func sigHandler(sigs chan os.Signal, cancel context.CancelFunc) {
 	s := <-sigs
 	hl.Debugf("got signal %v", s)
@@ -272,6 +405,9 @@ type specUnit struct {
 	envPath string
 }
 
+// UnitFileState property as dbus variant prints it
+const unitFileEnabled = "\"enabled\""
+
 func formTemplateUnitName(bin string, id string) string {
 	return fmt.Sprintf("shardman-%s-%s@%s.service", bin, cfg.ClusterName, id)
 }
@@ -292,10 +428,19 @@ func formEnvFilename(bin string, id string) string {
 }
 
 // loaded units are ones either enabled or running
-func getLoadedUnits(ld *ladle.LadleData, dbusConn *dbus.Conn) ([]loadedUnit, error) {
+// UnitFileState is not in ListUnits reply, so it costs one more dbus call
+// per unit; units from applied are known to be enabled and are not asked.
+func getLoadedUnits(ld *ladle.LadleData, dbusConn *dbus.Conn, applied map[string]string) ([]loadedUnit, error) {
 	var loadedUnits []loadedUnit
 
-	unitStatuses, err := dbusConn.ListUnits()
+	// let systemd filter out foreign units instead of sending all of them
+	patterns := []string{
+		"shardman-keeper-" + cfg.ClusterName + "*",
+		"shardman-sentinel-" + cfg.ClusterName + "*",
+		"shardman-proxy-" + cfg.ClusterName + "*",
+		"shardman-monitor-" + cfg.ClusterName + "*",
+	}
+	unitStatuses, err := dbusConn.ListUnitsByPatterns([]string{}, patterns)
 	if err != nil {
 		return nil, err
 	}
@@ -305,11 +450,14 @@ func getLoadedUnits(ld *ladle.LadleData, dbusConn *dbus.Conn) ([]loadedUnit, err
 		}
 
 		hl.Debugf("found our service %v, activestate %v", s.Name, s.ActiveState)
-		prop, err := dbusConn.GetUnitProperty(s.Name, "UnitFileState")
-		if err != nil {
-			return nil, err
+		unitFileState := unitFileEnabled
+		if _, ok := applied[s.Name]; !ok {
+			prop, err := dbusConn.GetUnitProperty(s.Name, "UnitFileState")
+			if err != nil {
+				return nil, err
+			}
+			unitFileState = prop.Value.String()
 		}
-		unitFileState := prop.Value.String()
 
 		unit := unit{name: s.Name}
 		var uI unitI = unit
@@ -495,20 +643,33 @@ func (su specUnit) getConfig() (map[string]string, error) {
 	return c, nil
 }
 
-// dump this unit config into env file
-func (su specUnit) writeConfig() error {
-	f, err := os.OpenFile(su.envPath, os.O_WRONLY|os.O_CREATE|os.O_TRUNC, 0600)
-	if err != nil {
-		return err
+// env file contents, with sorted keys to make it (and its hash) stable
+func (su specUnit) formConfig() []byte {
+	var keys []string
+	for k := range su.env {
+		keys = append(keys, k)
 	}
-	defer f.Close()
+	sort.Strings(keys)
 
-	w := bufio.NewWriter(f)
-	defer w.Flush() // yeah, it is not flushed on close
-	for k, v := range su.env {
-		fmt.Fprintf(w, "%s=%s\n", k, v)
+	var buf bytes.Buffer
+	for _, k := range keys {
+		fmt.Fprintf(&buf, "%s=%s\n", k, su.env[k])
 	}
-	return nil
+	return buf.Bytes()
+}
+
+// identifies everything we put into the unit: where config is and what
+func (su specUnit) configHash() string {
+	h := sha256.New()
+	io.WriteString(h, su.envPath)
+	h.Write([]byte{0})
+	h.Write(su.formConfig())
+	return hex.EncodeToString(h.Sum(nil))
+}
+
+// dump this unit config into env file
+func (su specUnit) writeConfig() error {
+	return ioutil.WriteFile(su.envPath, su.formConfig(), 0600)
 }
 
 // avoid using reflect...
@@ -530,9 +691,25 @@ func mapsEqual(m1 map[string]string, m2 map[string]string) bool {
 	return true
 }
 
-func reconfigure(loadedUnits []loadedUnit, specUnits []specUnit, c *dbus.Conn) error {
+// Disable units not in spec and (re)start the ones whose config changed.
+// applied is updated as units are configured.
+func reconfigure(loadedUnits []loadedUnit, specUnits []specUnit, applied map[string]string, c *dbus.Conn) error {
 	// there are always only a few daemons, so O(n^2) is ok
 
+	// forget units which are not in spec anymore
+	for name := range applied {
+		inSpec := false
+		for _, su := range specUnits {
+			if name == su.getName() {
+				inSpec = true
+				break
+			}
+		}
+		if !inSpec {
+			delete(applied, name)
+		}
+	}
+
 	// shut down removed units
 	for _, lu := range loadedUnits {
 		shutdown := true
@@ -553,11 +730,14 @@ func reconfigure(loadedUnits []loadedUnit, specUnits []specUnit, c *dbus.Conn) e
 	// now (re)start units as spec says
 	for _, su := range specUnits {
 		hl.Debugf("ensuring unit %s is running", su.getName())
+		hash := su.configHash()
+		appliedHash, known := applied[su.getName()]
+		delete(applied, su.getName())
 		// if unit is active and enabled, only restart if config changed;
 		// otherwise, re-enable and restart unconditionally
 		considerOk := false
 		for _, lu := range loadedUnits {
-			if su.getName() == lu.getName() && lu.unitFileState == "\"enabled\"" && lu.activeState == "active" {
+			if su.getName() == lu.getName() && lu.unitFileState == unitFileEnabled && lu.activeState == "active" {
 				considerOk = true
 				break
 			}
@@ -565,16 +745,23 @@ func reconfigure(loadedUnits []loadedUnit, specUnits []specUnit, c *dbus.Conn) e
 
 		if considerOk {
 			hl.Debugf("checking config equality")
-			currCfg, err := su.getConfig()
-			if err != nil || !mapsEqual(currCfg, su.env) {
-				err = su.writeConfig()
+			var cfgEqual bool
+			if known {
+				cfgEqual = appliedHash == hash
+			} else {
+				// don't know what unit was started with, look at the file
+				currCfg, err := su.getConfig()
+				cfgEqual = err == nil && mapsEqual(currCfg, su.env)
+			}
+			if !cfgEqual {
+				err := su.writeConfig()
 				if err != nil {
 					hl.Errorf("failed to write config: %v", err)
 					return err
 				}
 				err = su.restart(c)
 				if err != nil {
-					hl.Errorf("failed to restart unit: %v")
+					hl.Errorf("failed to restart unit: %v", err)
 					return err
 				}
 			}
@@ -592,22 +779,21 @@ func reconfigure(loadedUnits []loadedUnit, specUnits []specUnit, c *dbus.Conn) e
 				return err
 			}
 		}
+		applied[su.getName()] = hash
 	}
 	return nil
 }
 
 // do the deed
-func bowlReconfigure(ctx context.Context, b *bowlState) {
+// Unit state is always asked from systemd, even if the spec hasn't changed:
+// a unit might have died since we started it.
+func bowlReconfigure(b *bowlState) {
 	var err error
 	var loadedUnits []loadedUnit
 	var specUnits []specUnit
 	var l *ladle.NodeLayout = nil
+	ld, cd := b.ld, b.cd
 
-	ld, _, cd, _, err := b.ls.GetLadleAndClusterData(ctx)
-	if err != nil {
-		hl.Errorf("%v", err)
-		goto retry
-	}
 	if ld != nil && cd == nil {
 		hl.Errorf("ladledata exists, but clusterdata not")
 		goto retry
@@ -618,16 +804,16 @@ func bowlReconfigure(ctx context.Context, b *bowlState) {
 	}
 	hl.Debugf("ld is %v, l %v", spew.Sdump(ld), spew.Sdump(l))
 
-	loadedUnits, err = getLoadedUnits(ld, b.dbusConn)
+	specUnits = getSpecUnits(ld, l, cd)
+
+	loadedUnits, err = getLoadedUnits(ld, b.dbusConn, b.applied)
 	if err != nil {
 		hl.Errorf("%v", err)
 		goto retry
 	}
 
-	specUnits = getSpecUnits(ld, l, cd)
-
 	hl.Debugf("reconfiguring")
-	err = reconfigure(loadedUnits, specUnits, b.dbusConn)
+	err = reconfigure(loadedUnits, specUnits, b.applied, b.dbusConn)
 	if err != nil {
 		goto retry
 	}
@@ -10,6 +10,7 @@ import (
 	"os"
 	"os/signal"
 	"regexp"
+	"sort"
 	"strconv"
 	"strings"
 	"sync"
@@ -19,6 +20,7 @@ import (
 
 	"github.com/jackc/pgx"
 	"github.com/spf13/cobra"
+	"go.etcd.io/etcd/clientv3"
 	"go.uber.org/zap"
 
 	cmdcommon "postgrespro.ru/shardman/cmd"
@@ -111,8 +113,24 @@ type shMonState struct {
 	xact_resolverch     chan clusterState
 	deadlock_detectorch chan clusterState
 	wg                  sync.WaitGroup
+	// store watch: keys watched and how to stop it, nil if not running
+	watchKeys   []string
+	watchCancel context.CancelFunc
+	// incremented on each watch (re)start; failures are tagged with it, so
+	// that watcher of already stopped watch can't stop the current one
+	watchGen int
+	// watchers notify about changes and failures here
+	storeEvents chan struct{}
+	watchFailed chan int
 }
 
+// Reload store at least this often, even if watch says nothing
+const reloadStoreInterval = 5 * time.Second
+
+// Wait that long after change notification before reloading the store, so
+// that burst of changes results in one reload
+const storeEventReloadDelay = 100 * time.Millisecond
+
 // what is sharded and current masters, fed into workers
 type clusterState struct {
 	rgs map[int]*repGroupState
@@ -120,6 +138,7 @@ type clusterState struct {
 type repGroupState struct {
 	sysId      int64
 	connstrmap map[string]string
+	standbys   []*cluster.Endpoint
 }
 
 // TODO: we should we add ctx to all pg's commands to prevent any worker
@@ -131,6 +150,8 @@ func shmon(c *cobra.Command, args []string) {
 	state.workers = make(map[int]chan clusterState)
 	state.xact_resolverch = make(chan clusterState)
 	state.deadlock_detectorch = make(chan clusterState)
+	state.storeEvents = make(chan struct{}, 1)
+	state.watchFailed = make(chan int)
 
 	ctx, cancel := context.WithCancel(context.Background())
 	state.ctx = ctx
@@ -148,7 +169,9 @@ func shmon(c *cobra.Command, args []string) {
 		go deadlockDetectorMain(ctx, state.deadlock_detectorch, &state.wg)
 	}
 
-	// TODO: watch instead of polling
+	// Masters are watched so that failover reaches foreign servers without
+	// waiting for the next poll; polling stays for the rest and in case
+	// watch is broken.
 	reloadStoreTimerCh := time.NewTimer(0).C
 	hl.Infof("shardman-montitor started")
 	for {
@@ -160,9 +183,71 @@ func shmon(c *cobra.Command, args []string) {
 
 		case <-reloadStoreTimerCh:
 			reloadStore(&state)
-			reloadStoreTimerCh = time.NewTimer(5 * time.Second).C
+			reloadStoreTimerCh = time.NewTimer(reloadStoreInterval).C
+
+		case <-state.storeEvents:
+			reloadStoreTimerCh = time.NewTimer(storeEventReloadDelay).C
+
+		case gen := <-state.watchFailed:
+			// will be restarted on next reload
+			if gen == state.watchGen {
+				stopStoreWatch(&state)
+			}
+		}
+	}
+}
+
+// (Re)start watching keys, unless we already watch exactly them
+func updateStoreWatch(state *shMonState, keys []string) {
+	if state.watchCancel != nil && len(keys) == len(state.watchKeys) {
+		var same = true
+		for i := range keys {
+			if keys[i] != state.watchKeys[i] {
+				same = false
+				break
+			}
+		}
+		if same {
+			return
 		}
 	}
+	stopStoreWatch(state)
+	wctx, cancel := context.WithCancel(clientv3.WithRequireLeader(state.ctx))
+	cli := state.cs.Store.GetClient()
+	state.watchGen++
+	for _, key := range keys {
+		go storeWatcher(wctx, cli.Watch(wctx, key), state.watchGen, state.storeEvents, state.watchFailed)
+	}
+	state.watchKeys = keys
+	state.watchCancel = cancel
+}
+
+func stopStoreWatch(state *shMonState) {
+	if state.watchCancel != nil {
+		state.watchCancel()
+		state.watchCancel = nil
+		state.watchKeys = nil
+	}
+}
+
+// Forward notifications of single watch to main, squashing them
+func storeWatcher(ctx context.Context, watchCh clientv3.WatchChan, gen int, events chan<- struct{}, failed chan<- int) {
+	for wresp := range watchCh {
+		if wresp.Canceled {
+			// etcd unrecoverable error, hmm
+			hl.Errorf("store (watch) failed: %v", wresp.Err())
+			break
+		}
+		select {
+		case events <- struct{}{}:
+		default: // reload is already pending
+		}
+	}
+	// chan is closed either because of error or because we were stopped
+	select {
+	case failed <- gen:
+	case <-ctx.Done():
+	}
 }
 
 func sigHandler(sigs chan os.Signal, cancel context.CancelFunc) {
@@ -196,6 +281,7 @@ func reloadStore(state *shMonState) {
 		hl.Errorf("Failed to get repgroups: %v", err)
 		goto StoreError
 	}
+	updateStoreWatch(state, state.cs.MastersWatchKeys(rgs))
 	// shut down workers for removed repgroups
 	for rgid, in := range state.workers {
 		if _, ok := rgs[rgid]; !ok {
@@ -219,7 +305,13 @@ func reloadStore(state *shMonState) {
 			hl.Errorf("Failed to get connstr for rgid %d: %v", rgid, err)
 			return
 		}
-		clstate.rgs[rgid] = &repGroupState{connstrmap: connstrmap, sysId: rg.SysId}
+		standbys, err := state.cs.GetStandbys(state.ctx, rg)
+		if err != nil {
+			hl.Errorf("Failed to get standbys for rgid %d: %v", rgid, err)
+			return
+		}
+		clstate.rgs[rgid] = &repGroupState{connstrmap: connstrmap, sysId: rg.SysId,
+			standbys: standbys}
 	}
 
 	// Send current state to all workers. They must not scribble on it.
@@ -235,6 +327,7 @@ func reloadStore(state *shMonState) {
 
 	return
 StoreError:
+	stopStoreWatch(state)
 	state.cs.Close()
 	state.cs = nil
 	return
@@ -318,72 +411,71 @@ func monWorkerFull(w *monWorker) {
 			return
 		}
 	}
-	for rgid, rg := range w.clstate.rgs {
-		if rgid == w.rgid {
-			continue
-		}
-		connstrmap := rg.connstrmap
-
-		// foreign server
-		var fs_exists bool
-		err = w.conn.QueryRow(fmt.Sprintf(
-			"select exists (select 1 from pg_foreign_server where srvname = 'hp_rg_%d')",
-			rgid)).Scan(&fs_exists)
-		if err != nil {
-			w.Warnf("failed to check fs existence: %v", err)
-			goto ConnError
-		}
-		if !fs_exists {
-			/* should never happen */
-			w.Errorf("foreign server for rgid %d doesn't exist", rgid)
-			goto ConnError
-		}
-		rows, err := w.conn.Query(fmt.Sprintf(
-			"select split_part(opt, '=', 1) k, split_part(opt, '=', 2) v from (select unnest(srvoptions) opt from pg_foreign_server where srvname = 'hp_rg_%d') o;",
-			rgid))
+	{
+		// current options of all foreign servers, in one query
+		var srvopts = make(map[string]map[string]string)
+		rows, err := w.conn.Query(
+			`select srvname, coalesce(srvoptions, '{}') from pg_foreign_server where srvname like 'hp\_rg\_%'`)
 		if err != nil {
 			w.Warnf("failed to retrieve fserver info: %v", err)
 			goto ConnError
 		}
-		var currfsoptsmap = make(map[string]string)
-		var key, value, currfsopts, newfsopts string
 		for rows.Next() {
-			err = rows.Scan(&key, &value)
+			var srvname string
+			var opts []string
+			err = rows.Scan(&srvname, &opts)
 			if err != nil {
 				// xxx panic?
 				w.Errorf("%v", err)
+				rows.Close()
 				goto ConnError
 			}
-			currfsoptsmap[key] = value
+			var optsmap = make(map[string]string)
+			for _, opt := range opts {
+				kv := strings.SplitN(opt, "=", 2)
+				if len(kv) == 2 {
+					optsmap[kv[0]] = kv[1]
+				}
+			}
+			srvopts[srvname] = optsmap
 		}
 		if rows.Err() != nil {
 			w.Errorf("%v", rows.Err())
 			goto ConnError
 		}
-		newfsopts, _ = pg.FormForeignServerOpts(connstrmap)
-		currfsopts, err = pg.FormForeignServerOpts(currfsoptsmap)
-		if err != nil || currfsopts != newfsopts {
-			/*
-			 * Need to update foreign server. We would like to avoid
-			 * recreating it to stay away from rebuilding foreign
-			 * tables and user mappings.
-			 */
-			w.Infof("altering foreign server to rg %d", rgid)
-			/* drop all currents opts */
-			for optname, _ := range currfsoptsmap {
-				_, err = w.conn.Exec(fmt.Sprintf(
-					"alter server hp_rg_%d options (drop %s)",
-					rgid, optname))
-				if err != nil {
-					w.Warnf("failed to drop fs opts: %v", err)
-					goto ConnError
-				}
+
+		/*
+		 * Update foreign servers where needed. We would like to avoid
+		 * recreating them to stay away from rebuilding foreign tables
+		 * and user mappings.
+		 */
+		var alters []string
+		for rgid, rg := range w.clstate.rgs {
+			if rgid == w.rgid {
+				continue
+			}
+			currfsopts, ok := srvopts[pg.FSI(rgid)]
+			if !ok {
+				/* should never happen */
+				w.Errorf("foreign server for rgid %d doesn't exist", rgid)
+				goto ConnError
 			}
-			/* add all new opts */
-			_, err = w.conn.Exec(fmt.Sprintf(
-				"alter server hp_rg_%d %s", rgid, newfsopts))
+			newfsopts, err := pg.ForeignServerOpts(rg.connstrmap)
 			if err != nil {
-				w.Warnf("failed to set new fs opts: %v", err)
+				w.Errorf("wrong connstr of rg %d: %v", rgid, err)
+				continue
+			}
+			newfsopts["standby_hosts"] = pg.StandbyHostsOpt(rg.standbys)
+			if alter := pg.FormAlterForeignServer(pg.FSI(rgid), currfsopts, newfsopts); alter != "" {
+				w.Infof("altering foreign server to rg %d", rgid)
+				alters = append(alters, alter)
+			}
+		}
+		if len(alters) != 0 {
+			_, err = w.conn.Exec(fmt.Sprintf("begin; %s; commit",
+				strings.Join(alters, "; ")))
+			if err != nil {
+				w.Warnf("failed to alter foreign servers: %v", err)
 				goto ConnError
 			}
 		}
@@ -401,13 +493,15 @@ ConnError:
 	w.retryTimer = time.NewTimer(retryConnInterval)
 }
 
+// prepares found at requester
 type xResolveRequest struct {
 	requester int // requester rgid
-	gid       string
+	gids      []string
 }
 
+// xacts to check at their coordinator
 type xStatusRequest struct {
-	gid string
+	gids []string
 }
 
 const (
@@ -418,14 +512,18 @@ const (
 	xStatusFailedToCheck
 )
 
-type xStatusResponse struct {
+type xStatus struct {
 	gid     string
 	xStatus int
 }
 
+type xStatusResponse struct {
+	statuses []xStatus
+}
+
+// only committed and aborted xacts reach requesters
 type xResolveResponse struct {
-	gid     string
-	xStatus int
+	outcomes []xStatus
 }
 
 type xactResolverState struct {
@@ -444,6 +542,11 @@ const retryBcstClstateInterval = 1 * time.Second
 // status. If it is unavailable, wait until Stolon restores it.
 // To save some trees, we try to keep connections persistent. Each rg is served
 // by its own goroutine, and main goroutine coordinates them.
+// After failover there might be lots of orphaned prepares, so everything is
+// done in batches: worker reports all its prepares at once, main asks each
+// coordinator about all its xacts in one message (and worker checks them in
+// one query), and outcomes are sent back to each requester in one message
+// and finished there one by one.
 // Bidirectional communication is subject to deadlocks. To avoid them,
 // -- main goroutine *never* blocks: before sending something, it makes sure
 //    there is a slot in the chan (it is safe since nobody but it writes to worker
@@ -465,7 +568,6 @@ func xactResolverMain(ctx context.Context, clstatechan chan clusterState, wg *sy
 	<-state.retryBcstClstateTimer.C
 	xrmLog.Infof("starting")
 
-MainLoop:
 	for {
 		select {
 		case <-ctx.Done():
@@ -502,62 +604,86 @@ MainLoop:
 		case msg := <-state.in:
 			switch msg := msg.(type) {
 			case xResolveRequest:
-				if requesters, ok := state.resolve_requests[msg.gid]; ok {
-					// we already know about that request
-					// and sent the inquiry; just remember
-					// that this rgid is also interested in
-					// result, if not yet
-					for _, r := range requesters {
-						if r == msg.requester {
-							continue MainLoop
+				// gids we haven't yet inquired, by coordinator rgid
+				var inquiries = make(map[int][]string)
+				for _, gid := range msg.gids {
+					if requesters, ok := state.resolve_requests[gid]; ok {
+						// we already know about that request
+						// and sent the inquiry; just remember
+						// that this rgid is also interested in
+						// result, if not yet
+						var known = false
+						for _, r := range requesters {
+							if r == msg.requester {
+								known = true
+								break
+							}
+						}
+						if !known {
+							state.resolve_requests[gid] = append(requesters, msg.requester)
 						}
+						continue
 					}
-					state.resolve_requests[msg.gid] = append(requesters, msg.requester)
-					continue
-				}
-				// ok, try to inquiry this
-				gid_splitted := strings.Split(msg.gid, ":")
-				if len(gid_splitted) < 7 {
-					xrmLog.Debugf("format of gid %v from rg %d is wrong, ignoring it", msg.gid, msg.requester)
-					continue
-				}
-				coord_sysid, err := strconv.ParseInt(gid_splitted[2], 10, 64)
-				if err != nil {
-					xrmLog.Warnf("couldn't parse sysid of gid %v, ignoring it", msg.gid)
-					continue
+					// ok, try to inquiry this
+					gid_splitted := strings.Split(gid, ":")
+					if len(gid_splitted) < 7 {
+						xrmLog.Debugf("format of gid %v from rg %d is wrong, ignoring it", gid, msg.requester)
+						continue
+					}
+					coord_sysid, err := strconv.ParseInt(gid_splitted[2], 10, 64)
+					if err != nil {
+						xrmLog.Warnf("couldn't parse sysid of gid %v, ignoring it", gid)
+						continue
+					}
+					var coord_rgid = -1
+					for rgid, rg := range state.clstate.rgs {
+						if rg.sysId == coord_sysid {
+							coord_rgid = rgid
+							break
+						}
+					}
+					if coord_rgid == -1 {
+						xrmLog.Errorf("failed to resolve %s xact from repgroup %d: there is no rg with coordinator sysid %d in the cluster",
+							gid, msg.requester, coord_sysid)
+						continue
+					}
+					inquiries[coord_rgid] = append(inquiries[coord_rgid], gid)
 				}
-				for rgid, rg := range state.clstate.rgs {
-					if rg.sysId == coord_sysid {
-						// found the coordinator
-						ch := state.xrworkers[rgid]
-						if len(ch) < xactResolverWorkerChanBuf {
-							ch <- xStatusRequest{gid: msg.gid}
-							// remember who was asking
-							state.resolve_requests[msg.gid] = []int{msg.requester}
+				for coord_rgid, gids := range inquiries {
+					ch := state.xrworkers[coord_rgid]
+					if len(ch) < xactResolverWorkerChanBuf {
+						ch <- xStatusRequest{gids: gids}
+						// remember who was asking
+						for _, gid := range gids {
+							state.resolve_requests[gid] = []int{msg.requester}
 						}
-						continue MainLoop
 					}
 				}
-				xrmLog.Errorf("failed to resolve %s xact from repgroup %d: there is no rg with coordinator sysid %d in the cluster",
-					msg.gid, msg.requester, coord_sysid)
 
 			case xStatusResponse:
-				xrmLog.Debugf("status of xact %v is %v", msg.gid, msg.xStatus)
-				if msg.xStatus == xStatusUnknown {
-					xrmLog.Errorf("xact %s is too old to resolve it (status on coordinator is unknown)", msg.gid)
+				// useful outcomes by requester rgid
+				var outcomes = make(map[int][]xStatus)
+				for _, st := range msg.statuses {
+					xrmLog.Debugf("status of xact %v is %v", st.gid, st.xStatus)
+					if st.xStatus == xStatusUnknown {
+						xrmLog.Errorf("xact %s is too old to resolve it (status on coordinator is unknown)", st.gid)
+					}
+					if st.xStatus == xStatusCommitted ||
+						st.xStatus == xStatusAborted {
+						for _, requester := range state.resolve_requests[st.gid] {
+							outcomes[requester] = append(outcomes[requester], st)
+						}
+					}
+					delete(state.resolve_requests, st.gid)
 				}
-				if msg.xStatus == xStatusCommitted ||
-					msg.xStatus == xStatusAborted {
-					for _, requester := range state.resolve_requests[msg.gid] {
-						// unlikely, but requester might be gone
-						if ch, ok := state.xrworkers[requester]; ok {
-							if len(ch) < xactResolverWorkerChanBuf {
-								ch <- xResolveResponse{gid: msg.gid, xStatus: msg.xStatus}
-							}
+				for requester, o := range outcomes {
+					// unlikely, but requester might be gone
+					if ch, ok := state.xrworkers[requester]; ok {
+						if len(ch) < xactResolverWorkerChanBuf {
+							ch <- xResolveResponse{outcomes: o}
 						}
 					}
 				}
-				delete(state.resolve_requests, msg.gid)
 			}
 		}
 	}
@@ -646,62 +772,14 @@ func xactResolverWorkerMain(ctx context.Context, rgid int, in <-chan interface{}
 				connstr = newconnstr
 
 			case xStatusRequest:
-				if conn == nil {
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusFailedToCheck}
-					continue
-				}
-				gid_splitted := strings.Split(msg.gid, ":")
-				if len(gid_splitted) < 7 {
-					xrwLog.Warnf("format of gid %v is wrong, ignoring it", msg.gid)
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusFailedToCheck}
-					continue
-				}
-				xid := gid_splitted[4]
-				var statusp *string
-				err := conn.QueryRow(fmt.Sprintf(
-					"select txid_status(%s)", xid)).Scan(&statusp)
-				if err != nil {
-					xrwLog.Errorf("failed to check xact %s (xid %s) status: %v", msg.gid, xid, err)
-					xrwConnfail(&conn, &retryConnTimer)
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusFailedToCheck}
-					continue
-				}
-				if statusp == nil {
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusUnknown}
-				} else if *statusp == "committed" {
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusCommitted}
-				} else if *statusp == "aborted" {
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusAborted}
-				} else {
-					if *statusp != "in progress" {
-						panic(fmt.Sprintf("wrong xact status: %v", *statusp))
-					}
-					out <- xStatusResponse{gid: msg.gid, xStatus: xStatusInProgress}
-				}
+				out <- xStatusResponse{statuses: xrwCheckStatuses(xrwLog, &conn, &retryConnTimer, msg.gids)}
 
 			case xResolveResponse:
 				if conn == nil {
 					// conn not ready, handle it later, drop for now
 					continue
 				}
-				if msg.xStatus != xStatusCommitted && msg.xStatus != xStatusAborted {
-					panic(fmt.Sprintf("only useful outcomes must reach xr worker, got %v for %v",
-						msg.xStatus, msg.gid))
-				}
-				var action string
-				if msg.xStatus == xStatusCommitted {
-					action = "commit"
-				} else {
-					action = "rollback"
-				}
-				_, err := conn.Exec(fmt.Sprintf("%s prepared %s",
-					action, pg.QL(msg.gid)))
-				if err != nil {
-					xrwLog.Errorf("failed to finish (%v) xact %v: %v",
-						action, msg.gid, err)
-					// it might be not conn error, but simpler to reconnect anyway
-					xrwConnfail(&conn, &retryConnTimer)
-				}
+				xrwFinishPrepares(xrwLog, &conn, &retryConnTimer, msg.outcomes)
 			}
 
 		// TODO: get notified about new prepares via NOTIFY?
@@ -711,6 +789,7 @@ func xactResolverWorkerMain(ctx context.Context, rgid int, in <-chan interface{}
 				continue
 			}
 			var gid string
+			var gids []string
 			rows, err := conn.Query(fmt.Sprintf(
 				"select gid from pg_prepared_xacts where extract(epoch from (current_timestamp - prepared))::int >= %d",
 				resolvePrepareTimeout))
@@ -724,12 +803,15 @@ func xactResolverWorkerMain(ctx context.Context, rgid int, in <-chan interface{}
 					xrwLog.Errorf("%v", err)
 					goto CheckPreparesErr // xxx should be panic actually?
 				}
-				out <- xResolveRequest{requester: rgid, gid: gid}
+				gids = append(gids, gid)
 			}
 			if rows.Err() != nil {
-				xrwLog.Errorf("%v", err)
+				xrwLog.Errorf("%v", rows.Err())
 				goto CheckPreparesErr // xxx should be panic actually?
 			}
+			if len(gids) != 0 {
+				out <- xResolveRequest{requester: rgid, gids: gids}
+			}
 			continue
 		CheckPreparesErr:
 			xrwConnfail(&conn, &retryConnTimer)
@@ -737,6 +819,104 @@ func xactResolverWorkerMain(ctx context.Context, rgid int, in <-chan interface{}
 	}
 }
 
+// Get status of xacts coordinated by this rg with a single query
+func xrwCheckStatuses(xrwLog *zap.SugaredLogger, connp **pgx.Conn, retryConnTimerp **time.Timer, gids []string) []xStatus {
+	var statuses = make([]xStatus, 0, len(gids))
+	var valid_gids = make([]string, 0, len(gids))
+	for _, gid := range gids {
+		gid_splitted := strings.Split(gid, ":")
+		if len(gid_splitted) < 7 {
+			xrwLog.Warnf("format of gid %v is wrong, ignoring it", gid)
+			statuses = append(statuses, xStatus{gid: gid, xStatus: xStatusFailedToCheck})
+			continue
+		}
+		if _, err := strconv.ParseUint(gid_splitted[4], 10, 64); err != nil {
+			xrwLog.Warnf("couldn't parse xid of gid %v, ignoring it", gid)
+			statuses = append(statuses, xStatus{gid: gid, xStatus: xStatusFailedToCheck})
+			continue
+		}
+		valid_gids = append(valid_gids, gid)
+	}
+	if len(valid_gids) == 0 {
+		return statuses
+	}
+	var failAll = func() []xStatus {
+		for _, gid := range valid_gids {
+			statuses = append(statuses, xStatus{gid: gid, xStatus: xStatusFailedToCheck})
+		}
+		return statuses
+	}
+	if *connp == nil {
+		return failAll()
+	}
+
+	rows, err := (*connp).Query(
+		"select gid, txid_status(split_part(gid, ':', 5)::bigint) from unnest($1::text[]) gid",
+		valid_gids)
+	if err != nil {
+		xrwLog.Errorf("failed to check status of %d xacts: %v", len(valid_gids), err)
+		xrwConnfail(connp, retryConnTimerp)
+		return failAll()
+	}
+	var checked = make([]xStatus, 0, len(valid_gids))
+	for rows.Next() {
+		var gid string
+		var statusp *string
+		if err = rows.Scan(&gid, &statusp); err != nil {
+			break
+		}
+		if statusp == nil {
+			checked = append(checked, xStatus{gid: gid, xStatus: xStatusUnknown})
+		} else if *statusp == "committed" {
+			checked = append(checked, xStatus{gid: gid, xStatus: xStatusCommitted})
+		} else if *statusp == "aborted" {
+			checked = append(checked, xStatus{gid: gid, xStatus: xStatusAborted})
+		} else {
+			if *statusp != "in progress" {
+				panic(fmt.Sprintf("wrong xact status: %v", *statusp))
+			}
+			checked = append(checked, xStatus{gid: gid, xStatus: xStatusInProgress})
+		}
+	}
+	if err == nil {
+		err = rows.Err()
+	}
+	if err != nil {
+		rows.Close()
+		xrwLog.Errorf("failed to check status of %d xacts: %v", len(valid_gids), err)
+		xrwConnfail(connp, retryConnTimerp)
+		return failAll()
+	}
+	return append(statuses, checked...)
+}
+
+// Finish prepares according to their outcomes, one COMMIT/ROLLBACK PREPARED
+// at a time: they can't run inside xact block, so neither pgx batch (wrapped
+// in BEGIN/COMMIT) nor multi-statement query would do. After first failure
+// the rest is left until the next check of prepares.
+func xrwFinishPrepares(xrwLog *zap.SugaredLogger, connp **pgx.Conn, retryConnTimerp **time.Timer, outcomes []xStatus) {
+	for _, o := range outcomes {
+		var action string
+		if o.xStatus == xStatusCommitted {
+			action = "commit"
+		} else if o.xStatus == xStatusAborted {
+			action = "rollback"
+		} else {
+			panic(fmt.Sprintf("only useful outcomes must reach xr worker, got %v for %v",
+				o.xStatus, o.gid))
+		}
+		_, err := (*connp).Exec(fmt.Sprintf("%s prepared %s",
+			action, pg.QL(o.gid)))
+		if err != nil {
+			xrwLog.Errorf("failed to finish (%v) xact %v: %v",
+				action, o.gid, err)
+			// it might be not conn error, but simpler to reconnect anyway
+			xrwConnfail(connp, retryConnTimerp)
+			return
+		}
+	}
+}
+
 func xrwConnfail(connp **pgx.Conn, retryConnTimerp **time.Timer) {
 	(*connp).Close()
 	*connp = nil
@@ -760,6 +940,8 @@ type localLockGraph struct {
 	rgid  int
 	err   error
 	edges []edge
+	// edges are the same as in previous successful collection, not sent
+	unchanged bool
 }
 type cancelBackend struct {
 	pid int
@@ -815,6 +997,10 @@ func pprintDeadlock(deadlock []proc, rgs map[int]*repGroupState) string {
 // Because we can not make consistent distributed snapshot, collected global
 // local graph can contain "false" loops.  So we report deadlock only if
 // detected loop persists during deadlock detection period.
+// Nodes report only lock waits older than half of the period (the rest can't
+// be a part of persistent loop anyway), and workers tell when their part of
+// the graph hasn't changed since the previous collection, in which case we
+// don't rebuild the graph and search for loops again.
 func deadlockDetectorMain(ctx context.Context, clstatechan chan clusterState, wg *sync.WaitGroup) {
 	defer wg.Done()
 	ddLog := hl.With("goroutine", "deadlock detector")
@@ -826,6 +1012,11 @@ func deadlockDetectorMain(ctx context.Context, clstatechan chan clusterState, wg
 	var clstate clusterState
 	var ddWg sync.WaitGroup
 	var previousDeadlock []proc = nil
+	// last collected edges of each repgroup
+	var rgEdges = make(map[int][]edge)
+	// does deadlock, found in graph from rgEdges, need recalculation?
+	var graphChanged = true
+	var deadlock []proc = nil
 
 	ddLog.Infof("starting")
 
@@ -846,6 +1037,8 @@ func deadlockDetectorMain(ctx context.Context, clstatechan chan clusterState, wg
 					previousDeadlock = nil
 					close(ch)
 					delete(ddworkers, rgid)
+					delete(rgEdges, rgid)
+					graphChanged = true
 				}
 			}
 			// spin up workers for new repgroups
@@ -862,27 +1055,20 @@ func deadlockDetectorMain(ctx context.Context, clstatechan chan clusterState, wg
 				ch <- collectGraph{}
 			}
 			var fail = false
-			// for each vertex, all outbound edges
-			var lockGraph = make(map[proc][]proc)
 			for i := 0; i < len(ddworkers); i++ {
 				llg := (<-in).(localLockGraph)
 				if llg.err != nil {
 					ddLog.Warnf("failed to collect lock graph at repgroup %d: %v", llg.rgid, llg.err)
+					delete(rgEdges, llg.rgid)
+					graphChanged = true
 					fail = true
 					continue
 				}
-				for _, e := range llg.edges {
-					if _, ok := lockGraph[e.wait]; !ok {
-						lockGraph[e.wait] = []proc{e.hold}
-					} else {
-						lockGraph[e.wait] = append(lockGraph[e.wait], e.hold)
-					}
-					// *all* procs must be in lockGraph, even if
-					// they don't wait for anything themselves
-					if _, ok := lockGraph[e.hold]; !ok {
-						lockGraph[e.hold] = []proc{}
-					}
+				if _, ok := rgEdges[llg.rgid]; ok && llg.unchanged {
+					continue
 				}
+				rgEdges[llg.rgid] = llg.edges
+				graphChanged = true
 				// ddLog.Debugf("collected lg from %d:\n%v", llg.rgid, pprintEdges(llg.edges, clstate.rgs))
 			}
 			if fail {
@@ -890,8 +1076,23 @@ func deadlockDetectorMain(ctx context.Context, clstatechan chan clusterState, wg
 				previousDeadlock = nil
 				continue
 			}
-			// ddLog.Debugf("full graph is\n%v", pprintLockGraph(lockGraph, clstate.rgs))
-			deadlock := findDeadlock(lockGraph)
+			if graphChanged {
+				// for each vertex, all outbound edges
+				var lockGraph = make(map[proc][]proc)
+				for _, edges := range rgEdges {
+					for _, e := range edges {
+						lockGraph[e.wait] = append(lockGraph[e.wait], e.hold)
+						// *all* procs must be in lockGraph, even if
+						// they don't wait for anything themselves
+						if _, ok := lockGraph[e.hold]; !ok {
+							lockGraph[e.hold] = []proc{}
+						}
+					}
+				}
+				// ddLog.Debugf("full graph is\n%v", pprintLockGraph(lockGraph, clstate.rgs))
+				deadlock = findDeadlock(lockGraph)
+				graphChanged = false
+			}
 			if deadlock != nil {
 				ddLog.Debugf("found deadlock!\n  %v\n", pprintDeadlock(deadlock, clstate.rgs))
 				ddLog.Debugf("prev deadlock:\n  %v\n", pprintDeadlock(previousDeadlock, clstate.rgs))
@@ -930,6 +1131,10 @@ func deadlockDetectorMain(ctx context.Context, clstatechan chan clusterState, wg
 func deadlockDetectorWorker(rgid int, in <-chan interface{}, out chan<- interface{}, clstate clusterState, wg *sync.WaitGroup) {
 	var conn *pgx.Conn = nil
 	var connstr string = pg.ConnString(clstate.rgs[rgid].connstrmap)
+	// edges sent last time, sorted; nil if there was no successful collection
+	// on current conn
+	var prevEdges []edge = nil
+	var minWaitMs = checkDeadlockInterval.Nanoseconds() / int64(time.Millisecond) / 2
 
 	for {
 		msg, ok := <-in
@@ -948,6 +1153,7 @@ func deadlockDetectorWorker(rgid int, in <-chan interface{}, out chan<- interfac
 			if conn != nil && newconnstr != connstr {
 				conn.Close()
 				conn = nil
+				prevEdges = nil
 			}
 
 		case collectGraph:
@@ -966,7 +1172,7 @@ func deadlockDetectorWorker(rgid int, in <-chan interface{}, out chan<- interfac
 			var err error
 			var rows *pgx.Rows
 			var edges = make([]edge, 0, 128)
-			rows, err = conn.Query("select * from shardman.lock_graph_native_types")
+			rows, err = conn.Query("select * from shardman.lock_graph_edges($1)", minWaitMs)
 			if err != nil {
 				goto ConnError
 			}
@@ -979,13 +1185,21 @@ func deadlockDetectorWorker(rgid int, in <-chan interface{}, out chan<- interfac
 				edges = append(edges, e)
 			}
 			if rows.Err() != nil {
+				err = rows.Err()
 				goto ConnError
 			}
+			sortEdges(edges)
+			if prevEdges != nil && edgesEqual(edges, prevEdges) {
+				out <- localLockGraph{rgid: rgid, err: nil, unchanged: true}
+				continue
+			}
+			prevEdges = edges
 			out <- localLockGraph{rgid: rgid, err: nil, edges: edges}
 			continue
 		ConnError:
 			conn.Close()
 			conn = nil
+			prevEdges = nil
 			out <- localLockGraph{rgid: rgid, err: err}
 
 		case cancelBackend:
@@ -997,42 +1211,91 @@ func deadlockDetectorWorker(rgid int, in <-chan interface{}, out chan<- interfac
 			if err != nil {
 				conn.Close()
 				conn = nil
+				prevEdges = nil
 			}
 			out <- cancelBackendResponse{res: res, err: err}
 		}
 	}
 }
 
-// wrapper of []proc for findDeadlock to remember visited vertices
-type vertex struct {
-	e       []proc // outbound edges
-	visited bool
-	// set to true when we have checked all paths from vertex and ensured
-	// there is no loop
-	no_deadlocks bool
+func procLess(p1 proc, p2 proc) bool {
+	return p1.sysid < p2.sysid || (p1.sysid == p2.sysid && p1.pid < p2.pid)
+}
+
+func sortEdges(edges []edge) {
+	sort.Slice(edges, func(i, j int) bool {
+		if edges[i].wait != edges[j].wait {
+			return procLess(edges[i].wait, edges[j].wait)
+		}
+		return procLess(edges[i].hold, edges[j].hold)
+	})
 }
 
-// Actually find the loop. Returns nil if it doesn't exist, random one otherwise.
+func edgesEqual(e1 []edge, e2 []edge) bool {
+	if len(e1) != len(e2) {
+		return false
+	}
+	for i := range e1 {
+		if e1[i] != e2[i] {
+			return false
+		}
+	}
+	return true
+}
+
+// State of Tarjan's strongly connected components search. Vertices are
+// numbered; adj[v] are outbound edges of v.
+type sccSearch struct {
+	adj     [][]int
+	index   []int // dfs visit order, -1 if not visited yet
+	lowlink []int
+	onStack []bool
+	stack   []int
+	counter int
+}
+
+// Actually find the loop. Returns nil if it doesn't exist, some one
+// otherwise. The loop is returned without the doubled vertex: link
+// deadlock[len(deadlock) - 1] -> deadlock[0] is assumed.
+// Any strongly connected component of more than one vertex contains a loop;
+// we find one with Tarjan algorithm and walk the loop inside it, both in
+// linear time. Self-loops are ignored, waiting for yourself is lock upgrade
+// and not a deadlock. Vertices are numbered in sorted order, so the same
+// graph gives the same loop and persisting deadlock is recognized by
+// deadlocksEquivalent.
 func findDeadlock(lockGraph map[proc][]proc) []proc {
-	// wrap []proc edges into struct vertex to remember visited vertices
-	var lockGraphV = make(map[proc]*vertex)
-	for p, edges := range lockGraph {
-		lockGraphV[p] = &vertex{e: edges, visited: false, no_deadlocks: false}
+	var procs = make([]proc, 0, len(lockGraph))
+	for p, _ := range lockGraph {
+		procs = append(procs, p)
 	}
-	// For each vertice v, start dfs from v looking for deadlocks
-	for p, _ := range lockGraphV {
-		deadlock := findDeadlockWorkhorse(lockGraphV, nil, p)
-		if deadlock != nil {
-			// Returned path might contain not only the loop itself,
-			// but also initial tail. Trim it here. We also cut copy
-			// of doubled vertex, it is *not* included in the
-			// final res: deadlock[len(deadlock) - 1] -> deadlock[0]
-			// link is assumed.
-			var deadlock_member proc = deadlock[len(deadlock)-1]
-			for i, p := range deadlock {
-				if p == deadlock_member {
-					return deadlock[i : len(deadlock)-1]
-				}
+	sort.Slice(procs, func(i, j int) bool { return procLess(procs[i], procs[j]) })
+	var num = make(map[proc]int, len(procs))
+	for i, p := range procs {
+		num[p] = i
+	}
+	var s = sccSearch{
+		adj:     make([][]int, len(procs)),
+		index:   make([]int, len(procs)),
+		lowlink: make([]int, len(procs)),
+		onStack: make([]bool, len(procs)),
+	}
+	for i, p := range procs {
+		for _, child := range lockGraph[p] {
+			if child != p {
+				s.adj[i] = append(s.adj[i], num[child])
+			}
+		}
+		s.index[i] = -1
+	}
+
+	for v := range procs {
+		if s.index[v] != -1 {
+			continue
+		}
+		if scc := s.strongConnect(v); scc != nil {
+			var deadlock []proc
+			for _, v := range loopInComponent(s.adj, scc) {
+				deadlock = append(deadlock, procs[v])
 			}
 			return deadlock
 		}
@@ -1040,36 +1303,85 @@ func findDeadlock(lockGraph map[proc][]proc) []proc {
 	return nil
 }
 
-// one step: with 'path' passed, visit p and its childs. If deadlock if found,
-// returns it; the last vertex closures the loop. Otherwise returns nil.
-func findDeadlockWorkhorse(lockGraph map[proc]*vertex, path []proc, p proc) []proc {
-	var vp *vertex = lockGraph[p]
-	// return immediatly, if we have checked p before
-	if vp.no_deadlocks {
-		return nil
+// Tarjan's dfs step from v. Returns first found component of more than one
+// vertex, nil if there is none reachable from v.
+func (s *sccSearch) strongConnect(v int) []int {
+	s.index[v] = s.counter
+	s.lowlink[v] = s.counter
+	s.counter++
+	s.stack = append(s.stack, v)
+	s.onStack[v] = true
+
+	for _, w := range s.adj[v] {
+		if s.index[w] == -1 {
+			if scc := s.strongConnect(w); scc != nil {
+				return scc
+			}
+			if s.lowlink[w] < s.lowlink[v] {
+				s.lowlink[v] = s.lowlink[w]
+			}
+		} else if s.onStack[w] && s.index[w] < s.lowlink[v] {
+			s.lowlink[v] = s.index[w]
+		}
 	}
-	path = append(path, p)
-	if vp.visited {
-		return path // found!
+
+	if s.lowlink[v] != s.index[v] {
+		return nil // v is not the root of its component
 	}
-	// ok, mark that we were here
-	vp.visited = true
-	// and let's go deeper
-	for _, child := range vp.e {
-		deadlock := findDeadlockWorkhorse(lockGraph, path, child)
-		if deadlock != nil {
-			return deadlock
-		}
+	// pop the component
+	var i = len(s.stack) - 1
+	for s.stack[i] != v {
+		i--
+	}
+	var scc = s.stack[i:]
+	s.stack = s.stack[:i]
+	for _, w := range scc {
+		s.onStack[w] = false
+	}
+	if len(scc) > 1 {
+		return scc
 	}
-	// not found; remember there is nothing to do here
-	vp.no_deadlocks = true
-	// And note that this vertex is not in path anymore. Actually, this is not
-	// necessary as we use 'no_deadlocks' optimization: if already seen vertex
-	// doesn't belong to any loop, we ping back from it immediately
-	vp.visited = false
 	return nil
 }
 
+// Walk loop inside strongly connected component: dfs from its smallest
+// vertex, not leaving the component, until we come back to it.
+func loopInComponent(adj [][]int, scc []int) []int {
+	var inScc = make(map[int]bool, len(scc))
+	var start = scc[0]
+	for _, v := range scc {
+		inScc[v] = true
+		if v < start {
+			start = v
+		}
+	}
+	var visited = make(map[int]bool, len(scc))
+	// path from start and position of next edge to try for each vertex on it
+	var path = []int{start}
+	var edgePos = []int{0}
+	visited[start] = true
+	for len(path) != 0 {
+		var top = len(path) - 1
+		var v = path[top]
+		if edgePos[top] == len(adj[v]) {
+			// dead end
+			path, edgePos = path[:top], edgePos[:top]
+			continue
+		}
+		var w = adj[v][edgePos[top]]
+		edgePos[top]++
+		if w == start {
+			return path
+		}
+		if inScc[w] && !visited[w] {
+			visited[w] = true
+			path = append(path, w)
+			edgePos = append(edgePos, 0)
+		}
+	}
+	return scc // unreachable: component is strongly connected
+}
+
 // deadlocks collected at different times might be shifted
 func deadlocksEquivalent(d1 []proc, d2 []proc) bool {
 	if len(d1) != len(d2) {
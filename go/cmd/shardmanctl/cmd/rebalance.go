@@ -13,15 +13,27 @@ import (
 )
 
 var parallelism int
+var copyStreams int
+var catchupThreshold int64
+var maxMovesPerRg int
 
 var rebCmd = &cobra.Command{
 	Use:   "rebalance",
 	Run:   rebalance,
-	Short: "Rebalance the data: moves partitions between replication groups until they are evenly distributed. Based on logical replication and performed mostly seamlessly in background; each partition will be only shortly locked in the end to finally sync the data.",
+	Short: "Rebalance the data: moves partitions between replication groups until data is evenly distributed. Based on logical replication and performed mostly seamlessly in background; each partition will be only shortly locked in the end to finally sync the data.",
 	PreRun: func(c *cobra.Command, args []string) {
 		if parallelism == 0 || parallelism < -1 {
 			hl.Fatalf("Wrong parallelism")
 		}
+		if maxMovesPerRg < 0 {
+			hl.Fatalf("Wrong max moves per repgroup")
+		}
+		if copyStreams < 1 {
+			hl.Fatalf("Wrong number of copy streams")
+		}
+		if catchupThreshold < 0 {
+			hl.Fatalf("Wrong catchup threshold")
+		}
 	},
 }
 
@@ -29,6 +41,9 @@ func init() {
 	rootCmd.AddCommand(rebCmd)
 
 	rebCmd.Flags().IntVarP(&parallelism, "parallelism", "p", 10, "How many partitions to move simultaneously. Moving partitions one-by-one (1) minimizes overhead on cluster operation; -1 means maximum parallelism, all parts are moved at the same time.")
+	rebCmd.Flags().IntVar(&maxMovesPerRg, "max-moves-per-rg", commands.DefaultMaxMovesPerRg, "How many partitions may be moved from or to the same replication group simultaneously, so that parallel moves are spread over the cluster instead of saturating one node. 0 means no limit.")
+	rebCmd.Flags().IntVarP(&copyStreams, "copy-streams", "c", commands.DefaultCopyStreams, "How many connections copy initial data of each partition in parallel. With 1, the copy is done by logical replication itself in a single stream.")
+	rebCmd.Flags().Int64Var(&catchupThreshold, "catchup-threshold", commands.DefaultCatchupThreshold, "Replication lag in bytes below which writes to the partition are blocked to finally sync it. Lower values shorten the write-blocked window at the cost of longer catchup.")
 }
 
 func rebalance(cmd *cobra.Command, args []string) {
@@ -49,20 +64,52 @@ func rebalance(cmd *cobra.Command, args []string) {
 		hl.Fatalf("Failed to get repgroups: %v", err)
 	}
 
-	var tasks = even_rebalance(tables, rgs)
-	if err = commands.Rebalance(ctx, hl, cs, parallelism, tasks); err != nil {
+	sizes, err := pg.GetPartSizes(ctx, cs)
+	if err != nil {
+		hl.Fatalf("Failed to get partition sizes: %v", err)
+	}
+
+	var tasks = even_rebalance(tables, rgs, sizes)
+	if err = commands.Rebalance(ctx, hl, cs, parallelism, maxMovesPerRg, copyStreams, catchupThreshold, tasks); err != nil {
 		hl.Fatalf("%v", err)
 	}
 }
 
+// Partition is weighed by its size plus one block, so empty partitions
+// (e.g. of a freshly created table) are still spread evenly by number
+const partBaseWeight = 8192
+
 // form slice of tasks giving even rebalance
-func even_rebalance(tables []cluster.Table, rgs map[int]*cluster.RepGroup) []commands.MoveTask {
+//
+// Each table is balanced separately, so that queries to it are spread over
+// the cluster. The unit of movement is partition together with the same
+// partitions of tables colocated with it; it is weighed by total size of
+// these. We move parts from the fattest repgroup to the leanest one while
+// it makes the difference between them smaller, each time choosing the part
+// which makes them closest to equal.
+func even_rebalance(tables []cluster.Table, rgs map[int]*cluster.RepGroup, sizes map[pg.PartKey]int64) []commands.MoveTask {
 	var tasks = make([]commands.MoveTask, 0)
 	for _, table := range tables {
 		if table.ColocateWithRelname != "" {
 			continue // colocated tables follow their references
 		}
+		var ctables = make([]cluster.Table, 0)
+		for _, ctable := range tables {
+			if ctable.ColocateWithSchema == table.Schema &&
+				ctable.ColocateWithRelname == table.Relname {
+				ctables = append(ctables, ctable)
+			}
+		}
+		var weights = make([]int64, table.Nparts)
+		for pnum := 0; pnum < table.Nparts; pnum++ {
+			weights[pnum] = partBaseWeight + sizes[pg.PartKey{table.Schema, table.Relname, pnum}]
+			for _, ctable := range ctables {
+				weights[pnum] += partBaseWeight + sizes[pg.PartKey{ctable.Schema, ctable.Relname, pnum}]
+			}
+		}
+
 		var parts_per_rg = make(map[int][]int)
+		var load = make(map[int]int64)
 		for rgid, _ := range rgs {
 			parts_per_rg[rgid] = make([]int, 0)
 		}
@@ -71,53 +118,71 @@ func even_rebalance(tables []cluster.Table, rgs map[int]*cluster.RepGroup) []com
 			rgid := table.Partmap[pnum]
 			if parts, ok := parts_per_rg[rgid]; ok {
 				parts_per_rg[rgid] = append(parts, pnum)
+				load[rgid] += weights[pnum]
 			} else {
 				hl.Fatalf("Metadata is broken: partholder %d is non-existing rgid", rgid)
 			}
 		}
 
-		for { // rebalance until ideal
+		// Rebalance until ideal. Each move strictly decreases the sum of
+		// squared loads, so this terminates.
+		for {
 			var leanest_rgid = -1
-			var leanest_rgid_parts int
 			var fattest_rgid = -1
-			var fattest_rgid_parts int
-			for rgid, parts := range parts_per_rg {
-				if leanest_rgid == -1 || len(parts) < leanest_rgid_parts {
-					leanest_rgid, leanest_rgid_parts = rgid, len(parts)
+			for rgid, _ := range parts_per_rg {
+				if leanest_rgid == -1 || load[rgid] < load[leanest_rgid] {
+					leanest_rgid = rgid
 				}
-				if fattest_rgid == -1 || len(parts) > fattest_rgid_parts {
-					fattest_rgid, fattest_rgid_parts = rgid, len(parts)
+				if fattest_rgid == -1 || load[rgid] > load[fattest_rgid] {
+					fattest_rgid = rgid
 				}
 			}
-			if fattest_rgid_parts-leanest_rgid_parts <= 1 {
+			// moving part of weight w helps iff w < diff; w = diff / 2 is ideal
+			var diff = load[fattest_rgid] - load[leanest_rgid]
+			var moved_idx = -1
+			var moved_dist int64
+			fattest_parts := parts_per_rg[fattest_rgid]
+			for idx, pnum := range fattest_parts {
+				if weights[pnum] >= diff {
+					continue
+				}
+				dist := diff/2 - weights[pnum]
+				if dist < 0 {
+					dist = -dist
+				}
+				if moved_idx == -1 || dist < moved_dist {
+					moved_idx, moved_dist = idx, dist
+				}
+			}
+			if moved_idx == -1 {
 				break // done
 			}
 			// move part
-			leanest_parts, fattest_parts := parts_per_rg[leanest_rgid], parts_per_rg[fattest_rgid]
-			moved_part := fattest_parts[len(fattest_parts)-1]
+			moved_part := fattest_parts[moved_idx]
 			tasks = append(tasks, commands.MoveTask{
 				SrcRgid:   fattest_rgid,
 				DstRgid:   leanest_rgid,
 				Schema:    table.Schema,
 				TableName: table.Relname,
 				Pnum:      moved_part,
+				GroupSize: weights[moved_part],
 			})
-			hl.Debugf("Planned moving pnum %d for table %s from rg %d to rg %d\n",
-				moved_part, table.Relname, fattest_rgid, leanest_rgid)
-			parts_per_rg[leanest_rgid] = append(leanest_parts, moved_part)
-			parts_per_rg[fattest_rgid] = fattest_parts[:len(fattest_parts)-1] // pop
+			hl.Debugf("Planned moving pnum %d for table %s (%d bytes with colocated) from rg %d to rg %d\n",
+				moved_part, table.Relname, weights[moved_part], fattest_rgid, leanest_rgid)
+			parts_per_rg[leanest_rgid] = append(parts_per_rg[leanest_rgid], moved_part)
+			parts_per_rg[fattest_rgid] = append(fattest_parts[:moved_idx], fattest_parts[moved_idx+1:]...)
+			load[leanest_rgid] += weights[moved_part]
+			load[fattest_rgid] -= weights[moved_part]
 			// move part of colocated tables
-			for _, ctable := range tables {
-				if ctable.ColocateWithSchema == table.Schema &&
-					ctable.ColocateWithRelname == table.Relname {
-					tasks = append(tasks, commands.MoveTask{
-						SrcRgid:   fattest_rgid,
-						DstRgid:   leanest_rgid,
-						Schema:    ctable.Schema,
-						TableName: ctable.Relname,
-						Pnum:      moved_part,
-					})
-				}
+			for _, ctable := range ctables {
+				tasks = append(tasks, commands.MoveTask{
+					SrcRgid:   fattest_rgid,
+					DstRgid:   leanest_rgid,
+					Schema:    ctable.Schema,
+					TableName: ctable.Relname,
+					Pnum:      moved_part,
+					GroupSize: weights[moved_part],
+				})
 			}
 		}
 	}
@@ -18,6 +18,35 @@ import (
 )
 
 func AddRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore, hpc *cluster.StoreConnInfo, newrg *cluster.RepGroup) error {
+	rgs, _, err := cs.GetRepGroups(ctx)
+	if err != nil {
+		return fmt.Errorf("Failed to get repgroups: %v", err)
+	}
+	newrgid := NextRepGroupId(rgs)
+	if err = PrepareRepGroup(ctx, hl, cs, hpc, newrg, newrgid); err != nil {
+		return err
+	}
+	return RegisterRepGroup(ctx, hl, cs, newrg, newrgid)
+}
+
+// Id for next added repgroup; n-th of simultaneously added ones should get
+// NextRepGroupId() + n
+func NextRepGroupId(rgs map[int]*cluster.RepGroup) int {
+	var newrgid int = 0
+	for rgid, _ := range rgs {
+		if rgid > newrgid {
+			newrgid = rgid
+		}
+	}
+	return newrgid + 1
+}
+
+// Adding repgroup consists of two parts. First, new rg is prepared: it gets
+// extension, rgid and schema with metadata from some existing rg. This
+// doesn't touch the rest of the cluster, so many repgroups can be prepared
+// concurrently. Then RegisterRepGroup makes everyone know about it; that must
+// be done one by one.
+func PrepareRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore, hpc *cluster.StoreConnInfo, newrg *cluster.RepGroup, newrgid int) error {
 	cldata, _, err := cs.GetClusterData(ctx)
 	if err != nil {
 		return fmt.Errorf("cannot get cluster data: %v", err)
@@ -60,16 +89,14 @@ func AddRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore
 	if err != nil {
 		return fmt.Errorf("Failed to get repgroups: %v", err)
 	}
-	var newrgid int = 0
 	for rgid, rg := range rgs {
 		if rg.SysId == newrg.SysId {
 			return fmt.Errorf("Repgroup with sys id %v already exists", rg.SysId)
 		}
-		if rgid > newrgid {
-			newrgid = rgid
+		if rgid == newrgid {
+			return fmt.Errorf("Repgroup with id %d already exists", rgid)
 		}
 	}
-	newrgid++
 
 	// stamp rgid in config
 	err = cluster.StolonUpdate(hpc, newrg, newrgid, true, &cldata.Spec.StolonSpec)
@@ -168,6 +195,30 @@ func AddRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore
 
 		break
 	}
+	return nil
+}
+
+// Register prepared repgroup newrg in the cluster: create foreign servers
+// and user mappings between it and all other rgs and save it in the store
+func RegisterRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore, newrg *cluster.RepGroup, newrgid int) error {
+	cldata, _, err := cs.GetClusterData(ctx)
+	if err != nil {
+		return fmt.Errorf("cannot get cluster data: %v", err)
+	}
+	if cldata == nil {
+		return fmt.Errorf("cluster data not found in the store")
+	}
+	// might include rgs registered after newrg was prepared
+	rgs, _, err := cs.GetRepGroups(ctx)
+	if err != nil {
+		return fmt.Errorf("Failed to get repgroups: %v", err)
+	}
+	if rgs == nil {
+		rgs = make(map[int]*cluster.RepGroup)
+	}
+	if _, ok := rgs[newrgid]; ok {
+		return fmt.Errorf("Repgroup with id %d already exists", newrgid)
+	}
 
 	rgs[newrgid] = newrg
 	bcst, err := pg.NewBroadcaster(cs, rgs, cldata)
@@ -202,8 +253,9 @@ func AddRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore
 		rgfsopts, _ := pg.FormForeignServerOpts(rgconnstrmap)
 		bcst.Push(newrgid, fmt.Sprintf("drop server if exists %s cascade", pg.FSI(rgid)))
 		bcst.Push(newrgid, fmt.Sprintf("create server %s foreign data wrapper shardman_postgres_fdw %s", pg.FSI(rgid), rgfsopts))
-		bcst.Push(newrgid, fmt.Sprintf("update shardman.repgroups set srvid = (select oid from pg_foreign_server where srvname = %s) where id = %d",
-			pg.FSL(rgid), rgid))
+		// rg might be registered after newrg got its dump
+		bcst.Push(newrgid, fmt.Sprintf("insert into shardman.repgroups values (%d, (select oid from pg_foreign_server where srvname = %s)) on conflict (id) do update set srvid = excluded.srvid",
+			rgid, pg.FSL(rgid)))
 		bcst.Push(rgid, fmt.Sprintf("drop server if exists %s cascade", pg.FSI(newrgid)))
 		bcst.Push(rgid, fmt.Sprintf("create server %s foreign data wrapper shardman_postgres_fdw %s", pg.FSI(newrgid), newrgfsopts))
 		bcst.Push(rgid, fmt.Sprintf("insert into shardman.repgroups values (%d, (select oid from pg_foreign_server where srvname = %s))",
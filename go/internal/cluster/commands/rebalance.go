@@ -7,6 +7,7 @@ import (
 	"fmt"
 	"os"
 	"os/signal"
+	"sort"
 	"syscall"
 	"time"
 
@@ -18,6 +19,33 @@ import (
 	"postgrespro.ru/shardman/internal/pg"
 )
 
+// DefaultCopyStreams is the default number of connections copying the
+// initial data of each moved partition in parallel
+const DefaultCopyStreams = 4
+
+// Parallel copy sends rows to destination in batches of this size
+const copyBatchRows = 10000
+
+// Don't start another copy stream for less than this many blocks
+const copyMinBlocksPerStream = 1024
+
+// DefaultCatchupThreshold is the default replication lag in bytes below
+// which writes to the moved partition are blocked for the final sync
+const DefaultCatchupThreshold = 1024 * 1024
+
+// Bounds of the interval at which workers check the progress. Within them,
+// the interval adapts to how fast the progress is.
+const (
+	minPollInterval = 20 * time.Millisecond
+	maxPollInterval = 2 * time.Second
+	// writes are blocked during the final sync, so check it often
+	fullSyncPollInterval = 10 * time.Millisecond
+)
+
+// DefaultMaxMovesPerRg is the default limit of partitions simultaneously
+// moved from or to one repgroup
+const DefaultMaxMovesPerRg = 2
+
 type MoveTask struct {
 	SrcRgid    int
 	srcConnstr string
@@ -26,6 +54,9 @@ type MoveTask struct {
 	Schema     string
 	TableName  string
 	Pnum       int
+	// Size of the partition together with colocated ones moved along; used
+	// to order moves, 0 if unknown
+	GroupSize int64
 }
 
 func min(x, y int) int {
@@ -50,10 +81,20 @@ type report struct {
 	id  int
 }
 
+// parallel initial copy of partition in progress
+type parallelCopy struct {
+	// replication connection which created the slot; keeps the snapshot
+	// exported for the copy alive
+	rc     *pgx.ReplicationConn
+	cancel context.CancelFunc
+	done   chan error // receives the result once all streams are finished
+}
+
 // movepart worker state machine
 const (
 	movePartWorkerIdle = iota
 	movePartWorkerConnsEstablished
+	movePartWorkerParallelCopy
 	movePartWorkerWaitInitCopy
 	movePartWorkerWaitInitialCatchup
 	movePartWorkerWaitFullSync
@@ -63,10 +104,17 @@ const (
 // Attempt to clean up after ourselves. We try to leave everything clean and
 // consistent at least if rebalance was stopped by signal and all pgs were
 // healthy.
-func rwcleanup(rwLog *zap.SugaredLogger, src_conn **pgx.Conn, dst_conn **pgx.Conn, task *MoveTask, state int, id int) error {
+func rwcleanup(rwLog *zap.SugaredLogger, src_conn **pgx.Conn, dst_conn **pgx.Conn, pcopy **parallelCopy, task *MoveTask, state int, id int) error {
 	var err error
 	var report_err error = nil
 	rwLog.Debugf("rwcleanup: state is %v", state)
+	if *pcopy != nil {
+		// stop the copy streams and release the snapshot
+		(*pcopy).cancel()
+		<-(*pcopy).done
+		(*pcopy).rc.Close()
+		*pcopy = nil
+	}
 	if state < movePartWorkerConnsEstablished {
 		goto CLOSE_CONNS // nothing to do except for closing conns
 	}
@@ -85,6 +133,14 @@ func rwcleanup(rwLog *zap.SugaredLogger, src_conn **pgx.Conn, dst_conn **pgx.Con
 		report_err = err
 	}
 
+	// slot created for parallel copy, if subscription didn't take it
+	_, err = (*src_conn).Exec(fmt.Sprintf("select shardman.drop_repslot('hp_copy_%d', true)",
+		id))
+	if err != nil {
+		rwLog.Errorf("cleanup: drop slot failed: %v", err)
+		report_err = err
+	}
+
 	_, err = (*src_conn).Exec(fmt.Sprintf("drop publication if exists hp_copy_%d",
 		id))
 	if err != nil {
@@ -122,13 +178,246 @@ CLOSE_CONNS:
 	return report_err
 }
 
+func connectConnstr(connstr string) (*pgx.Conn, error) {
+	connconfig, err := pgx.ParseConnectionString(connstr)
+	if err != nil {
+		return nil, err
+	}
+	return pgx.Connect(connconfig)
+}
+
+// Copy the rows of the partition matching cond to destination, reading them
+// with the given snapshot. Rows travel in their text form and are parsed
+// back by destination's record input, so any column types will do.
+func copyPartRange(ctx context.Context, task *MoveTask, snapshot string, cond string) (int64, error) {
+	var ncopied int64 = 0
+	var part = pg.QI(fmt.Sprintf("%s_%d", task.TableName, task.Pnum))
+
+	src_conn, err := connectConnstr(task.srcConnstr)
+	if err != nil {
+		return 0, err
+	}
+	defer src_conn.Close()
+	dst_conn, err := connectConnstr(task.dstConnstr)
+	if err != nil {
+		return 0, err
+	}
+	defer dst_conn.Close()
+
+	_, err = src_conn.ExecEx(ctx, "begin isolation level repeatable read", nil)
+	if err != nil {
+		return 0, err
+	}
+	_, err = src_conn.ExecEx(ctx, fmt.Sprintf("set transaction snapshot %s", pg.QL(snapshot)), nil)
+	if err != nil {
+		return 0, err
+	}
+	// range is a fraction of the table, which planner would rather seqscan
+	if cond != "" {
+		_, err = src_conn.ExecEx(ctx, "set local enable_seqscan to off", nil)
+		if err != nil {
+			return 0, err
+		}
+	}
+	// lost data is recopied anyway if we fail
+	_, err = dst_conn.ExecEx(ctx, "set synchronous_commit to off", nil)
+	if err != nil {
+		return 0, err
+	}
+
+	rows, err := src_conn.QueryEx(ctx, fmt.Sprintf("select t::text from %s t%s", part, cond), nil)
+	if err != nil {
+		return 0, err
+	}
+	defer rows.Close()
+	var insert = fmt.Sprintf("insert into %s select * from unnest($1::text[]::%s[])", part, part)
+	var batch = make([]string, 0, copyBatchRows)
+	for {
+		var more = rows.Next()
+		if more {
+			var row string
+			if err = rows.Scan(&row); err != nil {
+				return ncopied, err
+			}
+			batch = append(batch, row)
+		} else if err = rows.Err(); err != nil {
+			return ncopied, err
+		}
+		if len(batch) == copyBatchRows || (!more && len(batch) > 0) {
+			if _, err = dst_conn.ExecEx(ctx, insert, nil, batch); err != nil {
+				return ncopied, err
+			}
+			ncopied += int64(len(batch))
+			batch = batch[:0]
+		}
+		if !more {
+			return ncopied, nil
+		}
+	}
+}
+
+// Find the leading column of partition's btree index, preferably of primary
+// key, and up to n-1 values splitting it into n ranges of about the same
+// size, taken from the column's histogram. Empty column is returned if there
+// is no such index or no statistics for it.
+func copySplitPoints(conn *pgx.Conn, part string, n int) (string, []string, error) {
+	_, err := conn.Exec(fmt.Sprintf("analyze %s", part))
+	if err != nil {
+		return "", nil, err
+	}
+	var col string
+	var hist []string
+	err = conn.QueryRow(`select a.attname, s.histogram_bounds::text::text[]
+		from pg_index i
+		join pg_class ic on ic.oid = i.indexrelid
+		join pg_am am on am.oid = ic.relam and am.amname = 'btree'
+		join pg_class c on c.oid = i.indrelid
+		join pg_namespace ns on ns.oid = c.relnamespace
+		join pg_attribute a on a.attrelid = i.indrelid and a.attnum = i.indkey[0]
+		join pg_stats s on s.schemaname = ns.nspname and s.tablename = c.relname and s.attname = a.attname
+		where i.indrelid = $1::regclass and i.indkey[0] <> 0 and i.indpred is null and
+			s.histogram_bounds is not null
+		order by i.indisprimary desc, i.indisunique desc
+		limit 1`, part).Scan(&col, &hist)
+	if err == pgx.ErrNoRows {
+		return "", nil, nil
+	}
+	if err != nil {
+		return "", nil, err
+	}
+	var bounds []string
+	for i := 1; i < n; i++ {
+		b := hist[len(hist)*i/n]
+		if len(bounds) == 0 || bounds[len(bounds)-1] != b {
+			bounds = append(bounds, b)
+		}
+	}
+	return col, bounds, nil
+}
+
+// Create the slot for replicating the partition and copy its contents as of
+// the slot's snapshot over several connections, each taking its own range of
+// the partition's index. Once all the data is copied, subscription created on
+// the slot replicates changes made since then.
+func startParallelCopy(rwLog *zap.SugaredLogger, src_conn *pgx.Conn, task *MoveTask, nstreams int, id int) (*parallelCopy, error) {
+	var part = pg.QI(fmt.Sprintf("%s_%d", task.TableName, task.Pnum))
+	connconfig, err := pgx.ParseConnectionString(task.srcConnstr)
+	if err != nil {
+		return nil, err
+	}
+	rc, err := pgx.ReplicationConnect(connconfig)
+	if err != nil {
+		return nil, err
+	}
+	_, snapshot, err := rc.CreateReplicationSlotEx(fmt.Sprintf("hp_copy_%d", id), "pgoutput")
+	if err != nil {
+		rc.Close()
+		return nil, err
+	}
+
+	var nblocks int64
+	err = src_conn.QueryRow(fmt.Sprintf("select pg_relation_size(%s::regclass) / current_setting('block_size')::int",
+		pg.QL(part))).Scan(&nblocks)
+	if err != nil {
+		rc.Close()
+		return nil, err
+	}
+	if nblocks/copyMinBlocksPerStream < int64(nstreams) {
+		nstreams = int(nblocks/copyMinBlocksPerStream) + 1
+	}
+	// Ranges must be served by an index: PG11 can't scan a range of ctids,
+	// so each stream would read the whole table.
+	var col string
+	var bounds []string
+	if nstreams > 1 {
+		col, bounds, err = copySplitPoints(src_conn, part, nstreams)
+		if err != nil {
+			rc.Close()
+			return nil, err
+		}
+		if col == "" {
+			rwLog.Infof("no btree index with statistics on %s, copying in one stream", part)
+		}
+	}
+	var conds = []string{""}
+	for i, b := range bounds {
+		// NULLs go to the first range; the last one is open
+		var qcol = pg.QI(col)
+		if i == 0 {
+			conds[0] = fmt.Sprintf(" where (%s < %s or %s is null)", qcol, pg.QL(b), qcol)
+		} else {
+			conds[i] += fmt.Sprintf(" and %s < %s", qcol, pg.QL(b))
+		}
+		conds = append(conds, fmt.Sprintf(" where %s >= %s", qcol, pg.QL(b)))
+	}
+	nstreams = len(conds)
+	rwLog.Infof("copying %d blocks over %d streams", nblocks, nstreams)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	var pcopy = &parallelCopy{rc: rc, cancel: cancel, done: make(chan error, 1)}
+	var errs = make(chan error, nstreams)
+	for _, cond := range conds {
+		go func(cond string) {
+			ncopied, err := copyPartRange(ctx, task, snapshot, cond)
+			rwLog.Debugf("copy stream%s done, %d rows copied", cond, ncopied)
+			errs <- err
+		}(cond)
+	}
+	go func() {
+		var err error = nil
+		for i := 0; i < nstreams; i++ {
+			if e := <-errs; e != nil && err == nil {
+				err = e
+				cancel() // no point in the rest
+			}
+		}
+		pcopy.done <- err
+	}()
+	return pcopy, nil
+}
+
+// Poll interval when nothing tells how soon the progress will come
+func backoffPoll(poll time.Duration) time.Duration {
+	poll *= 2
+	if poll > maxPollInterval {
+		poll = maxPollInterval
+	}
+	return poll
+}
+
+// Poll interval during the catchup: estimate when lag drops below the
+// threshold from the rate it decreased at since the previous check
+func catchupPoll(poll time.Duration, prev_lag int64, prev_lag_time time.Time, lag int64, now time.Time, threshold int64) time.Duration {
+	if prev_lag < 0 || lag >= prev_lag {
+		return backoffPoll(poll)
+	}
+	var rate = float64(prev_lag-lag) / now.Sub(prev_lag_time).Seconds()
+	poll = time.Duration(float64(lag-threshold) / rate * float64(time.Second))
+	if poll < minPollInterval {
+		poll = minPollInterval
+	}
+	if poll > maxPollInterval {
+		poll = maxPollInterval
+	}
+	return poll
+}
+
 // The communication is simple: worker starts with task, completes it, sends
 // report and receives from main worker another one. One exception:
 // when in chan is closed (no deadlock risks), worker must exit asap.
-func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report, myid int) {
+//
+// With copyStreams > 1, initial data is copied by us in parallel, see
+// startParallelCopy; otherwise by the subscription's tablesync worker.
+// Writes are blocked for the final sync once lag drops below
+// catchupThreshold bytes.
+func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report, myid int, copyStreams int, catchupThreshold int64) {
 	var state = movePartWorkerIdle
+	var poll = maxPollInterval
+	var prev_lag int64 = -1 // lag seen at previous catchup check, if any
+	var prev_lag_time time.Time
 	var src_conn *pgx.Conn = nil
 	var dst_conn *pgx.Conn = nil
+	var pcopy *parallelCopy = nil
 	var task MoveTask
 	var ok bool
 	var sync_lsn string
@@ -136,12 +425,17 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 	var rwLog *zap.SugaredLogger
 
 	for {
+		var copy_done <-chan error = nil // nil chan blocks forever
+		if pcopy != nil {
+			copy_done = pcopy.done
+		}
+
 		select {
 		case task, ok = <-in:
 			if !ok {
 				// done, no more tasks, or request to shut down
 				if state != movePartWorkerIdle {
-					err := rwcleanup(rwLog, &src_conn, &dst_conn, &task, state, myid)
+					err := rwcleanup(rwLog, &src_conn, &dst_conn, &pcopy, &task, state, myid)
 					out <- report{err: err, id: myid}
 				}
 				break
@@ -152,6 +446,8 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 			}
 			rwLog = wLog.With("table", task.TableName, "partition num", task.Pnum, "source rgid", task.SrcRgid, "dest rgid", task.DstRgid)
 			rwLog.Infof("got new task")
+			poll = minPollInterval
+			prev_lag = -1
 			var connconfig pgx.ConnConfig
 			connconfig, err := pgx.ParseConnectionString(task.srcConnstr)
 			if err != nil {
@@ -200,6 +496,15 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 				rwLog.Errorf("pub creation failed: %v", err)
 				goto ERR
 			}
+			if copyStreams > 1 {
+				pcopy, err = startParallelCopy(rwLog, src_conn, &task, copyStreams, myid)
+				if err != nil {
+					rwLog.Errorf("failed to start initial copy: %v", err)
+					goto ERR
+				}
+				state = movePartWorkerParallelCopy
+				continue
+			}
 			_, err = dst_conn.Exec(fmt.Sprintf("create subscription hp_copy_%d connection %s publication hp_copy_%d with (synchronous_commit=off)",
 				myid, pg.QL(task.srcConnstr), myid))
 			if err != nil {
@@ -212,10 +517,34 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 		ERR:
 			out <- report{err: err, id: myid}
 			err = nil
-			rwcleanup(rwLog, &src_conn, &dst_conn, &task, state, myid)
+			rwcleanup(rwLog, &src_conn, &dst_conn, &pcopy, &task, state, myid)
 			state = movePartWorkerIdle
 
-		case <-time.After(2 * time.Second):
+		case err := <-copy_done:
+			pcopy.rc.Close()
+			pcopy.cancel()
+			pcopy = nil
+			if err != nil {
+				rwLog.Errorf("initial copy failed: %v", err)
+				goto ERRCOPY
+			}
+			// data is here, replicate the rest from the slot
+			_, err = dst_conn.Exec(fmt.Sprintf("create subscription hp_copy_%d connection %s publication hp_copy_%d with (create_slot=false, slot_name='hp_copy_%d', copy_data=false, synchronous_commit=off)",
+				myid, pg.QL(task.srcConnstr), myid, myid))
+			if err != nil {
+				rwLog.Errorf("sub creation failed: %v", err)
+				goto ERRCOPY
+			}
+			state = movePartWorkerWaitInitialCatchup
+			continue
+
+		ERRCOPY:
+			out <- report{err: err, id: myid}
+			err = nil
+			rwcleanup(rwLog, &src_conn, &dst_conn, &pcopy, &task, state, myid)
+			state = movePartWorkerIdle
+
+		case <-time.After(poll):
 			var err error
 
 			if state == movePartWorkerWaitInitCopy {
@@ -228,6 +557,9 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 				}
 				if synced {
 					state = movePartWorkerWaitInitialCatchup
+					poll = minPollInterval
+				} else {
+					poll = backoffPoll(poll)
 				}
 				continue
 			}
@@ -239,8 +571,13 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 					rwLog.Errorf("%v", err)
 					goto ERRTMT
 				}
-				if lag > 1024*1024 {
-					continue /* lag is still too big */
+				if lag > catchupThreshold {
+					/* lag is still too big */
+					var now = time.Now()
+					poll = catchupPoll(poll, prev_lag, prev_lag_time, lag, now, catchupThreshold)
+					prev_lag = lag
+					prev_lag_time = now
+					continue
 				}
 				// ok, block writes and wait for full sync
 				_, err = src_conn.Exec(fmt.Sprintf("select shardman.write_protection_on(%s::regclass)",
@@ -256,6 +593,7 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 					goto ERRTMT
 				}
 				state = movePartWorkerWaitFullSync
+				poll = fullSyncPollInterval
 				continue
 			}
 			if state == movePartWorkerWaitFullSync {
@@ -294,6 +632,7 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 				/* done */
 				out <- report{err: nil, id: myid}
 				state = movePartWorkerIdle
+				poll = maxPollInterval
 				continue
 			}
 			// movePartWorkerIdle or movePartWorkerWaitCommit,
@@ -303,13 +642,19 @@ func movePartWorkerMain(hl *hplog.Logger, in <-chan MoveTask, out chan<- report,
 		ERRTMT:
 			out <- report{err: err, id: myid}
 			err = nil
-			rwcleanup(rwLog, &src_conn, &dst_conn, &task, state, myid)
+			rwcleanup(rwLog, &src_conn, &dst_conn, &pcopy, &task, state, myid)
 			state = movePartWorkerIdle
 		}
 	}
 }
 
-func Rebalance(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore, p int, tasks []MoveTask) error {
+// Move partitions according to tasks using at most p workers (-1 means
+// worker per task), with at most maxPerRg of them (0 means no limit) loading
+// the same repgroup as source or destination. Large moves are started first,
+// so that the small ones fill the gaps in the end instead of some huge one
+// running alone. Colocated partitions are planned next to each other and
+// share src and dst, so they are moved together.
+func Rebalance(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore, p int, maxPerRg int, copyStreams int, catchupThreshold int64, tasks []MoveTask) error {
 	// fill connstrs
 	connstrs, err := pg.GetSuConnstrs(ctx, cs)
 	if err != nil {
@@ -319,56 +664,106 @@ func Rebalance(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore,
 		tasks[i].srcConnstr = connstrs[task.SrcRgid]
 		tasks[i].dstConnstr = connstrs[task.DstRgid]
 	}
+	// stable, so that tasks of the same size keep planned order
+	sort.SliceStable(tasks, func(i, j int) bool {
+		return tasks[i].GroupSize > tasks[j].GroupSize
+	})
 
+	if p == -1 {
+		p = len(tasks)
+	}
 	var nworkers = min(p, len(tasks))
 	var chans = make(map[int]*movePartWorkerChans)
 	var reportch = make(chan report)
-	var active_workers = nworkers
+	var idle = make([]int, 0)            // workers waiting for task
+	var running = make(map[int]MoveTask) // worker id -> its task
+	var closed = make(map[int]bool)      // workers already shut down
+	var moves_per_rg = make(map[int]int) // rgid -> moves involving it
 	for i := 0; i < nworkers; i++ {
 		chans[i] = new(movePartWorkerChans)
 		chans[i].in = make(chan MoveTask)
 		chans[i].commit = make(chan bool)
-		go movePartWorkerMain(hl, chans[i].in, reportch, i)
-		chans[i].in <- tasks[len(tasks)-1] // push first task
-		tasks = tasks[:len(tasks)-1]
+		go movePartWorkerMain(hl, chans[i].in, reportch, i, copyStreams, catchupThreshold)
+		idle = append(idle, i)
+	}
+
+	var shutdown = func(id int) {
+		if !closed[id] {
+			close(chans[id].in)
+			closed[id] = true
+		}
 	}
+	// first pending task not overloading its repgroups
+	var takeTask = func() (MoveTask, bool) {
+		for i, task := range tasks {
+			if maxPerRg > 0 && (moves_per_rg[task.SrcRgid] >= maxPerRg ||
+				moves_per_rg[task.DstRgid] >= maxPerRg) {
+				continue
+			}
+			tasks = append(tasks[:i], tasks[i+1:]...)
+			return task, true
+		}
+		return MoveTask{}, false
+	}
+	// give tasks to idle workers while possible
+	var dispatch = func() {
+		for len(idle) != 0 {
+			task, ok := takeTask()
+			if !ok {
+				break
+			}
+			id := idle[len(idle)-1]
+			idle = idle[:len(idle)-1]
+			running[id] = task
+			moves_per_rg[task.SrcRgid]++
+			moves_per_rg[task.DstRgid]++
+			chans[id].in <- task
+		}
+		if len(tasks) == 0 { // nothing left for idle workers
+			for _, id := range idle {
+				shutdown(id)
+			}
+			idle = idle[:0]
+		}
+	}
+	var stop = func() {
+		for i := 0; i < nworkers; i++ {
+			shutdown(i)
+		}
+		idle = idle[:0]
+	}
+	dispatch()
 
 	var sigs = make(chan os.Signal, 1)
 	signal.Notify(sigs, syscall.SIGINT, syscall.SIGTERM)
 	var stopped = false
-	// We must continue looping until we get reports from all workers even
-	// after we get shutdown signal because some of them might be hanging
-	// in sending something to us
-	for active_workers != 0 {
+	// We must continue looping until we get reports from all running
+	// workers even after we get shutdown signal because some of them might
+	// be hanging in sending something to us
+	for len(running) != 0 {
 		select {
 		case report := <-reportch:
+			task := running[report.id]
+			delete(running, report.id)
+			moves_per_rg[task.SrcRgid]--
+			moves_per_rg[task.DstRgid]--
 			if report.err != nil {
 				err = report.err
 				// not much sense to continue after any error
 				if !stopped {
-					for i := 0; i < nworkers; i++ {
-						close(chans[i].in)
-					}
+					stop()
 					stopped = true
 				}
 			}
 			if stopped {
-				active_workers--
 				continue
 			}
-			if len(tasks) != 0 { // push next task
-				chans[report.id].in <- tasks[len(tasks)-1]
-				tasks = tasks[:len(tasks)-1]
-			} else { // or shut down worker
-				close(chans[report.id].in)
-				active_workers--
-			}
+			idle = append(idle, report.id)
+			dispatch()
 
 		case _ = <-sigs: // stop all workers immediately
 			hl.Infof("Stopping all workers")
-			for i := 0; i < nworkers; i++ {
-				close(chans[i].in)
-			}
+			stop()
 			stopped = true
 		}
 	}
@@ -49,7 +49,7 @@ func RmRepGroup(ctx context.Context, hl *hplog.Logger, cs *cluster.ClusterStore,
 	if len(movetasks) != 0 {
 		hl.Infof("Replication group being removed holds partitions; moving them")
 	}
-	if err = Rebalance(ctx, hl, cs, 1, movetasks); err != nil {
+	if err = Rebalance(ctx, hl, cs, 1, DefaultMaxMovesPerRg, DefaultCopyStreams, DefaultCatchupThreshold, movetasks); err != nil {
 		return fmt.Errorf("Failed to move tasks from removed repgroup: %v", err)
 	}
 
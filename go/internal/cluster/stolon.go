@@ -11,6 +11,7 @@ import (
 	"fmt"
 	"os/exec"
 	"path/filepath"
+	"sort"
 	"strconv"
 	"strings"
 	"time"
@@ -69,9 +70,18 @@ type StolonClusterData struct {
 	Proxy *Proxy         `json:"proxy"`
 }
 type DB struct {
+	Spec   *DBSpec  `json:"spec,omitempty"`
 	Status DBStatus `json:"status,omitempty"`
 }
+type DBSpec struct {
+	Role         string        `json:"role,omitempty"`
+	FollowConfig *FollowConfig `json:"followConfig,omitempty"`
+}
+type FollowConfig struct {
+	DBUID string `json:"dbuid,omitempty"`
+}
 type DBStatus struct {
+	Healthy       bool   `json:"healthy,omitempty"`
 	ListenAddress string `json:"listenAddress,omitempty"`
 	Port          string `json:"port,omitempty"`
 }
@@ -88,11 +98,15 @@ type Endpoint struct {
 	Port    string
 }
 
+// key of Stolon's clusterdata, which among other things says who is master
+func (ss *StolonStore) ClusterDataPath() string {
+	return filepath.Join(ss.storePath, "clusterdata")
+}
+
 func (ss *StolonStore) GetClusterData(ctx context.Context) (*StolonClusterData, error) {
 	var clusterData StolonClusterData
 
-	path := filepath.Join(ss.storePath, "clusterdata")
-	pair, err := ss.store.Get(ctx, path)
+	pair, err := ss.store.Get(ctx, ss.ClusterDataPath())
 	if err != nil {
 		return nil, err
 	}
@@ -125,6 +139,42 @@ func (ss *StolonStore) GetMaster(ctx context.Context) (*Endpoint, error) {
 	}
 }
 
+// Healthy standbys directly following current master, sorted so that the
+// list doesn't change while they don't. If there are none or there is no
+// cluster, returns nil, nil
+func (ss *StolonStore) GetStandbys(ctx context.Context) ([]*Endpoint, error) {
+	clusterData, err := ss.GetClusterData(ctx)
+	if err != nil {
+		return nil, err
+	}
+	if clusterData == nil {
+		return nil, nil
+	}
+
+	var standbys []*Endpoint
+	masterUID := clusterData.Proxy.Spec.MasterDBUID
+	for uid, db := range clusterData.DBs {
+		if uid == masterUID || db.Spec == nil || db.Spec.Role != "standby" ||
+			!db.Status.Healthy || db.Status.ListenAddress == "" {
+			continue
+		}
+		if db.Spec.FollowConfig == nil || db.Spec.FollowConfig.DBUID != masterUID {
+			continue
+		}
+		standbys = append(standbys, &Endpoint{
+			Address: db.Status.ListenAddress,
+			Port:    db.Status.Port,
+		})
+	}
+	sort.Slice(standbys, func(i, j int) bool {
+		if standbys[i].Address != standbys[j].Address {
+			return standbys[i].Address < standbys[j].Address
+		}
+		return standbys[i].Port < standbys[j].Port
+	})
+	return standbys, nil
+}
+
 // if no proxy available (but store is ok) returns nil, nil
 func (ss *StolonStore) GetProxy(ctx context.Context) (*Endpoint, error) {
 	return nil, fmt.Errorf("not implemented")
@@ -9,6 +9,7 @@ import (
 	"encoding/json"
 	"fmt"
 	"path/filepath"
+	"sort"
 	"strings"
 
 	etcdclientv3 "go.etcd.io/etcd/clientv3"
@@ -67,10 +68,14 @@ func NewClusterStore(cfg *ClusterStoreConnInfo) (*ClusterStore, error) {
 	return &ClusterStore{StorePath: storePath, Store: etcdstore, ClusterName: cfg.ClusterName}, nil
 }
 
+func (cs *ClusterStore) ClusterDataPath() string {
+	return filepath.Join(cs.StorePath, "clusterdata")
+}
+
 // Get global cluster data
 func (cs *ClusterStore) GetClusterData(ctx context.Context) (*ClusterData, *store.KVPair, error) {
 	var cldata = &ClusterData{}
-	path := filepath.Join(cs.StorePath, "clusterdata")
+	path := cs.ClusterDataPath()
 	pair, err := cs.Store.Get(ctx, path)
 	if err != nil {
 		return nil, nil, err
@@ -90,7 +95,7 @@ func (cs *ClusterStore) PutClusterData(ctx context.Context, cldata *ClusterData)
 	if err != nil {
 		return err
 	}
-	path := filepath.Join(cs.StorePath, "clusterdata")
+	path := cs.ClusterDataPath()
 	return cs.Store.Put(ctx, path, cldataj)
 }
 
@@ -131,6 +136,23 @@ func (cs *ClusterStore) PutRepGroups(ctx context.Context, rgs map[int]*RepGroup)
 // return cs.Store.Put(ctx, path, mastersj)
 // }
 
+// Keys in our store changed when repgroups are added or removed or their
+// masters switch, sorted. Stolon clusterdata is included only for repgroups
+// sharing our store.
+func (cs *ClusterStore) MastersWatchKeys(rgs map[int]*RepGroup) []string {
+	var keys = []string{
+		cs.ClusterDataPath(),
+		filepath.Join(cs.StorePath, "repgroups"),
+	}
+	for _, rg := range rgs {
+		if rg.StoreConnInfo.Endpoints == "" {
+			keys = append(keys, NewStolonStoreFromExisting(rg, cs.Store).ClusterDataPath())
+		}
+	}
+	sort.Strings(keys)
+	return keys
+}
+
 func (cs *ClusterStore) Close() error {
 	return cs.Store.Close()
 }
@@ -197,21 +219,12 @@ func (mue MasterUnavailableError) Error() string {
 // Get current connstr for this rg as map of libpq options
 // if no master available, returns MasterUnavailableError
 func (cs *ClusterStore) GetSuConnstrMap(ctx context.Context, rg *RepGroup, cldata *ClusterData) (map[string]string, error) {
-	// if this rg has separate store, connect to it
-	var ss *StolonStore
-	if rg.StoreConnInfo.Endpoints != "" {
-		var err error
-		ss, err = NewStolonStore(rg)
-		if err != nil {
-			return nil, err
-		}
-		defer ss.Close()
-	} else {
-		// otherwise, use our
-		ss = NewStolonStoreFromExisting(rg, cs.Store)
+	ss, release, err := cs.stolonStore(rg)
+	if err != nil {
+		return nil, err
 	}
+	defer release()
 
-	var err error
 	var ep *Endpoint
 	if cldata.Spec.UseProxy {
 		ep, err = ss.GetProxy(ctx)
@@ -236,3 +249,28 @@ func (cs *ClusterStore) GetSuConnstrMap(ctx context.Context, rg *RepGroup, cldat
 	}
 	return cp, nil
 }
+
+// Get healthy standbys of this rg's master, empty if there are none
+func (cs *ClusterStore) GetStandbys(ctx context.Context, rg *RepGroup) ([]*Endpoint, error) {
+	ss, release, err := cs.stolonStore(rg)
+	if err != nil {
+		return nil, err
+	}
+	defer release()
+
+	return ss.GetStandbys(ctx)
+}
+
+// Stolon store of the rg; release must be called when done with it
+func (cs *ClusterStore) stolonStore(rg *RepGroup) (ss *StolonStore, release func(), err error) {
+	// if this rg has separate store, connect to it
+	if rg.StoreConnInfo.Endpoints != "" {
+		ss, err = NewStolonStore(rg)
+		if err != nil {
+			return nil, nil, err
+		}
+		return ss, func() { ss.Close() }, nil
+	}
+	// otherwise, use our
+	return NewStolonStoreFromExisting(rg, cs.Store), func() {}, nil
+}
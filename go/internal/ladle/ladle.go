@@ -11,6 +11,7 @@ import (
 	"time"
 
 	"github.com/jackc/pgx"
+	"go.etcd.io/etcd/clientv3"
 	"postgrespro.ru/shardman/internal/cluster"
 	"postgrespro.ru/shardman/internal/cluster/commands"
 	"postgrespro.ru/shardman/internal/hplog"
@@ -285,6 +286,7 @@ func (ls *LadleStore) AddNodes(ctx context.Context, hl *hplog.Logger, nodes []st
 
 	hl.Infof("Initting Stolon instances...")
 	newCloverIds := make([]int, 0)
+	newRgs := make([]*cluster.RepGroup, 0)
 	nNewClovers := len(nodes) / nCopies
 	// configure each new clover
 	for i := 0; i < nNewClovers; i++ {
@@ -326,15 +328,18 @@ func (ls *LadleStore) AddNodes(ctx context.Context, hl *hplog.Logger, nodes []st
 				// push the keeper
 				ldata.Layout[node].Keepers = append(ldata.Layout[node].Keepers, keeper)
 			}
-
-			// actually create stolon instance
-			err = cluster.StolonInit(ldata.Spec.StoreConnInfo, &rg, &cldata.Spec.StolonSpec, ldata.Spec.StolonBinPath)
-			if err != nil {
-				return err
-			}
+			newRgs = append(newRgs, &rg)
 		}
 	}
 
+	// actually create stolon instances
+	err = forEachRepGroup(newRgs, func(rg *cluster.RepGroup) error {
+		return cluster.StolonInit(ldata.Spec.StoreConnInfo, rg, &cldata.Spec.StolonSpec, ldata.Spec.StolonBinPath)
+	})
+	if err != nil {
+		return err
+	}
+
 	// add monitors, if needed
 	for _, node := range nodes {
 		if ldata.MonitorsNum >= *ldata.Spec.MonitorsNum {
@@ -350,83 +355,118 @@ func (ls *LadleStore) AddNodes(ctx context.Context, hl *hplog.Logger, nodes []st
 	}
 
 	// now, before actually adding repgroups, we must wait until keepers get
-	// up and running, which takes quite a bit of time
+	// up and running, which takes quite a bit of time. Wait for all rgs and
+	// prepare them concurrently, only registration in the cluster goes one by
+	// one.
 	hl.Infof("Waiting for keepers/proxies to start... make sure bowl daemons are running on the nodes")
-	for _, cloverId := range newCloverIds {
-		clover := ldata.Clovers[cloverId]
-		for _, master := range clover {
-			rgName := fmt.Sprintf("clover-%d-%s", cloverId, master)
-			rg := cluster.RepGroup{
-				StolonName: rgName,
-				// always use single (shardman) store
-				StoreConnInfo: cluster.StoreConnInfo{Endpoints: ""},
-				StorePrefix:   "stolon/cluster",
-			}
-
-			var conn *pgx.Conn = nil
-			for {
-				var err error
-				var connstr string
-				var connconfig pgx.ConnConfig
-				var inRecovery bool
-
-				connstr, err = pg.GetSuConnstr(ctx, ls.ClusterStore, &rg, cldata)
-				if err != nil {
-					if _, ok := err.(cluster.MasterUnavailableError); ok {
-						goto notAvailableYet
-					}
-					return fmt.Errorf("failed to check connstring of new rg: %v", err)
-				}
+	rgs, _, err := ls.GetRepGroups(ctx)
+	if err != nil {
+		return fmt.Errorf("failed to get rgs: %v", err)
+	}
+	firstRgid := commands.NextRepGroupId(rgs)
+	var rgids = make(map[*cluster.RepGroup]int)
+	for i, rg := range newRgs {
+		rgids[rg] = firstRgid + i
+	}
+	err = forEachRepGroup(newRgs, func(rg *cluster.RepGroup) error {
+		if err := ls.waitRepGroupReady(ctx, hl, rg, cldata); err != nil {
+			return err
+		}
+		hl.Infof("Preparing repgroup %v", rg.StolonName)
+		return commands.PrepareRepGroup(ctx, hl, ls.ClusterStore, ldata.Spec.StoreConnInfo, rg, rgids[rg])
+	})
+	if err != nil {
+		return err
+	}
 
-				connconfig, err = pgx.ParseConnectionString(connstr)
-				if err != nil {
-					return fmt.Errorf("connstring parsing \"%s\" failed: %v", connstr, err) // should not happen
-				}
-				conn, err = pgx.Connect(connconfig)
-				if err != nil {
-					goto notAvailableYet
-				}
+	hl.Infof("Adding repgroups...")
+	for _, rg := range newRgs {
+		err = commands.RegisterRepGroup(ctx, hl, ls.ClusterStore, rg, rgids[rg])
+		if err != nil {
+			return err
+		}
+	}
 
-				// run something, just in case...
-				err = conn.QueryRow("select pg_is_in_recovery()").Scan(&inRecovery)
-				if err != nil || inRecovery {
-					// actually, should never be in recovery here
-					goto notAvailableYet
-				}
+	return nil
+}
 
-				// done
-				conn.Close()
-				break
-			notAvailableYet:
-				if conn != nil {
-					conn.Close()
-					conn = nil
-				}
-				hl.Infof("Waiting for keepers/proxies of rg %s to start... err: %v", rgName, err)
-				time.Sleep(2 * time.Second)
-			}
+// Run f for all rgs concurrently, returning the first error
+func forEachRepGroup(rgs []*cluster.RepGroup, f func(rg *cluster.RepGroup) error) error {
+	var errs = make(chan error, len(rgs))
+	for _, rg := range rgs {
+		go func(rg *cluster.RepGroup) {
+			errs <- f(rg)
+		}(rg)
+	}
+	var err error = nil
+	for i := 0; i < len(rgs); i++ {
+		if e := <-errs; e != nil && err == nil {
+			err = e
 		}
 	}
+	return err
+}
 
-	hl.Infof("Adding repgroups...")
-	for _, cloverId := range newCloverIds {
-		clover := ldata.Clovers[cloverId]
-		for _, master := range clover {
-			rgName := fmt.Sprintf("clover-%d-%s", cloverId, master)
-			rg := cluster.RepGroup{
-				StolonName: rgName,
-				// always use single (shardman) store
-				StoreConnInfo: cluster.StoreConnInfo{Endpoints: ""},
-				StorePrefix:   "stolon/cluster",
+// Stolon might publish master a bit before it accepts connections, so
+// besides watching clusterdata recheck readiness with this interval
+const rgReadyRecheckInterval = 2 * time.Second
+
+// Wait until rg master accepts connections. Sentinel publishes keepers
+// state in Stolon clusterdata, so we recheck readiness whenever it changes.
+func (ls *LadleStore) waitRepGroupReady(ctx context.Context, hl *hplog.Logger, rg *cluster.RepGroup, cldata *cluster.ClusterData) error {
+	// start watching before the first check to not miss anything
+	wctx, cancel := context.WithCancel(clientv3.WithRequireLeader(ctx))
+	defer cancel()
+	ss := cluster.NewStolonStoreFromExisting(rg, ls.Store)
+	watchCh := ls.Store.GetClient().Watch(wctx, ss.ClusterDataPath())
+
+	for {
+		var conn *pgx.Conn = nil
+		var err error
+		var connstr string
+		var connconfig pgx.ConnConfig
+		var inRecovery bool
+
+		connstr, err = pg.GetSuConnstr(ctx, ls.ClusterStore, rg, cldata)
+		if err != nil {
+			if _, ok := err.(cluster.MasterUnavailableError); ok {
+				goto notAvailableYet
 			}
-			err = commands.AddRepGroup(ctx, hl, ls.ClusterStore, ldata.Spec.StoreConnInfo, &rg)
-			if err != nil {
-				return err
+			return fmt.Errorf("failed to check connstring of new rg: %v", err)
+		}
+
+		connconfig, err = pgx.ParseConnectionString(connstr)
+		if err != nil {
+			return fmt.Errorf("connstring parsing \"%s\" failed: %v", connstr, err) // should not happen
+		}
+		conn, err = pgx.Connect(connconfig)
+		if err != nil {
+			goto notAvailableYet
+		}
+
+		// run something, just in case...
+		err = conn.QueryRow("select pg_is_in_recovery()").Scan(&inRecovery)
+		conn.Close()
+		if err != nil || inRecovery {
+			// actually, should never be in recovery here
+			goto notAvailableYet
+		}
+		return nil // done
+
+	notAvailableYet:
+		hl.Infof("Waiting for keepers/proxies of rg %s to start... err: %v", rg.StolonName, err)
+		select {
+		case <-ctx.Done():
+			return ctx.Err()
+		case wresp, ok := <-watchCh:
+			if !ok || wresp.Canceled {
+				// rely on rechecks only; nil chan blocks forever
+				hl.Warnf("store (watch) failed: %v", wresp.Err())
+				watchCh = nil
 			}
+		case <-time.After(rgReadyRecheckInterval):
 		}
 	}
-
-	return nil
 }
 
 // make sure that stolon instances are created for all replication groups
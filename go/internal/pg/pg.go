@@ -49,10 +49,15 @@ type RollbackPrepared struct {
 	gid string
 }
 
+// Statements of xact (between Begin and Commit/Prepare) are not executed
+// one by one: they are queued and sent together with BEGIN and
+// COMMIT/PREPARE as one simple query, so the whole xact takes one round
+// trip. Rows they return are not collected then.
 func broadcastConnMain(in <-chan interface{}, resch chan<- resT, reportch chan<- report, connstr string, myid int) {
 	var report = report{err: nil, id: myid}
 	var res *string = nil
-	var tx *pgx.Tx = nil
+	var in_xact = false
+	var queue []string // statements of current xact, starting with BEGIN
 	var prepare_exists = false
 
 	connconfig, err := pgx.ParseConnectionString(connstr)
@@ -69,20 +74,15 @@ func broadcastConnMain(in <-chan interface{}, resch chan<- resT, reportch chan<-
 	for msg := range in {
 		switch msg := msg.(type) {
 		case Begin:
-			if report.err == nil {
-				tx, err = conn.Begin()
-				if err != nil {
-					report.err = fmt.Errorf("BEGIN failed: %v", err)
-				}
-			}
+			in_xact = true
+			queue = []string{"begin"}
 		case Commit:
 			// Commit if everything is ok; otherwise just report last error
 			if report.err == nil {
-				err = tx.Commit()
-				if err != nil {
-					report.err = fmt.Errorf("COMMIT failed: %v", err)
-				}
+				report.err = execXact(conn, append(queue, "commit"))
 			}
+			in_xact = false
+			queue = nil
 			if report.err == nil && res != nil {
 				resch <- resT{res: *res, id: myid}
 			}
@@ -90,12 +90,13 @@ func broadcastConnMain(in <-chan interface{}, resch chan<- resT, reportch chan<-
 			report.err = nil
 		case Prepare:
 			if report.err == nil {
-				_, err = conn.Exec(fmt.Sprintf("prepare transaction '%s'", msg.gid))
-				if err != nil {
-					report.err = fmt.Errorf("PREPARE failed: %v", err)
-				}
-				prepare_exists = true
+				report.err = execXact(conn,
+					append(queue, fmt.Sprintf("prepare transaction '%s'", msg.gid)))
+				// if anything failed, xact is aborted without prepare
+				prepare_exists = report.err == nil
 			}
+			in_xact = false
+			queue = nil
 			if report.err == nil && res != nil {
 				resch <- resT{res: *res, id: myid}
 			}
@@ -131,6 +132,10 @@ func broadcastConnMain(in <-chan interface{}, resch chan<- resT, reportch chan<-
 			}
 		case string:
 			sql := msg
+			if in_xact {
+				queue = append(queue, sql)
+				continue
+			}
 			// Run always Query instead of bookkeeping whether we should
 			// Exec or Query. Testing shows it works.
 			if report.err == nil {
@@ -155,6 +160,23 @@ func broadcastConnMain(in <-chan interface{}, resch chan<- resT, reportch chan<-
 	}
 }
 
+// Run stmts of xact, starting with BEGIN and ending with COMMIT or PREPARE,
+// as one simple query; user statements might contain several commands
+// themselves, which extended protocol (and so pgx batch) doesn't allow.
+// Server skips the rest after the first failure, leaving aborted xact block.
+func execXact(conn *pgx.Conn, stmts []string) error {
+	sql := strings.Join(stmts, ";\n")
+	_, err := conn.Exec(sql)
+	if err != nil {
+		if conn.TxStatus != 'I' {
+			// don't leave aborted xact block behind
+			conn.Exec("rollback")
+		}
+		return fmt.Errorf("sql \n%v\n failed: %v", sql, err)
+	}
+	return nil
+}
+
 func NewBroadcaster(cs *cluster.ClusterStore, rgs map[int]*cluster.RepGroup, cldata *cluster.ClusterData) (*Broadcaster, error) {
 	var bcst = Broadcaster{conns: map[int]*BroadcastConn{}}
 
@@ -340,24 +362,79 @@ func FormUserMappingOpts(p map[string]string) (string, error) {
 	}
 	return fmt.Sprintf("%s)", res), nil
 }
-func FormForeignServerOpts(p map[string]string) (string, error) {
+
+// Options of foreign server pointing to rg with connstr p
+func ForeignServerOpts(p map[string]string) (map[string]string, error) {
 	if _, ok := p["dbname"]; !ok {
-		return "", fmt.Errorf("dbname not specified")
+		return nil, fmt.Errorf("dbname not specified")
 	}
 	if _, ok := p["host"]; !ok {
-		return "", fmt.Errorf("host not specified")
+		return nil, fmt.Errorf("host not specified")
 	}
 	if _, ok := p["port"]; !ok {
-		return "", fmt.Errorf("port not specified")
+		return nil, fmt.Errorf("port not specified")
+	}
+
+	// async_capable lets scans of partitions living on different
+	// repgroups run concurrently; all nodes run the same build, so builtin
+	// types can be transferred in binary
+	return map[string]string{
+		"dbname":        p["dbname"],
+		"host":          p["host"],
+		"port":          p["port"],
+		"async_capable": "true",
+		"binary_format": "true",
+	}, nil
+}
+
+// Value of standby_hosts option of foreign server: host:port list which
+// postgres_fdw may send scans of read-only transactions to
+func StandbyHostsOpt(standbys []*cluster.Endpoint) string {
+	var hosts []string
+	for _, ep := range standbys {
+		hosts = append(hosts, fmt.Sprintf("%s:%s", ep.Address, ep.Port))
 	}
+	return strings.Join(hosts, ",")
+}
 
-	res := fmt.Sprintf("options (dbname %s, host %s, port '%s')",
-		QL(p["dbname"]),
-		QL(p["host"]),
-		p["port"])
+func FormForeignServerOpts(p map[string]string) (string, error) {
+	opts, err := ForeignServerOpts(p)
+	if err != nil {
+		return "", err
+	}
+	res := fmt.Sprintf("options (dbname %s, host %s, port %s, async_capable %s, binary_format %s)",
+		QL(opts["dbname"]),
+		QL(opts["host"]),
+		QL(opts["port"]),
+		QL(opts["async_capable"]),
+		QL(opts["binary_format"]))
 	return res, nil
 }
 
+// Form ALTER SERVER changing options curr of server srvname to opts in one
+// go; other options of the server are left as is. Returns empty string if
+// nothing needs to be changed.
+func FormAlterForeignServer(srvname string, curr map[string]string, opts map[string]string) string {
+	var keys []string
+	for k, _ := range opts {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+
+	var changes []string
+	for _, k := range keys {
+		if v, ok := curr[k]; !ok {
+			changes = append(changes, fmt.Sprintf("add %s %s", QI(k), QL(opts[k])))
+		} else if v != opts[k] {
+			changes = append(changes, fmt.Sprintf("set %s %s", QI(k), QL(opts[k])))
+		}
+	}
+	if len(changes) == 0 {
+		return ""
+	}
+	return fmt.Sprintf("alter server %s options (%s)", QI(srvname), strings.Join(changes, ", "))
+}
+
 // PG's quote_identifier. FIXME keywords
 func QI(ident string) string {
 	var safe = true
@@ -485,3 +562,56 @@ pg_namespace cn on (cn.oid = cc.relnamespace);`)
 	}
 	return tables, nil
 }
+
+// Identifies partition of sharded table
+type PartKey struct {
+	Schema  string
+	Relname string
+	Pnum    int
+}
+
+// Get total size (with indexes and toast) of each partition. Every repgroup
+// is asked about the partitions it holds.
+func GetPartSizes(ctx context.Context, cs *cluster.ClusterStore) (map[PartKey]int64, error) {
+	connstrs, err := GetSuConnstrs(ctx, cs)
+	if err != nil {
+		return nil, err
+	}
+
+	var sizes = make(map[PartKey]int64)
+	for rgid, connstr := range connstrs {
+		connconfig, err := pgx.ParseConnectionString(connstr)
+		if err != nil {
+			return nil, err
+		}
+		conn, err := pgx.Connect(connconfig)
+		if err != nil {
+			return nil, fmt.Errorf("Unable to connect to database: %v", err)
+		}
+		rows, err := conn.Query(
+			`select n.nspname, c.relname, p.pnum,
+coalesce(pg_total_relation_size(to_regclass(quote_ident(c.relname || '_' || p.pnum))), 0)
+from shardman.parts p join pg_class c on (p.rel = c.oid) join
+pg_namespace n on (c.relnamespace = n.oid) where p.rgid = $1`, rgid)
+		if err != nil {
+			conn.Close()
+			return nil, err
+		}
+		for rows.Next() {
+			var key PartKey
+			var size int64
+			if err = rows.Scan(&key.Schema, &key.Relname, &key.Pnum, &size); err != nil {
+				rows.Close()
+				conn.Close()
+				return nil, err
+			}
+			sizes[key] = size
+		}
+		err = rows.Err()
+		conn.Close()
+		if err != nil {
+			return nil, err
+		}
+	}
+	return sizes, nil
+}
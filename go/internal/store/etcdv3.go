@@ -60,6 +60,32 @@ func (s *EtcdV3Store) Get(pctx context.Context, key string) (*KVPair, error) {
 		LastIndex: uint64(kv.ModRevision)}, nil
 }
 
+// Get several keys atomically. Pairs are returned in keys order, nil for
+// absent keys, together with store revision the reads were made at.
+func (s *EtcdV3Store) GetMany(pctx context.Context, keys ...string) ([]*KVPair, int64, error) {
+	var ops []etcdclientv3.Op
+	for _, key := range keys {
+		ops = append(ops, etcdclientv3.OpGet(key))
+	}
+	ctx, cancel := context.WithTimeout(pctx, requestTimeout)
+	resp, err := s.c.Txn(ctx).Then(ops...).Commit()
+	cancel()
+	if err != nil {
+		return nil, 0, err
+	}
+	pairs := make([]*KVPair, len(keys))
+	for i, r := range resp.Responses {
+		kvs := r.GetResponseRange().Kvs
+		if len(kvs) == 0 {
+			continue
+		}
+		kv := kvs[0]
+		pairs[i] = &KVPair{Key: string(kv.Key), Value: kv.Value,
+			LastIndex: uint64(kv.ModRevision)}
+	}
+	return pairs, resp.Header.Revision, nil
+}
+
 func (s *EtcdV3Store) Close() error {
 	return s.c.Close()
 }